@@ -0,0 +1,182 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <string>
+#include <unordered_map>
+#include "Admission.h"
+#include "DiskWriter.h"
+#include "Metrics.h"
+#include "Protocol.h"
+
+// Dead entries in the per-client map are swept out once it grows past this,
+// and past twice what was left alive after the last sweep.
+const size_t CLIENT_SWEEP_MIN = 1024;
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+: _rate(rate), _burst(burst), _tokens(burst), _refilledAt(monotonicMicros())
+{
+}
+
+void TokenBucket::refill(uint64_t now)
+{
+  if (now > _refilledAt) {
+    _tokens += (now - _refilledAt) * _rate / 1e6;
+    if (_tokens > _burst)
+      _tokens = _burst;
+  }
+  _refilledAt = now;
+}
+
+void TokenBucket::take(size_t bytes)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  refill(monotonicMicros());
+  _tokens -= bytes;
+}
+
+unsigned TokenBucket::millisUntilClear()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  refill(monotonicMicros());
+  if (_tokens >= 0)
+    return 0;
+  return (unsigned)(-_tokens * 1000 / _rate) + 1;
+}
+
+static unsigned maxConnections = 0;
+static bool refuseWhenFull = false;
+static std::atomic<unsigned> openConnections(0);
+static std::mutex roomLock;
+static std::condition_variable roomFreed;
+static std::atomic<unsigned> waiters(0);
+
+static uint64_t clientRate = 0;
+static uint64_t rateBurst = 0;
+static TokenBucket* total = nullptr;
+
+static std::mutex clientsLock;
+static std::unordered_map<std::string, std::weak_ptr<TokenBucket>> clients;
+static size_t sweepAt = CLIENT_SWEEP_MIN;
+
+void Admission::configure(const ServerConfig& config)
+{
+  maxConnections = config.maxConnections;
+  refuseWhenFull = config.refuseWhenFull;
+  clientRate = config.clientRate;
+  rateBurst = config.rateBurst;
+  if (config.totalRate > 0)
+    total = new TokenBucket(config.totalRate, config.rateBurst);
+}
+
+bool Admission::enter()
+{
+  unsigned open = openConnections.fetch_add(1) + 1;
+  if (maxConnections > 0 && open > maxConnections) {
+    openConnections--;
+    return false;
+  }
+  return true;
+}
+
+void Admission::leave()
+{
+  openConnections--;
+  if (waiters > 0) {
+    std::lock_guard<std::mutex> guard(roomLock);
+    roomFreed.notify_all();
+  }
+}
+
+bool Admission::hasRoom()
+{
+  return maxConnections == 0 || openConnections < maxConnections;
+}
+
+void Admission::waitForRoom(unsigned millis)
+{
+  waiters++;
+  {
+    std::unique_lock<std::mutex> lock(roomLock);
+    roomFreed.wait_for(lock, std::chrono::milliseconds(millis), []() { return hasRoom(); });
+  }
+  waiters--;
+}
+
+bool Admission::refusing()
+{
+  return refuseWhenFull;
+}
+
+// The peer's address without the port, so every connection from one host
+// shares a bucket.
+static std::string peerAddress(int fd)
+{
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr*)&addr, &len) == -1)
+    return std::string();
+
+  char text[INET6_ADDRSTRLEN];
+  const void* ip;
+  if (addr.ss_family == AF_INET6)
+    ip = &((struct sockaddr_in6*)&addr)->sin6_addr;
+  else
+    ip = &((struct sockaddr_in*)&addr)->sin_addr;
+  if (inet_ntop(addr.ss_family, ip, text, sizeof(text)) == nullptr)
+    return std::string();
+  return text;
+}
+
+std::shared_ptr<TokenBucket> Admission::clientBucket(int fd)
+{
+  if (clientRate == 0)
+    return nullptr;
+  std::string peer = peerAddress(fd);
+
+  std::lock_guard<std::mutex> guard(clientsLock);
+  std::shared_ptr<TokenBucket> bucket = clients[peer].lock();
+  if (bucket == nullptr) {
+    // A host that comes back after all its connections closed starts
+    // over with a full bucket; that is at most one burst early.
+    bucket = std::make_shared<TokenBucket>(clientRate, rateBurst);
+    clients[peer] = bucket;
+  }
+
+  if (clients.size() >= sweepAt) {
+    for (auto it = clients.begin(); it != clients.end();) {
+      if (it->second.expired())
+        it = clients.erase(it);
+      else
+        ++it;
+    }
+    sweepAt = std::max(CLIENT_SWEEP_MIN, 2 * clients.size());
+  }
+  return bucket;
+}
+
+TokenBucket* Admission::totalBucket()
+{
+  return total;
+}
+
+uint64_t Admission::burst()
+{
+  return rateBurst;
+}
+
+void shedConnection(int clientfd)
+{
+  // A resumable client takes BUSY as "try again" and reconnects; anyone
+  // else just sees the connection close. The socket is fresh, so the reply
+  // fits in its buffer.
+  std::string encoded = encodeUploadReply(UploadReply(REPLY_BUSY));
+  send(clientfd, encoded.data(), encoded.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+  close(clientfd);
+  Metrics::count(Metrics::SHED);
+}
@@ -0,0 +1,71 @@
+#ifndef _admission_
+#define _admission_
+
+#include <memory>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ServerConfig.h"
+
+// How long a backend that stopped accepting waits before it looks again;
+// a slot freed on another thread doesn't wake it.
+const unsigned ADMISSION_RETRY_MS = 20;
+
+// Bytes per second, with room for a burst. Whatever a recv() brought in is
+// charged after the fact and may leave the bucket in debt; the connection
+// then waits that out, so no read size has to be guessed up front.
+class TokenBucket
+{
+private:
+	std::mutex _lock;
+	double _rate;			// bytes per second
+	double _burst;
+	double _tokens;
+	uint64_t _refilledAt;		// monotonic us
+
+	void refill(uint64_t now);
+
+public:
+	TokenBucket(uint64_t rate, uint64_t burst);
+
+	void take(size_t bytes);
+	// 0 once the bucket is out of debt
+	unsigned millisUntilClear();
+};
+
+// Who gets in, and how fast they may send. A cap on open connections, with
+// the ones past it either left in the listen queue until a slot frees up or
+// turned away with REPLY_BUSY; and token buckets, one per client address and
+// one for the whole server, charged as bytes come off the sockets.
+//
+// The first burst of every file never waits on the server-wide bucket. Small
+// uploads go straight through while the bulk ones, which are charged for
+// them, slow down instead; the per-client buckets apply to everything.
+class Admission
+{
+public:
+	static void configure(const ServerConfig& config);
+
+	// A slot for one more connection, false when at the limit; every
+	// Connection gives its slot back when it is destroyed.
+	static bool enter();
+	static void leave();
+	static bool hasRoom();
+	// until there is room or millis passed
+	static void waitForRoom(unsigned millis);
+	// at the limit: true to refuse newcomers, false to leave them queued
+	static bool refusing();
+
+	// The bucket for fd's peer address, shared by all its connections;
+	// null without a per-client rate.
+	static std::shared_ptr<TokenBucket> clientBucket(int fd);
+	// null without a server-wide rate
+	static TokenBucket* totalBucket();
+	static uint64_t burst();
+};
+
+// Accepted over the limit: tell the client to come back later and hang up.
+void shedConnection(int clientfd);
+
+#endif
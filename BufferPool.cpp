@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "BufferPool.h"
+
+static BufferPool* sharedPool = nullptr;
+
+static size_t pageSize()
+{
+  long size = sysconf(_SC_PAGESIZE);
+  return size > 0 ? size : 4096;
+}
+
+BufferPool::BufferPool(size_t bufferSize, size_t maxCached)
+: _maxCached(maxCached), _hits(0), _misses(0), _outstanding(0), _allocated(0), _highWater(0)
+{
+  // whole pages only, so O_DIRECT and the page cache both like them
+  size_t page = pageSize();
+  _bufferSize = (bufferSize + page - 1) / page * page;
+}
+
+BufferPool::~BufferPool()
+{
+  for (char* buf : _free)
+    free(buf);
+}
+
+char* BufferPool::borrow()
+{
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_free.empty()) {
+      char* buf = _free.back();
+      _free.pop_back();
+      _hits++;
+      _outstanding++;
+      return buf;
+    }
+  }
+
+  void* buf = nullptr;
+  if (posix_memalign(&buf, pageSize(), _bufferSize) != 0) {
+    perror("posix_memalign");
+    exit(EXIT_FAILURE);
+  }
+  _misses++;
+  _outstanding++;
+
+  size_t allocated = _allocated += _bufferSize;
+  size_t highWater = _highWater.load();
+  while (allocated > highWater && !_highWater.compare_exchange_weak(highWater, allocated))
+    ;
+  return (char*)buf;
+}
+
+void BufferPool::giveBack(char* buf)
+{
+  if (buf == nullptr)
+    return;
+  _outstanding--;
+
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (_free.size() < _maxCached) {
+      _free.push_back(buf);
+      return;
+    }
+  }
+  _allocated -= _bufferSize;
+  free(buf);
+}
+
+size_t BufferPool::bufferSize() const { return _bufferSize; }
+
+unsigned long long BufferPool::hits() const { return _hits; }
+
+unsigned long long BufferPool::misses() const { return _misses; }
+
+size_t BufferPool::outstanding() const { return _outstanding; }
+
+size_t BufferPool::allocatedBytes() const { return _allocated; }
+
+size_t BufferPool::highWaterBytes() const { return _highWater; }
+
+void BufferPool::configure(size_t bufferSize, size_t maxCached)
+{
+  // called once at startup, before any thread borrows
+  delete sharedPool;
+  sharedPool = new BufferPool(bufferSize, maxCached);
+}
+
+BufferPool& BufferPool::shared()
+{
+  if (sharedPool == nullptr)
+    sharedPool = new BufferPool(DEFAULT_BUFFER_SIZE, 1024);
+  return *sharedPool;
+}
+
+size_t parseSize(const char* arg)
+{
+  // plain bytes or with a k/m/g suffix
+  char* end;
+  unsigned long long size = strtoull(arg, &end, 10);
+  if (end == arg)
+    return 0;
+  switch (*end) {
+    case '\0':
+      return size;
+    case 'k': case 'K':
+      size <<= 10;
+      break;
+    case 'm': case 'M':
+      size <<= 20;
+      break;
+    case 'g': case 'G':
+      size <<= 30;
+      break;
+    default:
+      return 0;
+  }
+  return end[1] == '\0' ? size : 0;
+}
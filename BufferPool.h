@@ -0,0 +1,63 @@
+#ifndef _buffer_pool_
+#define _buffer_pool_
+
+#include <atomic>
+#include <mutex>
+#include <stddef.h>
+#include <vector>
+
+#ifndef DEFAULT_BUFFER_SIZE
+#define DEFAULT_BUFFER_SIZE (64 << 10)
+#endif
+
+// Process-wide pool of large page-aligned I/O buffers. A transfer borrows one
+// for as long as it is actively moving bytes and hands it back when the
+// socket runs dry, so idle connections hold no buffer at all and memory
+// tracks concurrent activity rather than connection count. Buffers are
+// never zeroed; whoever borrows one overwrites what it reads.
+class BufferPool
+{
+private:
+	size_t _bufferSize;
+	size_t _maxCached;		// free buffers kept around, the rest are released
+	std::mutex _lock;
+	std::vector<char*> _free;
+	std::atomic<unsigned long long> _hits;
+	std::atomic<unsigned long long> _misses;
+	std::atomic<size_t> _outstanding;
+	std::atomic<size_t> _allocated;
+	std::atomic<size_t> _highWater;
+
+public:
+	BufferPool(size_t bufferSize, size_t maxCached);
+	~BufferPool();
+
+	char* borrow();
+	void giveBack(char* buf);
+
+	size_t bufferSize() const;
+	unsigned long long hits() const;
+	unsigned long long misses() const;
+	size_t outstanding() const;
+	size_t allocatedBytes() const;
+	size_t highWaterBytes() const;
+
+	static void configure(size_t bufferSize, size_t maxCached);
+	static BufferPool& shared();
+
+	// Borrow for the lifetime of a scope.
+	class Lease {
+	private:
+		BufferPool& _pool;
+		char* _buf;
+	public:
+		Lease(BufferPool& pool) : _pool(pool), _buf(pool.borrow()) {}
+		~Lease() { _pool.giveBack(_buf); }
+		char* data() const { return _buf; }
+		size_t size() const { return _pool.bufferSize(); }
+	};
+};
+
+size_t parseSize(const char* arg);
+
+#endif
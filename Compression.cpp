@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include <ostream>
+#include "Compression.h"
+
+// A block has to come out at least this much smaller (1/16th) to be worth
+// inflating at the other end.
+const unsigned MIN_SAVING_SHIFT = 4;
+// After a block fails to shrink, the next few go out stored untried; the
+// number doubles up to this while the data stays incompressible.
+const unsigned MAX_BACKOFF = 32;
+
+uint64_t threadCpuMicros()
+{
+  struct timespec ts;
+  if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == -1)
+    return 0;
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void put32(char* p, uint32_t v)
+{
+  p[0] = (char)(v >> 24);
+  p[1] = (char)(v >> 16);
+  p[2] = (char)(v >> 8);
+  p[3] = (char)v;
+}
+
+static uint32_t get32(const char* p)
+{
+  const unsigned char* u = (const unsigned char*)p;
+  return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 | u[3];
+}
+
+static void reportStream(std::ostream& out, uint64_t raw, uint64_t wire, uint64_t blocks,
+                         uint64_t stored, uint64_t cpuMicros)
+{
+  out << raw << " -> " << wire << " bytes";
+  if (wire > 0)
+    out << " (" << (double)raw / wire << "x)";
+  out << ", " << stored << " of " << blocks << " blocks stored, "
+      << cpuMicros / 1000.0 << " ms CPU";
+}
+
+BlockPacker::BlockPacker(int level)
+: _level(level), _skip(0), _backoff(1), _rawBytes(0), _wireBytes(0), _blocks(0), _stored(0),
+  _cpuMicros(0) {}
+
+bool BlockPacker::pack(const char* data, size_t len, std::string& out)
+{
+  if (len == 0 || len > BLOCK_MAX) {
+    errno = EINVAL;
+    return false;
+  }
+  uint64_t started = threadCpuMicros();
+
+  uLongf packedLen = 0;
+  bool packed = false;
+  if (_skip > 0) {
+    _skip--;
+  } else {
+    _scratch.resize(compressBound(len));
+    packedLen = _scratch.size();
+    packed = compress2((Bytef*)&_scratch[0], &packedLen, (const Bytef*)data, len, _level) == Z_OK
+             && packedLen < len - (len >> MIN_SAVING_SHIFT);
+    if (packed) {
+      _backoff = 1;
+    } else {
+      // already compressed or random; stop paying for deflate for a while
+      _skip = _backoff;
+      _backoff = _backoff < MAX_BACKOFF ? _backoff * 2 : MAX_BACKOFF;
+    }
+  }
+
+  size_t payload = packed ? packedLen : len;
+  out.resize(BLOCK_HEADER_LEN + payload);
+  put32(&out[0], len);
+  put32(&out[4], payload);
+  memcpy(&out[BLOCK_HEADER_LEN], packed ? _scratch.data() : data, payload);
+
+  _rawBytes += len;
+  _wireBytes += out.size();
+  _blocks++;
+  if (!packed)
+    _stored++;
+  _cpuMicros += threadCpuMicros() - started;
+  return true;
+}
+
+void BlockPacker::report(std::ostream& out) const
+{
+  out << "compressed ";
+  reportStream(out, _rawBytes, _wireBytes, _blocks, _stored, _cpuMicros);
+}
+
+BlockUnpacker::BlockUnpacker(uint64_t limit)
+: _rawBytes(0), _wireBytes(0), _blocks(0), _stored(0), _cpuMicros(0), _limit(limit) {}
+
+// Total length of the block whose header is at p, or 0 if the header is bad.
+static size_t blockLength(const char* p)
+{
+  uint32_t rawLen = get32(p);
+  uint32_t packedLen = get32(p + 4);
+  if (rawLen == 0 || rawLen > BLOCK_MAX || packedLen == 0 || packedLen > rawLen)
+    return 0;
+  return BLOCK_HEADER_LEN + packedLen;
+}
+
+ssize_t BlockUnpacker::feed(const char* data, size_t len,
+                            const std::function<bool(const char*, size_t)>& sink)
+{
+  size_t given = len;
+  while (len > 0 && _rawBytes < _limit) {
+    if (_pending.empty() && len >= BLOCK_HEADER_LEN) {
+      // a block that came in whole is decoded straight out of data
+      size_t want = blockLength(data);
+      if (want == 0) {
+        errno = EPROTO;
+        return -1;
+      }
+      if (len >= want) {
+        if (!unpack(data, sink))
+          return -1;
+        data += want;
+        len -= want;
+        continue;
+      }
+    }
+
+    // otherwise collect it piece by piece, header first
+    size_t want = BLOCK_HEADER_LEN;
+    if (_pending.size() >= BLOCK_HEADER_LEN) {
+      want = blockLength(_pending.data());
+      if (want == 0) {
+        errno = EPROTO;
+        return -1;
+      }
+    }
+    size_t take = want - _pending.size() < len ? want - _pending.size() : len;
+    _pending.append(data, take);
+    data += take;
+    len -= take;
+    if (_pending.size() > BLOCK_HEADER_LEN && _pending.size() == want) {
+      if (!unpack(_pending.data(), sink))
+        return -1;
+      _pending.clear();
+    }
+  }
+  _wireBytes += given - len;
+  return given - len;
+}
+
+bool BlockUnpacker::unpack(const char* block, const std::function<bool(const char*, size_t)>& sink)
+{
+  uint32_t rawLen = get32(block);
+  uint32_t packedLen = get32(block + 4);
+  const char* payload = block + BLOCK_HEADER_LEN;
+  _blocks++;
+  _rawBytes += rawLen;
+
+  if (packedLen == rawLen) {
+    _stored++;
+    return sink(payload, rawLen);
+  }
+
+  uint64_t started = threadCpuMicros();
+  _raw.resize(rawLen);
+  uLongf outLen = rawLen;
+  int rc = uncompress((Bytef*)&_raw[0], &outLen, (const Bytef*)payload, packedLen);
+  _cpuMicros += threadCpuMicros() - started;
+  if (rc != Z_OK || outLen != rawLen) {
+    errno = EPROTO;
+    return false;
+  }
+  return sink(_raw.data(), rawLen);
+}
+
+void BlockUnpacker::report(std::ostream& out) const
+{
+  out << "compressed ";
+  reportStream(out, _rawBytes, _wireBytes, _blocks, _stored, _cpuMicros);
+}
@@ -0,0 +1,78 @@
+#ifndef _compression_
+#define _compression_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <sys/types.h>
+
+// The body of an UPLOAD_FLAG_COMPRESSED upload is a run of blocks, each
+// compressed on its own so either side can stop and start at a block edge:
+//
+//   0  rawLen     u32, bytes of file this block stands for (1 .. BLOCK_MAX)
+//   4  packedLen  u32, bytes of payload that follow; equal to rawLen when
+//                 the block is stored as is because it didn't shrink
+//   8  payload
+//
+// Only zlib's deflate is built in; the codec byte in the header leaves room
+// for faster codecs later.
+
+const size_t BLOCK_HEADER_LEN = 8;
+const size_t BLOCK_MAX = 16 << 20;
+
+// Microseconds of CPU the calling thread has used so far.
+uint64_t threadCpuMicros();
+
+// Client side: turns file data into framed blocks.
+class BlockPacker
+{
+private:
+	int _level;
+	std::string _scratch;
+	unsigned _skip;		// blocks left to send stored without trying
+	unsigned _backoff;		// how many to skip after the next failure
+	uint64_t _rawBytes;
+	uint64_t _wireBytes;
+	uint64_t _blocks;
+	uint64_t _stored;
+	uint64_t _cpuMicros;
+
+public:
+	explicit BlockPacker(int level);
+
+	// Replaces out with the block for data[0, len), len <= BLOCK_MAX.
+	bool pack(const char* data, size_t len, std::string& out);
+	void report(std::ostream& out) const;
+};
+
+// Server side: takes the body as it arrives, in pieces of any size, and
+// hands each decoded block to sink. A false from the sink stops it.
+class BlockUnpacker
+{
+private:
+	std::string _pending;	// header and payload of the block being received
+	std::string _raw;
+	uint64_t _rawBytes;
+	uint64_t _wireBytes;
+	uint64_t _blocks;
+	uint64_t _stored;
+	uint64_t _cpuMicros;
+	uint64_t _limit;		// raw bytes the stream carries
+
+	bool unpack(const char* block, const std::function<bool(const char*, size_t)>& sink);
+
+public:
+	explicit BlockUnpacker(uint64_t limit);
+
+	// Returns how much of data it used, which falls short of len only once
+	// the block that completes limit bytes has been decoded; whatever follows
+	// is the caller's. -1 with errno set on a malformed block or a failed sink.
+	ssize_t feed(const char* data, size_t len, const std::function<bool(const char*, size_t)>& sink);
+	// a block was cut off part way
+	bool partial() const { return !_pending.empty(); }
+	void report(std::ostream& out) const;
+};
+
+#endif
@@ -0,0 +1,980 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iostream>
+#include "Connection.h"
+#include "Crc32c.h"
+#include "Metrics.h"
+#include "TransferRegistry.h"
+
+bool setNonBlocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// Just accepted: how long the connection sat in the listen queue. The kernel
+// stamps a new socket when it is created off the handshake (or, with
+// TCP_DEFER_ACCEPT, off the first data), so "last received" is that wait, in
+// jiffies rounded to milliseconds.
+void recordAcceptWait(int clientfd)
+{
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  if (getsockopt(clientfd, IPPROTO_TCP, TCP_INFO, &info, &len) == 0)
+    Metrics::record(Metrics::ACCEPT_WAIT, (uint64_t)info.tcpi_last_data_recv * 1000);
+}
+
+// Socket -> pipe -> file without the bytes ever entering user space. One pipe
+// per thread is enough: it is always drained into the file before the next
+// splice, so it never holds data belonging to two connections.
+struct SplicePipe {
+  int _fds[2];
+  size_t _capacity;
+
+  SplicePipe() : _capacity(0)
+  {
+    _fds[0] = _fds[1] = -1;
+    reset();
+  }
+  ~SplicePipe() { release(); }
+
+  void release()
+  {
+    if (_fds[0] != -1) {
+      close(_fds[0]);
+      close(_fds[1]);
+    }
+    _fds[0] = _fds[1] = -1;
+  }
+
+  void reset()
+  {
+    release();
+    if (pipe2(_fds, O_CLOEXEC) == -1) {
+      _fds[0] = _fds[1] = -1;
+      return;
+    }
+    // a bigger pipe means fewer splice pairs per MB; the default is 64 KB
+    fcntl(_fds[1], F_SETPIPE_SZ, 1 << 20);
+    int size = fcntl(_fds[1], F_GETPIPE_SZ);
+    _capacity = size > 0 ? size : 65536;
+  }
+
+  bool ok() const { return _fds[0] != -1; }
+};
+
+static SplicePipe* threadPipe()
+{
+  static thread_local SplicePipe pipe;
+  return pipe.ok() ? &pipe : nullptr;
+}
+
+static bool writeAll(int fd, const char* buf, size_t nbytes, off_t offset)
+{
+  while (nbytes > 0) {
+    ssize_t bytesWritten = ::pwrite(fd, buf, nbytes, offset);
+    if (bytesWritten == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += bytesWritten;
+    nbytes -= bytesWritten;
+    offset += bytesWritten;
+  }
+  return true;
+}
+
+static void writeErrorMarker(int fd)
+{
+  // throw away what we got and leave the marker instead
+  const char *msg = "ERROR";
+  if (ftruncate(fd, 0) == -1 || pwrite(fd, msg, strlen(msg), 0) == -1)
+    perror("ERROR");
+}
+
+ReplyChannel::~ReplyChannel()
+{
+  flushLocked(true);
+  close(_fd);
+}
+
+void ReplyChannel::send(const UploadReply& reply)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _outbox += encodeUploadReply(reply);
+  flushLocked(false);
+}
+
+void ReplyChannel::flush()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  flushLocked(false);
+}
+
+void ReplyChannel::flushLocked(bool closing)
+{
+  // Replies are tiny and normally go out at once. A session client that
+  // isn't reading its acks fills the send buffer, though; what doesn't fit
+  // waits here for the next read, or a moment at close.
+  unsigned waits = 0;
+  while (!_outbox.empty()) {
+    ssize_t sent = ::send(_fd, _outbox.data(), _outbox.size(), MSG_NOSIGNAL);
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      struct pollfd pfd;
+      pfd.fd = _fd;
+      pfd.events = POLLOUT;
+      if (closing && waits++ < 10 && poll(&pfd, 1, 100) >= 0)
+        continue;
+      if (closing)
+        std::cerr << "ERROR: client never read " << _outbox.size() / UPLOAD_REPLY_LEN << " replies\n";
+      return;
+    }
+    if (sent == -1) {
+      perror("ERROR");
+      _outbox.clear();
+      return;
+    }
+    _outbox.erase(0, sent);
+    Metrics::count(Metrics::BYTES_SENT, sent);
+  }
+}
+
+Connection::Connection(int fd, std::function<std::string()> nextFilename, const ServerConfig& config)
+: _fd(fd), _ofd(-1), _state(RECEIVING), _queued(false), _nextFilename(nextFilename),
+  _splice(config.splice), _dedup(config.dedup), _session(false), _files(0),
+  _replies(std::make_shared<ReplyChannel>(fd)), _writeBehind(DiskWriter::shared() != nullptr),
+  _ring(nullptr), _direct(config.directIo && _writeBehind), _directFd(-1), _fill(nullptr), _fillLen(0), _fillOffset(0), _fillSince(0),
+  _acceptedAt(monotonicMicros()), _receivedAt(_acceptedAt), _heardFrom(false),
+  _clientBucket(Admission::clientBucket(fd)), _throttleMillis(0), _chunked(nullptr), _unpacker(nullptr), _maxFileSize(config.maxFileSize),
+  _startedAt(TimerWheel::nowMillis()), _lastActivity(_startedAt)
+{
+  Metrics::count(Metrics::ACCEPTED);
+  TransferRegistry::shared().sweep();
+  resetFile();
+  if (!openFile())
+    _state = CLOSED;
+}
+
+Connection::~Connection()
+{
+  finishFile(false);
+  if (_session)
+    std::cerr << "session ended after " << _files << " files\n";
+  // The writer finishes whatever is still queued and drops the ring after;
+  // the socket closes with the last reference to _replies.
+  if (_ring != nullptr)
+    _ring->release();
+  Metrics::count(Metrics::CLOSED);
+  Admission::leave();
+}
+
+void Connection::resetFile()
+{
+  _filename.clear();
+  _headerDone = false;
+  _header.clear();
+  _framed = false;
+  _ranged = false;
+  _resumable = false;
+  _transferId = 0;
+  _bodyOffset = 0;
+  _declaredSize = 0;
+  _rejected = false;
+  _checksummed = false;
+  _crc = 0;
+  _trailer.clear();
+  _totalBytesRead = 0;
+  _totalBytesWritten = 0;
+  _startedAt = TimerWheel::nowMillis();
+  _fileStartedAt = monotonicMicros();
+}
+
+bool Connection::openFile()
+{
+  // Never over an existing file; should the name be taken after all (the
+  // ID counter lost), take the next one.
+  do {
+    _filename = _nextFilename();
+    _ofd = open(_filename.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  } while (_ofd == -1 && errno == EEXIST);
+  std::cerr << "file = " << _filename << std::endl;
+  if (_ofd == -1) {
+    perror("ERROR");
+    return false;
+  }
+
+  if (_dedup && ChunkStore::shared() != nullptr) {
+    // chunking needs the bytes in user space
+    _chunked = new ChunkedFile(*ChunkStore::shared());
+    _splice = false;
+  }
+  return true;
+}
+
+bool Connection::finishFile(bool ack)
+{
+  if (_ofd == -1)
+    return false;
+  if (_totalBytesRead > 0 || _framed) {
+    Metrics::count(Metrics::FILES);
+    Metrics::record(Metrics::TRANSFER, monotonicMicros() - _fileStartedAt);
+  }
+
+  bool intact = verifyChecksum();
+  if (!intact)
+    _rejected = true;
+  if (!_rejected && !_headerDone && _header.size() < UPLOAD_MAGIC_LEN) {
+    // a raw upload too short to tell from the start of a header
+    if (!writeBody(_header.data(), _header.size()))
+      perror("ERROR");
+  }
+
+  bool stored = false;
+  if (_writeBehind && !_rejected && !_resumable && !_ranged && _chunked == nullptr
+      && (!_framed || _totalBytesWritten == _declaredSize)) {
+    // Nothing left to decide here, so don't wait for the writer: it closes
+    // the file after the last buffer and passes it on to be committed.
+    handOff(ack);
+    stored = true;
+  } else {
+    if (!drainWrites()) {
+      perror("ERROR");
+      _rejected = true;
+      intact = false;
+    }
+    if (_directFd != -1)
+      close(_directFd);
+    bool sync = false;
+    if (_resumable) {
+      finishResumable(intact);
+    } else if (_ranged) {
+      // the registry trims or marks the file once the ranges cover it
+      sync = !_rejected && _totalBytesWritten == _declaredSize;
+      TransferRegistry::shared().leave(_transferId, _bodyOffset, _totalBytesWritten, sync, _rejected);
+    } else if (_rejected) {
+      discard();
+    } else if (_chunked != nullptr) {
+      stored = storeManifest();
+    } else if (_framed && _totalBytesWritten < _declaredSize) {
+      // hand back the preallocated tail the client never sent
+      std::cerr << "ERROR: " << _filename << " ended after " << _totalBytesWritten
+                << " of " << _declaredSize << " declared bytes\n";
+      if (ftruncate(_ofd, _totalBytesWritten) == -1)
+        perror("ERROR");
+    } else {
+      stored = true;
+    }
+    commit(stored || sync, ack, stored);
+  }
+  _ofd = -1;
+  _directFd = -1;
+
+  if (_unpacker != nullptr) {
+    std::cerr << _filename << ": ";
+    _unpacker->report(std::cerr);
+    std::cerr << "\n";
+  }
+  delete _unpacker;
+  _unpacker = nullptr;
+  delete _chunked;
+  _chunked = nullptr;
+  return stored;
+}
+
+void Connection::handOff(bool ack)
+{
+  int fd = _ofd;
+  int directFd = _directFd;
+  std::string filename = _filename;
+  std::shared_ptr<ReplyChannel> replies;
+  if (ack)
+    replies = _replies;
+  uint64_t bytes = _totalBytesWritten;
+  uint64_t since = monotonicMicros();
+
+  flushFill([fd, directFd, filename, replies, bytes, since](int error) {
+    if (directFd != -1)
+      close(directFd);
+    if (error != 0) {
+      std::cerr << "ERROR: " << filename << ": " << strerror(error) << "\n";
+      writeErrorMarker(fd);
+    }
+    std::function<void(bool)> done;
+    if (replies) {
+      done = [replies, bytes, error](bool durable) {
+        replies->send(UploadReply(error == 0 && durable ? REPLY_DONE : REPLY_REFUSED, bytes));
+      };
+    }
+    Committer::shared().submit(fd, done, since);
+  });
+}
+
+void Connection::commit(bool sync, bool ack, bool stored)
+{
+  // _ofd goes with it, synced first if asked to
+  int fd = _ofd;
+  if (!sync) {
+    close(fd);
+    fd = -1;
+    if (!ack)
+      return;
+  }
+
+  std::function<void(bool)> done;
+  if (ack) {
+    std::shared_ptr<ReplyChannel> replies = _replies;
+    uint64_t bytes = _totalBytesWritten;
+    done = [replies, bytes, stored](bool durable) {
+      replies->send(UploadReply(stored && durable ? REPLY_DONE : REPLY_REFUSED, bytes));
+    };
+  }
+  Committer::shared().submit(fd, done, monotonicMicros());
+}
+
+bool Connection::fileComplete() const
+{
+  return _headerDone && _framed && _totalBytesRead == _declaredSize
+         && (!_checksummed || _trailer.size() == UPLOAD_TRAILER_LEN);
+}
+
+void Connection::nextFile()
+{
+  // The ack goes out once the file is durable, without waiting for the
+  // client to ask; it reads them back in the order it sent the files.
+  finishFile(true);
+  _files++;
+  resetFile();
+}
+
+ssize_t Connection::consume(const char* data, size_t len)
+{
+  size_t left = len;
+  while (left > 0) {
+    ssize_t used;
+    if (!_headerDone) {
+      used = consumeHeader(data, left);
+      if (used < 0)
+        return -1;
+    } else {
+      used = receiveBody(data, left);
+      if (used < 0)
+        return -1;
+      if ((size_t)used < left && !_session) {
+        _rejected = true;
+        errno = EPROTO;		// more than the header promised
+        return -1;
+      }
+    }
+    data += used;
+    left -= used;
+
+    // in a session whatever follows is the next file's header
+    if (_session && fileComplete())
+      nextFile();
+    else if (!_headerDone)
+      break;		// the header isn't all here yet
+  }
+  return len;
+}
+
+ssize_t Connection::consumeHeader(const char* data, size_t len)
+{
+  size_t held = _header.size();
+  _header.append(data, len);
+
+  UploadHeader header;
+  int headerLen = parseUploadHeader(_header.data(), _header.size(), header);
+  if (headerLen == HEADER_INCOMPLETE)
+    return len;
+
+  if (headerLen == HEADER_ABSENT && _files > 0) {
+    // every file in a session is framed
+    _rejected = true;
+    errno = EPROTO;
+    return -1;
+  }
+  if (headerLen == HEADER_ABSENT) {
+    // A raw upload; bytes held back from earlier reads are body after all.
+    _headerDone = true;
+    std::string prefix;
+    prefix.swap(_header);
+    if (held > 0 && (!acceptBody(held) || !writeBody(prefix.data(), held)))
+      return -1;
+    return 0;
+  }
+
+  if (_ofd == -1 && !openFile())
+    return -1;
+
+  int refusal = 0;
+  if (headerLen == HEADER_INVALID || (header.flags & ~UPLOAD_FLAGS_KNOWN) != 0
+      || (header.flags & UPLOAD_FLAG_RANGE && header.flags & UPLOAD_FLAG_RESUMABLE)
+      || (header.flags & UPLOAD_FLAG_SESSION && header.flags & (UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE))
+      || (header.flags & UPLOAD_FLAG_COMPRESSED && header.codec != CODEC_DEFLATE))
+    refusal = EPROTO;
+  else if (_maxFileSize > 0 && header.fileSize > _maxFileSize)
+    refusal = EFBIG;
+  if (refusal != 0) {
+    // a resumable or compressing client is waiting to hear back before it
+    // sends anything, a session client for every file's ack
+    if (headerLen > 0 && (_files > 0 || header.flags & UPLOAD_FLAG_SESSION))
+      acknowledge(UploadReply(REPLY_REFUSED));
+    else if (headerLen > 0 && header.flags & (UPLOAD_FLAG_RESUMABLE | UPLOAD_FLAG_COMPRESSED))
+      sendReply(UploadReply(REPLY_REFUSED));
+    _rejected = true;
+    errno = refusal;
+    return -1;
+  }
+
+  _headerDone = true;
+  _framed = true;
+  _declaredSize = header.fileSize;
+  _header.clear();
+
+  bool created = true;
+  if (_chunked != nullptr && header.flags & (UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE)) {
+    // both write at offsets, which a chunk stream can't do; keep a plain file
+    delete _chunked;
+    _chunked = nullptr;
+  }
+
+  if (header.flags & UPLOAD_FLAG_RANGE) {
+    std::string filename = _filename;
+    int fd = TransferRegistry::shared().join(header, _ofd, filename, created);
+    if (fd == -1) {
+      _rejected = true;
+      return -1;
+    }
+    if (!created) {
+      // another stream already owns the output file
+      abandonFile();
+      _ofd = fd;
+      _filename = filename;
+    }
+    _ranged = true;
+    _transferId = header.transferId;
+    _bodyOffset = header.rangeOffset;
+    _declaredSize = header.rangeLength;
+    std::cerr << _filename << ": \"" << header.name << "\" bytes " << header.rangeOffset
+              << "-" << header.rangeOffset + header.rangeLength << " of " << header.fileSize << "\n";
+  } else if (header.flags & UPLOAD_FLAG_RESUMABLE) {
+    if (!resume(header, created))
+      return -1;
+  } else {
+    std::cerr << _filename << ": \"" << header.name << "\", " << header.fileSize << " bytes\n";
+  }
+
+  // Reserve the whole file now so a burst of big uploads doesn't interleave
+  // their extents, and so a full disk is noticed before any body arrives.
+  if (created && _chunked == nullptr && header.fileSize > 0 && fallocate(_ofd, 0, 0, header.fileSize) == -1
+      && errno != EOPNOTSUPP && errno != ENOSYS) {
+    _rejected = true;
+    return -1;
+  }
+
+  if (header.flags & UPLOAD_FLAG_COMPRESSED) {
+    // the bytes have to be inflated in user space before they hit the file
+    _unpacker = new BlockUnpacker(_declaredSize);
+    _splice = false;
+  }
+  if (header.flags & UPLOAD_FLAG_CHECKSUM) {
+    // and summed, which splice would hide from us too
+    _checksummed = true;
+    _splice = false;
+  }
+  if (header.flags & UPLOAD_FLAG_SESSION) {
+    // splice can't stop where one file ends and the next header starts
+    _session = true;
+    _splice = false;
+  }
+
+  // Nothing in a session waits for a go-ahead, that would cost a round
+  // trip per file; the client learns of a refusal from the file's ack.
+  if (_resumable || (_unpacker != nullptr && !_session))
+    sendReply(UploadReply(REPLY_RESUME, _bodyOffset));
+  return headerLen - held;
+}
+
+bool Connection::resume(const UploadHeader& header, bool& created)
+{
+  TransferRegistry& registry = TransferRegistry::shared();
+  if (!registry.claim(header.transferId)) {
+    // the connection this one replaces hasn't timed out yet
+    sendReply(UploadReply(REPLY_BUSY));
+    abandonFile();
+    errno = EBUSY;
+    return false;
+  }
+  _resumable = true;
+  _transferId = header.transferId;
+
+  TransferRegistry::Checkpoint checkpoint;
+  if (registry.loadCheckpoint(_transferId, checkpoint) && checkpoint._fileSize == header.fileSize
+      && checkpoint._committed <= header.fileSize) {
+    int fd = open(checkpoint._filename.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd != -1) {
+      abandonFile();
+      _ofd = fd;
+      _filename = checkpoint._filename;
+      _bodyOffset = checkpoint._committed;
+      created = false;
+    }
+  }
+
+  if (created) {
+    checkpoint._filename = _filename;
+    checkpoint._fileSize = header.fileSize;
+    checkpoint._committed = 0;
+    if (!registry.saveCheckpoint(_transferId, checkpoint))
+      perror("ERROR");
+  }
+
+  _declaredSize = header.fileSize - _bodyOffset;
+  std::cerr << _filename << ": \"" << header.name << "\", " << header.fileSize << " bytes";
+  if (_bodyOffset > 0)
+    std::cerr << ", resuming at " << _bodyOffset;
+  std::cerr << "\n";
+  return true;
+}
+
+void Connection::finishResumable(bool intact)
+{
+  // Only bytes that made it through fdatasync count as stored; the client
+  // trusts the offset it gets back and won't send them again. Bytes that
+  // failed the checksum don't count at all, so they get sent again.
+  TransferRegistry& registry = TransferRegistry::shared();
+  uint64_t fileSize = _bodyOffset + _declaredSize;
+  uint64_t stored = _bodyOffset;
+  if (intact) {
+    if (fdatasync(_ofd) == 0)
+      stored += _totalBytesWritten;
+    else
+      perror("ERROR");
+  }
+
+  if (stored == fileSize) {
+    registry.dropCheckpoint(_transferId);
+    sendReply(UploadReply(REPLY_DONE, stored));
+  } else {
+    TransferRegistry::Checkpoint checkpoint;
+    checkpoint._filename = _filename;
+    checkpoint._fileSize = fileSize;
+    checkpoint._committed = stored;
+    if (!registry.saveCheckpoint(_transferId, checkpoint))
+      perror("ERROR");
+    std::cerr << "ERROR: " << _filename << " stopped at " << stored << " of " << fileSize
+              << " bytes, kept for resuming\n";
+  }
+  registry.release(_transferId);
+}
+
+bool Connection::storeManifest()
+{
+  // The bytes are in the chunk store; the upload's own file lists the
+  // chunks that make it up, in order.
+  if (!_chunked->finish()) {
+    perror("ERROR");
+    discard();
+    return false;
+  }
+  const std::string& manifest = _chunked->manifest();
+  if (!writeAll(_ofd, manifest.data(), manifest.size(), 0)) {
+    perror("ERROR");
+    Metrics::count(Metrics::WRITE_ERRORS);
+    return false;
+  }
+  _chunked->report(_filename);
+  return true;
+}
+
+void Connection::abandonFile()
+{
+  // the file opened at accept time, before we knew it wasn't needed
+  close(_ofd);
+  unlink(_filename.c_str());
+  _ofd = -1;
+}
+
+void Connection::sendReply(const UploadReply& reply)
+{
+  _replies->send(reply);
+}
+
+void Connection::acknowledge(const UploadReply& reply)
+{
+  // Behind the acks of the files before it, which may still be on their
+  // way through the ring and the committer.
+  std::shared_ptr<ReplyChannel> replies = _replies;
+  std::function<void(bool)> done = [replies, reply](bool) { replies->send(reply); };
+  uint64_t since = monotonicMicros();
+  if (_ring == nullptr) {
+    Committer::shared().submit(-1, done, since);
+    return;
+  }
+  _ring->push(-1, nullptr, 0, 0, 0, [done, since](int) { Committer::shared().submit(-1, done, since); });
+}
+
+bool Connection::acceptBody(size_t len)
+{
+  _totalBytesRead += len;
+  if (_framed && _totalBytesRead > _declaredSize) {
+    _rejected = true;
+    errno = EPROTO;		// more than the header promised
+    return false;
+  }
+  if (_maxFileSize > 0 && _totalBytesRead > _maxFileSize) {
+    _rejected = true;
+    errno = EFBIG;
+    return false;
+  }
+  return true;
+}
+
+ssize_t Connection::copyToFile(char* buf, size_t size)
+{
+  ssize_t bytesRead = recv(_fd, buf, size, 0);
+  if (bytesRead <= 0)
+    return bytesRead;
+  received(bytesRead);
+  if (consume(buf, bytesRead) < 0)
+    return -1;
+  return bytesRead;
+}
+
+ssize_t Connection::receiveBody(const char* data, size_t len)
+{
+  size_t body;
+  if (_unpacker != nullptr) {
+    // quota and declared size count the bytes as they land in the file
+    ssize_t used = _unpacker->feed(data, len, [this](const char* raw, size_t rawLen) {
+      return acceptBody(rawLen) && writeBody(raw, rawLen);
+    });
+    if (used < 0)
+      return -1;
+    body = used;
+  } else {
+    body = bodyPart(len);
+    if (body > 0 && (!acceptBody(body) || !writeBody(data, body)))
+      return -1;
+  }
+  return body + takeTrailer(data + body, len - body);
+}
+
+size_t Connection::bodyPart(size_t len) const
+{
+  // A raw or single framed upload takes everything; past the declared size
+  // acceptBody() refuses it.
+  if (!_checksummed && !_session)
+    return len;
+  uint64_t left = _declaredSize - _totalBytesRead;
+  return len < left ? len : left;
+}
+
+size_t Connection::takeTrailer(const char* data, size_t len)
+{
+  if (!_checksummed)
+    return 0;
+  size_t take = UPLOAD_TRAILER_LEN - _trailer.size();
+  if (take > len)
+    take = len;
+  _trailer.append(data, take);
+  return take;
+}
+
+void Connection::checksum(const char* data, size_t len)
+{
+  if (_checksummed)
+    _crc = crc32c(_crc, data, len);
+}
+
+bool Connection::verifyChecksum()
+{
+  // a short or refused body is already handled as one
+  if (!_checksummed || _rejected || _totalBytesRead < _declaredSize)
+    return true;
+  if (_trailer.size() == UPLOAD_TRAILER_LEN && parseUploadTrailer(_trailer.data()) == _crc)
+    return true;
+
+  std::cerr << "ERROR: " << _filename << ": body failed its CRC-32C check";
+  if (_trailer.size() < UPLOAD_TRAILER_LEN)
+    std::cerr << " (no trailer)";
+  std::cerr << "\n";
+  return false;
+}
+
+bool Connection::writeBody(const char* data, size_t len)
+{
+  checksum(data, len);
+  if (_writeBehind && _chunked == nullptr) {
+    stage(data, len);
+    return true;
+  }
+  bool written = _chunked != nullptr ? _chunked->write(data, len)
+                                     : writeAll(_ofd, data, len, _bodyOffset + _totalBytesWritten);
+  if (!written) {
+    Metrics::count(Metrics::WRITE_ERRORS);
+    return false;
+  }
+  Metrics::record(Metrics::RECV_TO_WRITE, monotonicMicros() - _receivedAt);
+  _totalBytesWritten += len;
+  return true;
+}
+
+void Connection::stage(const char* data, size_t len)
+{
+  // Copied into whole buffers, so the writer's pwrite()s are as big as
+  // the pool allows however the bytes trickled in.
+  BufferPool& pool = BufferPool::shared();
+  while (len > 0) {
+    if (_fill == nullptr) {
+      _fill = pool.borrow();
+      _fillLen = 0;
+      _fillOffset = _bodyOffset + _totalBytesWritten;
+      _fillSince = _receivedAt;
+    }
+    size_t take = pool.bufferSize() - _fillLen < len ? pool.bufferSize() - _fillLen : len;
+    memcpy(_fill + _fillLen, data, take);
+    _fillLen += take;
+    _totalBytesWritten += take;
+    data += take;
+    len -= take;
+    if (_fillLen == pool.bufferSize())
+      flushFill();
+  }
+}
+
+void Connection::flushFill(std::function<void(int)> then)
+{
+  if (_fill == nullptr && !then)
+    return;
+  if (_ring == nullptr)
+    _ring = DiskWriter::shared()->open(_wake);
+
+  // Whole blocks at a block boundary can skip the page cache; a short last
+  // buffer, or anything after a resume at an odd offset, can't.
+  int fd = _ofd;
+  if (_direct && _fill != nullptr && _fillLen % DIRECT_BLOCK == 0 && _fillOffset % DIRECT_BLOCK == 0) {
+    if (_directFd == -1)
+      _directFd = openDirect(_filename);
+    if (_directFd == -1)
+      _direct = false;		// this filesystem won't, stop asking
+    else
+      fd = _directFd;
+  }
+  _ring->push(fd, _fill, _fillLen, _fillOffset, _fillSince, then);
+  _fill = nullptr;
+  _fillLen = 0;
+}
+
+bool Connection::drainWrites()
+{
+  // A resumable upload keeps what it has even when rejected, and stage()
+  // already counted the staged bytes in _totalBytesWritten, which its
+  // checkpoint is taken from; they have to reach the file first. flushFill()
+  // writes an unaligned remainder through the page cache.
+  if (_rejected && !_resumable) {
+    // about to be replaced by the marker anyway
+    BufferPool::shared().giveBack(_fill);
+    _fill = nullptr;
+  } else {
+    flushFill();
+  }
+  return _ring == nullptr || _ring->drain();
+}
+
+ssize_t Connection::spliceToFile()
+{
+  // what a raw upload's first read staged goes ahead of the spliced bytes
+  flushFill();
+
+  SplicePipe* pipe = threadPipe();
+  if (pipe == nullptr) {
+    _splice = false;
+    errno = EINTR;	// caller retries on the copy path
+    return -1;
+  }
+
+  ssize_t bytesRead = splice(_fd, nullptr, pipe->_fds[1], nullptr, pipe->_capacity,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (bytesRead == -1 && (errno == EINVAL || errno == ENOSYS)) {
+    // this socket/filesystem pair can't splice; do it the old way
+    _splice = false;
+    errno = EINTR;
+    return -1;
+  }
+  if (bytesRead <= 0)
+    return bytesRead;
+  received(bytesRead);
+  if (!acceptBody(bytesRead)) {
+    pipe->reset();
+    return -1;
+  }
+
+  size_t left = bytesRead;
+  loff_t offset = _bodyOffset + _totalBytesWritten;
+  while (left > 0) {
+    ssize_t moved = splice(pipe->_fds[0], nullptr, _ofd, &offset, left, SPLICE_F_MOVE);
+    if (moved == -1 && errno == EINTR)
+      continue;
+    if (moved <= 0) {
+      // The pipe still holds this connection's bytes; throw it away rather
+      // than let them leak into the next file.
+      int saved = errno;
+      pipe->reset();
+      Metrics::count(Metrics::WRITE_ERRORS);
+      errno = moved == 0 ? EIO : saved;
+      return -1;
+    }
+    left -= moved;
+  }
+  Metrics::record(Metrics::RECV_TO_WRITE, monotonicMicros() - _receivedAt);
+  _totalBytesWritten += bytesRead;
+  return bytesRead;
+}
+
+void Connection::received(size_t len)
+{
+  _receivedAt = monotonicMicros();
+  _lastActivity = _receivedAt / 1000;
+  if (!_heardFrom) {
+    _heardFrom = true;
+    Metrics::record(Metrics::FIRST_BYTE, _receivedAt - _acceptedAt);
+  }
+  Metrics::count(Metrics::BYTES_RECEIVED, len);
+
+  if (_clientBucket != nullptr)
+    _clientBucket->take(len);
+  if (Admission::totalBucket() != nullptr)
+    Admission::totalBucket()->take(len);
+}
+
+// How long reading has to wait for the buckets to come out of debt; 0: go.
+unsigned Connection::throttleMillis()
+{
+  unsigned wait = 0;
+  if (_clientBucket != nullptr)
+    wait = _clientBucket->millisUntilClear();
+  // the start of every file is let through; see Admission
+  TokenBucket* total = Admission::totalBucket();
+  if (total != nullptr && _totalBytesRead >= Admission::burst())
+    wait = std::max(wait, total->millisUntilClear());
+
+  if (wait > 0) {
+    // held back by us, not idle
+    _lastActivity = TimerWheel::nowMillis();
+    Metrics::count(Metrics::THROTTLED);
+  }
+  return wait;
+}
+
+Connection::State Connection::onReadable()
+{
+  _replies->flush();
+
+  // The ring is full: stop reading until the writer has room and wakes the
+  // loop, rather than make every other socket on it wait for this disk.
+  if (_ring != nullptr && !_ring->reserve(RING_HEADROOM))
+    return _state = RECEIVING;
+
+  // The read buffer is only held while this burst lasts. With --direct-io
+  // an idle connection may still hold a partly filled _fill; see below.
+  BufferPool& pool = BufferPool::shared();
+  char* buf = nullptr;
+  State state = YIELDED;
+
+  for (unsigned short i = 0; i < READ_BUDGET; i++) {
+    // Over its bandwidth: what's left stays in the socket buffer, where
+    // TCP's window slows the sender down, until the debt is paid.
+    _throttleMillis = throttleMillis();
+    if (_throttleMillis > 0) {
+      state = THROTTLED;
+      break;
+    }
+
+    ssize_t bytesRead;
+    if (_splice && _headerDone) {
+      bytesRead = spliceToFile();
+    } else {
+      if (buf == nullptr)
+        buf = pool.borrow();
+      bytesRead = copyToFile(buf, pool.bufferSize());
+    }
+
+    if (bytesRead == 0) {
+      // eof reached and client closed cxn
+      state = CLOSED;
+      break;
+    } else if (bytesRead > 0 || errno == EINTR) {
+      continue;
+    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      state = RECEIVING;
+      break;
+    } else {
+      perror("ERROR");
+      state = CLOSED;
+      break;
+    }
+  }
+
+  pool.giveBack(buf);
+  // nor a half-filled one for the ring, unless flushing it early would
+  // knock the rest of the file off the O_DIRECT block boundary
+  if ((state == RECEIVING || state == THROTTLED) && !_direct)
+    flushFill();
+  return _state = state;
+}
+
+void Connection::discard()
+{
+  writeErrorMarker(_ofd);
+}
+
+void Connection::onTimeout()
+{
+  errno = ETIMEDOUT;
+  perror("ERROR");
+  Metrics::count(Metrics::TIMEOUTS);
+
+  // a resumable upload keeps what it has; see finishResumable()
+  if (_totalBytesRead > 0 || _framed)
+    _rejected = true;
+  else
+    std::cerr << "ERROR: No data sent from client.\n";
+
+  _state = CLOSED;
+}
+
+uint64_t Connection::idleMillis(uint64_t now) const
+{
+  return now > _lastActivity ? now - _lastActivity : 0;
+}
+
+uint64_t Connection::transferMillis(uint64_t now) const
+{
+  return now > _startedAt ? now - _startedAt : 0;
+}
+
+int Connection::millisUntilDeadline(uint64_t now, const ServerConfig& config) const
+{
+  int64_t idleLeft = (int64_t)config.idleTimeoutMs - (int64_t)idleMillis(now);
+  int64_t left = idleLeft;
+  if (config.transferTimeoutMs > 0) {
+    int64_t transferLeft = (int64_t)(_startedAt + config.transferTimeoutMs) - (int64_t)now;
+    if (transferLeft < left)
+      left = transferLeft;
+  }
+  return left > 0 ? (int)left : 0;
+}
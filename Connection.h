@@ -0,0 +1,157 @@
+#ifndef _connection_
+#define _connection_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+#include "Admission.h"
+#include "Compression.h"
+#include "DiskWriter.h"
+#include "FileManager.h"
+#include "Protocol.h"
+#include "ServerConfig.h"
+#include "TimerWheel.h"
+
+// How many recv() calls one connection may make per readiness event before it
+// has to give the other sockets on the loop a turn.
+const unsigned short READ_BUDGET = 64;
+
+// Ring slots a read may need: a filled buffer, and the marker of a file it
+// finished.
+const unsigned RING_HEADROOM = 2;
+
+// Where a connection's replies queue up. A session's acks are sent once
+// their file is durable, by whichever thread found that out and possibly
+// after the Connection is gone, so the channel owns the socket: it closes
+// with the last reference, after the last ack.
+class ReplyChannel
+{
+private:
+	int _fd;
+	std::mutex _lock;
+	std::string _outbox;		// replies the socket had no room for yet
+
+	void flushLocked(bool closing);
+
+public:
+	explicit ReplyChannel(int fd) : _fd(fd) {}
+	~ReplyChannel();
+
+	void send(const UploadReply& reply);
+	void flush();
+};
+
+// One accepted client upload. The event loop owns the socket and calls
+// onReadable() whenever the kernel says there is something to read; all the
+// bookkeeping that used to live on handleConnection's stack lives here so a
+// transfer can be suspended at any point and picked up on the next event.
+// A session connection carries one framed file after another; the per-file
+// half of the state is reset between them.
+struct Connection {
+	enum State {
+		RECEIVING,	// socket still open, bytes go straight to _ofd
+		YIELDED,		// read budget spent before EAGAIN, call onReadable() again
+		THROTTLED,		// over its bandwidth, call onReadable() in _throttleMillis
+		CLOSED			// peer hung up, errored or timed out
+	};
+
+	int _fd;
+	std::string _filename;
+	int _ofd;			// -1 between the files of a session
+	State _state;
+	bool _queued;
+	std::function<std::string()> _nextFilename;
+	bool _splice;		// zero-copy receive, cleared if the kernel refuses
+	bool _dedup;
+	bool _session;		// more framed files may follow on this connection
+	unsigned long _files;	// finished so far in the session
+	std::shared_ptr<ReplyChannel> _replies;
+	bool _writeBehind;		// body goes through a DiskWriter ring
+	WriteRing* _ring;		// made on first use
+	std::function<void()> _wake;	// for the ring; unset: wait for room instead
+	bool _direct;			// whole aligned buffers go through _directFd
+	int _directFd;		// O_DIRECT twin of _ofd, opened on first use
+	char* _fill;			// pool buffer being filled for the ring
+	size_t _fillLen;
+	uint64_t _fillOffset;	// where _fill goes in the file
+	uint64_t _fillSince;		// when _fill's first byte was received
+	uint64_t _acceptedAt;		// monotonic us, for the metrics
+	uint64_t _receivedAt;		// when the bytes being handled came in
+	bool _heardFrom;		// any bytes at all yet
+	std::shared_ptr<TokenBucket> _clientBucket;	// null: no per-client rate
+	unsigned _throttleMillis;
+
+	// the file being received
+	bool _headerDone;		// framed header parsed, or known to be a raw stream
+	std::string _header;		// header bytes seen so far
+	bool _framed;
+	bool _ranged;		// one of several streams of a TransferRegistry file
+	bool _resumable;		// checkpointed on close instead of marked ERROR
+	uint64_t _transferId;
+	uint64_t _bodyOffset;	// where this stream's body starts in the file
+	uint64_t _declaredSize;	// body bytes this stream promised
+	bool _rejected;		// file is replaced by the ERROR marker on close
+	ChunkedFile* _chunked;	// --dedup: body goes to the chunk store
+	BlockUnpacker* _unpacker;	// compressed upload: body is decoded first
+	bool _checksummed;		// a CRC-32C trailer follows the body
+	uint32_t _crc;			// of the body so far
+	std::string _trailer;
+	unsigned long _totalBytesRead;	// body bytes, past _bodyOffset
+	unsigned long _totalBytesWritten;
+	uint64_t _maxFileSize;	// 0: no quota
+	uint64_t _startedAt;		// monotonic ms, restarted for every file
+	uint64_t _fileStartedAt;	// the same in us, for the transfer histogram
+	uint64_t _lastActivity;
+	TimerWheel::Timer _idleTimer;
+	TimerWheel::Timer _transferTimer;
+	TimerWheel::Timer _throttleTimer;
+
+	Connection(int fd, std::function<std::string()> nextFilename, const ServerConfig& config);
+	~Connection();
+
+	void resetFile();
+	bool openFile();
+	bool finishFile(bool ack);
+	void handOff(bool ack);
+	bool fileComplete() const;
+	void nextFile();
+	ssize_t consume(const char* data, size_t len);
+	ssize_t copyToFile(char* buf, size_t size);
+	ssize_t spliceToFile();
+	ssize_t consumeHeader(const char* data, size_t len);
+	bool acceptBody(size_t len);
+	ssize_t receiveBody(const char* data, size_t len);
+	size_t bodyPart(size_t len) const;
+	size_t takeTrailer(const char* data, size_t len);
+	void checksum(const char* data, size_t len);
+	bool verifyChecksum();
+	bool writeBody(const char* data, size_t len);
+	void stage(const char* data, size_t len);
+	void flushFill(std::function<void(int)> then = nullptr);
+	bool drainWrites();
+	bool resume(const UploadHeader& header, bool& created);
+	void finishResumable(bool intact);
+	void abandonFile();
+	void sendReply(const UploadReply& reply);
+	void acknowledge(const UploadReply& reply);
+	void commit(bool sync, bool ack, bool stored);
+	bool storeManifest();
+	void discard();
+
+	void received(size_t len);
+	unsigned throttleMillis();
+	State onReadable();
+	void onTimeout();
+	uint64_t idleMillis(uint64_t now) const;
+	uint64_t transferMillis(uint64_t now) const;
+	int millisUntilDeadline(uint64_t now, const ServerConfig& config) const;
+};
+
+bool setNonBlocking(int fd);
+void recordAcceptWait(int clientfd);
+
+#endif
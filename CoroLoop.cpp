@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include <memory>
+
+#include "CoroLoop.h"
+#include "Admission.h"
+#include "FileManager.h"
+
+void RingRoom::wake()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_waiter) {
+    _reactor.post(_waiter);
+    _waiter = nullptr;
+  } else {
+    _freed = true;
+  }
+}
+
+bool RingRoom::Wait::await_suspend(std::coroutine_handle<> handle)
+{
+  // The writer may have freed a slot since reserve() looked; if so it
+  // already called wake() and there is nothing to wait for.
+  std::lock_guard<std::mutex> guard(_room._lock);
+  if (_room._freed) {
+    _room._freed = false;
+    return false;
+  }
+  _room._waiter = handle;
+  return true;
+}
+
+CoroLoop::CoroLoop(int listenfd, const ServerConfig& config, std::function<std::string()> nextFilename)
+: _listenfd(listenfd), _config(config), _nextFilename(nextFilename), _scratch(config.bufferSize)
+{
+}
+
+Task<void> CoroLoop::acceptClients()
+{
+  for (;;) {
+    bool admitted = Admission::enter();
+    if (!admitted && !Admission::refusing()) {
+      // at the limit; the rest wait in the listen queue
+      co_await _reactor.sleep(ADMISSION_RETRY_MS);
+      continue;
+    }
+
+    int clientfd = accept4(_listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientfd == -1) {
+      if (admitted)
+        Admission::leave();
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      co_await _reactor.readable(_listenfd);
+      continue;
+    }
+    recordAcceptWait(clientfd);
+    if (!admitted) {
+      shedConnection(clientfd);
+      continue;
+    }
+    // runs up to its first wait before the next accept
+    _reactor.spawn(serve(clientfd));
+  }
+}
+
+Task<void> CoroLoop::serve(int clientfd)
+{
+  Connection conn(clientfd, _nextFilename, _config);
+  std::shared_ptr<RingRoom> room = std::make_shared<RingRoom>(_reactor);
+  conn._wake = [room]() { room->wake(); };
+  FileManager socket(_reactor);
+  unsigned short reads = 0;
+
+  while (conn._state != Connection::CLOSED) {
+    conn._replies->flush();
+
+    // The ring is full: wait for the writer to make room rather than make
+    // every other client on this thread wait for this disk.
+    if (conn._ring != nullptr && !conn._ring->reserve(RING_HEADROOM)) {
+      co_await room->wait();
+      continue;
+    }
+
+    // A fast sender never sees EAGAIN, so never suspends by itself; let
+    // the accept loop and everybody else have a turn.
+    if (++reads > READ_BUDGET) {
+      reads = 0;
+      co_await _reactor.yield();
+      continue;
+    }
+
+    // Over its bandwidth: leave the rest in the socket buffer and let
+    // TCP's window slow the sender down.
+    unsigned throttle = conn.throttleMillis();
+    if (throttle > 0) {
+      if (!conn._direct)
+        conn.flushFill();
+      co_await _reactor.sleep(throttle);
+      continue;
+    }
+
+    int wait = conn.millisUntilDeadline(TimerWheel::nowMillis(), _config);
+    if (wait == 0) {
+      conn.onTimeout();
+      break;
+    }
+
+    ssize_t bytesRead;
+    if (conn._splice && conn._headerDone) {
+      // no buffer of ours: socket -> pipe -> file, waiting here on EAGAIN
+      bytesRead = conn.spliceToFile();
+      if (bytesRead == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        // the deadline is looked at again above
+        co_await _reactor.readable(clientfd, wait);
+        continue;
+      }
+      if (bytesRead == -1 && errno == EINTR)
+        continue;
+    } else {
+      socket.setTimeout(wait);
+      bytesRead = co_await socket.readBytesFromSocketToBuffer(clientfd, _scratch.data(), _scratch.size());
+      if (bytesRead > 0) {
+        conn.received(bytesRead);
+        if (conn.consume(_scratch.data(), bytesRead) < 0) {
+          perror("ERROR");
+          break;
+        }
+        // A short read emptied the socket and the next one waits. Don't sit
+        // on a half-filled buffer for the ring meanwhile, unless flushing it
+        // early would knock the rest of the file off the O_DIRECT boundary.
+        if ((size_t)bytesRead < _scratch.size() && !conn._direct)
+          conn.flushFill();
+        continue;
+      }
+      if (bytesRead == -1 && errno == ETIMEDOUT)
+        continue;
+    }
+    if (bytesRead == 0)
+      break;
+    if (bytesRead < 0) {
+      perror("ERROR");
+      break;
+    }
+  }
+  // before conn lets go of the socket
+  _reactor.forget(clientfd);
+}
+
+void CoroLoop::run()
+{
+  _reactor.spawn(acceptClients());
+  _reactor.run();
+}
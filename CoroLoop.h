@@ -0,0 +1,70 @@
+#ifndef _coro_loop_
+#define _coro_loop_
+
+#include <coroutine>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "Connection.h"
+#include "Reactor.h"
+#include "ServerConfig.h"
+#include "Task.h"
+
+// Where a disk writer finds the coroutine waiting for room in its ring.
+// Shared with the ring's wake function, which may still run once the
+// connection is gone.
+struct RingRoom {
+	Reactor& _reactor;
+	std::mutex _lock;
+	bool _freed;			// room came before anyone waited for it
+	std::coroutine_handle<> _waiter;
+
+	explicit RingRoom(Reactor& reactor) : _reactor(reactor), _freed(false) {}
+
+	// From the disk writer thread.
+	void wake();
+
+	// What co_await wait() suspends on: the next wake(), or nothing if it
+	// came already.
+	struct Wait {
+		RingRoom& _room;
+
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> handle);
+		void await_resume() {}
+	};
+
+	Wait wait() { return Wait{*this}; }
+};
+
+// The server's default backend. The accept loop and every client are
+// coroutines on one Reactor per thread, each written as a plain loop of
+// awaited FileManager reads, so a client's state is its own stack frame
+// rather than callbacks on the event loop. Throttling and the connection
+// limit are awaited sleeps, deadlines are the timeout on the read, and a
+// client whose disk writer fell behind awaits room in its ring. Nobody
+// suspends on a busy socket by itself, so after READ_BUDGET reads a client
+// yields to the rest.
+class CoroLoop
+{
+private:
+	int _listenfd;
+	const ServerConfig& _config;
+	std::function<std::string()> _nextFilename;
+	Reactor _reactor;
+	// Shared by every client on this thread: each consumes what it read
+	// before it suspends again.
+	std::vector<char> _scratch;
+
+	Task<void> acceptClients();
+	Task<void> serve(int clientfd);
+
+public:
+	CoroLoop(int listenfd, const ServerConfig& config, std::function<std::string()> nextFilename);
+
+	void run();
+};
+
+#endif
@@ -0,0 +1,183 @@
+#include <string.h>
+
+#include "Crc32c.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+const uint32_t POLY = 0x82f63b78;	// reflected Castagnoli polynomial
+
+// _table[k][b]: the CRC of byte b followed by k zero bytes
+static uint32_t _table[8][256];
+
+static void buildTable()
+{
+  for (uint32_t b = 0; b < 256; b++) {
+    uint32_t crc = b;
+    for (int bit = 0; bit < 8; bit++)
+      crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+    _table[0][b] = crc;
+  }
+  for (uint32_t b = 0; b < 256; b++)
+    for (int k = 1; k < 8; k++)
+      _table[k][b] = (_table[k - 1][b] >> 8) ^ _table[0][_table[k - 1][b] & 0xff];
+}
+
+static uint32_t crcTable(uint32_t crc, const unsigned char* p, size_t len)
+{
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+    crc = (crc >> 8) ^ _table[0][(crc ^ *p++) & 0xff];
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    word ^= crc;
+    crc = _table[7][word & 0xff] ^ _table[6][(word >> 8) & 0xff]
+        ^ _table[5][(word >> 16) & 0xff] ^ _table[4][(word >> 24) & 0xff]
+        ^ _table[3][(word >> 32) & 0xff] ^ _table[2][(word >> 40) & 0xff]
+        ^ _table[1][(word >> 48) & 0xff] ^ _table[0][word >> 56];
+  }
+
+  for (; len > 0; len--)
+    crc = (crc >> 8) ^ _table[0][(crc ^ *p++) & 0xff];
+  return crc;
+}
+
+#if defined(__x86_64__)
+// The crc32 instruction issues once a cycle but takes three to finish, so
+// one dependent chain runs at a third of its speed. Three chains over
+// adjacent blocks are folded back together by shifting a chain's CRC past
+// the bytes that follow it, which a table per block size makes cheap.
+const size_t LONG_BLOCK = 8192;
+const size_t SHORT_BLOCK = 256;
+static uint32_t _longShift[4][256];
+static uint32_t _shortShift[4][256];
+
+static uint32_t gf2Times(const uint32_t* mat, uint32_t vec)
+{
+  uint32_t sum = 0;
+  for (; vec != 0; vec >>= 1, mat++)
+    if (vec & 1)
+      sum ^= *mat;
+  return sum;
+}
+
+static void gf2Square(uint32_t* square, const uint32_t* mat)
+{
+  for (int n = 0; n < 32; n++)
+    square[n] = gf2Times(mat, mat[n]);
+}
+
+// op becomes the operator that appends len zero bytes to a CRC
+static void zerosOperator(uint32_t* even, size_t len)
+{
+  uint32_t odd[32];
+  uint32_t row = 1;
+  odd[0] = POLY;
+  for (int n = 1; n < 32; n++) {
+    odd[n] = row;
+    row <<= 1;
+  }
+  gf2Square(even, odd);
+  gf2Square(odd, even);
+  do {
+    gf2Square(even, odd);
+    len >>= 1;
+    if (len == 0)
+      return;
+    gf2Square(odd, even);
+    len >>= 1;
+  } while (len != 0);
+  memcpy(even, odd, sizeof(odd));
+}
+
+static void buildShift(uint32_t shift[4][256], size_t len)
+{
+  uint32_t op[32];
+  zerosOperator(op, len);
+  for (uint32_t n = 0; n < 256; n++)
+    for (int k = 0; k < 4; k++)
+      shift[k][n] = gf2Times(op, n << (8 * k));
+}
+
+static inline uint32_t shiftCrc(uint32_t shift[4][256], uint32_t crc)
+{
+  return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^ shift[2][(crc >> 16) & 0xff]
+       ^ shift[3][crc >> 24];
+}
+
+__attribute__((target("sse4.2")))
+static uint64_t crcLanes(uint64_t crc0, const unsigned char*& p, size_t& len, size_t block,
+                         uint32_t shift[4][256])
+{
+  while (len >= 3 * block) {
+    uint64_t crc1 = 0, crc2 = 0;
+    for (const unsigned char* end = p + block; p < end; p += 8) {
+      uint64_t w0, w1, w2;
+      memcpy(&w0, p, 8);
+      memcpy(&w1, p + block, 8);
+      memcpy(&w2, p + 2 * block, 8);
+      crc0 = _mm_crc32_u64(crc0, w0);
+      crc1 = _mm_crc32_u64(crc1, w1);
+      crc2 = _mm_crc32_u64(crc2, w2);
+    }
+    crc0 = shiftCrc(shift, (uint32_t)crc0) ^ crc1;
+    crc0 = shiftCrc(shift, (uint32_t)crc0) ^ crc2;
+    p += 2 * block;
+    len -= 3 * block;
+  }
+  return crc0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crcHardware(uint32_t crc, const unsigned char* p, size_t len)
+{
+  for (; len > 0 && ((uintptr_t)p & 7) != 0; len--)
+    crc = _mm_crc32_u8(crc, *p++);
+
+  uint64_t crc64 = crcLanes(crc, p, len, LONG_BLOCK, _longShift);
+  crc64 = crcLanes(crc64, p, len, SHORT_BLOCK, _shortShift);
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t)crc64;
+
+  for (; len > 0; len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
+
+typedef uint32_t (*CrcFunction)(uint32_t, const unsigned char*, size_t);
+
+static CrcFunction pick()
+{
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2")) {
+    buildShift(_longShift, LONG_BLOCK);
+    buildShift(_shortShift, SHORT_BLOCK);
+    return crcHardware;
+  }
+#endif
+  buildTable();
+  return crcTable;
+}
+
+static CrcFunction implementation()
+{
+  static CrcFunction chosen = pick();
+  return chosen;
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+  return ~implementation()(~crc, (const unsigned char*)data, len);
+}
+
+const char* crc32cImplementation()
+{
+  return implementation() == crcTable ? "table" : "sse4.2";
+}
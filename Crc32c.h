@@ -0,0 +1,16 @@
+#ifndef _crc32c_
+#define _crc32c_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC-32C (Castagnoli), the checksum iSCSI and ext4 use. Chains like zlib's
+// crc32(): start from 0 and feed the result back in with the next piece.
+// Runs on the SSE4.2 crc32 instruction when the CPU has it, and on a
+// slicing-by-8 table otherwise.
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+// "sse4.2" or "table", whichever crc32c() picked
+const char* crc32cImplementation();
+
+#endif
@@ -0,0 +1,334 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "BufferPool.h"
+#include "DiskWriter.h"
+#include "Metrics.h"
+
+static DiskWriter* sharedWriter = nullptr;
+static Committer* sharedCommitter = nullptr;
+
+uint64_t monotonicMicros()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void raiseTo(std::atomic<uint64_t>& max, uint64_t value)
+{
+  uint64_t seen = max.load();
+  while (value > seen && !max.compare_exchange_weak(seen, value))
+    ;
+}
+
+static bool pwriteAll(int fd, const char* buf, size_t nbytes, off_t offset)
+{
+  while (nbytes > 0) {
+    ssize_t bytesWritten = ::pwrite(fd, buf, nbytes, offset);
+    if (bytesWritten == -1) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    buf += bytesWritten;
+    nbytes -= bytesWritten;
+    offset += bytesWritten;
+  }
+  return true;
+}
+
+WriteRing::WriteRing(DiskWriter& writer, unsigned thread, std::function<void()> wake)
+: _writer(writer), _thread(thread), _wake(wake), _head(0), _tail(0), _stalled(false), _error(0),
+  _scheduled(false), _released(false) {}
+
+bool WriteRing::reserve(unsigned want)
+{
+  if (room() >= want)
+    return true;
+  _writer.stalled();
+  if (!_wake) {
+    waitForRoom(want);
+    return true;
+  }
+  // Set before looking again: either we see the slot the writer just
+  // freed, or the writer sees the flag and wakes us.
+  _stalled = true;
+  return room() >= want;
+}
+
+void WriteRing::waitForRoom(unsigned want)
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  while (room() < want) {
+    _stalled = true;
+    if (room() >= want)
+      break;
+    _progress.wait(lock);
+  }
+}
+
+void WriteRing::unstall()
+{
+  if (!_stalled.exchange(false))
+    return;
+  if (_wake)
+    _wake();
+  std::lock_guard<std::mutex> guard(_lock);
+  _progress.notify_all();
+}
+
+void WriteRing::push(int fd, char* buf, size_t len, uint64_t offset, uint64_t since,
+                     std::function<void(int)> then)
+{
+  if (room() == 0) {
+    // Only when one read decoded or finished more than the ring holds;
+    // the event loop normally stops reading well before this.
+    _writer.stalled();
+    waitForRoom(1);
+  }
+
+  unsigned head = _head.load(std::memory_order_relaxed);
+  Slot& slot = _slots[head % RING_SLOTS];
+  slot._fd = fd;
+  slot._buf = buf;
+  slot._len = len;
+  slot._offset = offset;
+  slot._since = since;
+  slot._then = then;
+  _head.store(head + 1, std::memory_order_release);
+
+  bool idle;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    idle = !_scheduled;
+    _scheduled = true;
+  }
+  if (idle)
+    _writer.schedule(this);
+}
+
+bool WriteRing::drain()
+{
+  std::unique_lock<std::mutex> lock(_lock);
+  _progress.wait(lock, [this]() { return !_scheduled; });
+  if (_error != 0) {
+    errno = _error;
+    _error = 0;
+    return false;
+  }
+  return true;
+}
+
+void WriteRing::release()
+{
+  bool idle;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _released = true;
+    idle = !_scheduled;
+  }
+  if (idle)
+    delete this;
+}
+
+DiskWriter::DiskWriter(unsigned threads)
+: _next(0), _buffers(0), _bytes(0), _stalls(0), _writeMicros(0)
+{
+  for (unsigned i = 0; i < threads; i++) {
+    Worker* worker = new Worker();
+    _workers.push_back(worker);
+    std::thread(&DiskWriter::work, this, worker).detach();
+  }
+}
+
+WriteRing* DiskWriter::open(std::function<void()> wake)
+{
+  return new WriteRing(*this, _next++ % _workers.size(), wake);
+}
+
+void DiskWriter::schedule(WriteRing* ring)
+{
+  Worker* worker = _workers[ring->_thread];
+  {
+    std::lock_guard<std::mutex> guard(worker->_lock);
+    worker->_queue.push_back(ring);
+  }
+  worker->_ready.notify_one();
+}
+
+void DiskWriter::work(Worker* worker)
+{
+  for (;;) {
+    WriteRing* ring;
+    {
+      std::unique_lock<std::mutex> lock(worker->_lock);
+      worker->_ready.wait(lock, [worker]() { return !worker->_queue.empty(); });
+      ring = worker->_queue.front();
+      worker->_queue.pop_front();
+    }
+    service(ring);
+  }
+}
+
+void DiskWriter::service(WriteRing* ring)
+{
+  BufferPool& pool = BufferPool::shared();
+  unsigned tail = ring->_tail.load(std::memory_order_relaxed);
+
+  for (;;) {
+    unsigned head = ring->_head.load(std::memory_order_acquire);
+    for (; tail != head; tail++) {
+      WriteRing::Slot& slot = ring->_slots[tail % RING_SLOTS];
+      if (slot._buf != nullptr) {
+        // once one write fails the rest of that file is moot
+        uint64_t started = monotonicMicros();
+        if (ring->_error == 0 && !pwriteAll(slot._fd, slot._buf, slot._len, slot._offset)) {
+          ring->_error = errno;
+          perror("ERROR");
+          Metrics::count(Metrics::WRITE_ERRORS);
+        }
+        uint64_t now = monotonicMicros();
+        _writeMicros += now - started;
+        if (ring->_error == 0)
+          Metrics::record(Metrics::RECV_TO_WRITE, now - slot._since);
+        _buffers++;
+        _bytes += slot._len;
+        pool.giveBack(slot._buf);
+      }
+      if (slot._then) {
+        std::function<void(int)> then;
+        then.swap(slot._then);
+        int error = ring->_error;
+        ring->_error = 0;
+        then(error);
+      }
+      ring->_tail.store(tail + 1, std::memory_order_release);
+      ring->unstall();
+    }
+
+    // Going idle is decided under the lock push() schedules under, so a
+    // slot pushed just now is either seen here or schedules us again.
+    bool gone;
+    {
+      std::lock_guard<std::mutex> guard(ring->_lock);
+      if (ring->_head.load() != tail)
+        continue;
+      ring->_scheduled = false;
+      gone = ring->_released;
+      ring->_progress.notify_all();
+    }
+    if (gone)
+      delete ring;
+    return;
+  }
+}
+
+void DiskWriter::configure(unsigned threads)
+{
+  sharedWriter = threads > 0 ? new DiskWriter(threads) : nullptr;
+}
+
+DiskWriter* DiskWriter::shared()
+{
+  return sharedWriter;
+}
+
+Committer::Committer(bool sync)
+: _sync(sync), _batches(0), _files(0), _maxBatch(0), _syncMicros(0), _acks(0), _ackMicros(0),
+  _maxAckMicros(0)
+{
+  if (_sync)
+    std::thread(&Committer::work, this).detach();
+}
+
+void Committer::submit(int fd, std::function<void(bool)> done, uint64_t since)
+{
+  Commit commit;
+  commit._fd = fd;
+  commit._done = done;
+  commit._since = since;
+  commit._durable = true;
+
+  if (!_sync) {
+    // acks go out as soon as the bytes are in the page cache
+    if (fd != -1)
+      close(fd);
+    finished(commit, monotonicMicros());
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    _queue.push_back(commit);
+  }
+  _ready.notify_one();
+}
+
+void Committer::work()
+{
+  for (;;) {
+    // Whatever queued up while the last batch was syncing is the next one;
+    // the busier the disk, the more files share each round of flushes.
+    std::vector<Commit> batch;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _ready.wait(lock, [this]() { return !_queue.empty(); });
+      batch.swap(_queue);
+    }
+
+    uint64_t started = monotonicMicros();
+    uint64_t files = 0;
+    for (Commit& commit : batch) {
+      if (commit._fd != -1)
+        sync_file_range(commit._fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+    for (Commit& commit : batch) {
+      if (commit._fd == -1)
+        continue;
+      if (fdatasync(commit._fd) == -1) {
+        perror("ERROR");
+        Metrics::count(Metrics::WRITE_ERRORS);
+        commit._durable = false;
+      }
+      close(commit._fd);
+      files++;
+    }
+
+    uint64_t now = monotonicMicros();
+    if (files > 0) {
+      _batches++;
+      _files += files;
+      _syncMicros += now - started;
+      raiseTo(_maxBatch, files);
+    }
+    for (Commit& commit : batch)
+      finished(commit, now);
+  }
+}
+
+void Committer::finished(Commit& commit, uint64_t now)
+{
+  if (!commit._done)
+    return;
+  commit._done(commit._durable);
+  uint64_t latency = now > commit._since ? now - commit._since : 0;
+  _acks++;
+  _ackMicros += latency;
+  raiseTo(_maxAckMicros, latency);
+}
+
+void Committer::configure(bool sync)
+{
+  sharedCommitter = new Committer(sync);
+}
+
+Committer& Committer::shared()
+{
+  if (sharedCommitter == nullptr)
+    configure(true);
+  return *sharedCommitter;
+}
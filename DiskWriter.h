@@ -0,0 +1,168 @@
+#ifndef _disk_writer_
+#define _disk_writer_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stddef.h>
+#include <stdint.h>
+#include <thread>
+#include <vector>
+
+// Write-behind stage between the sockets and the disk. A connection copies
+// body bytes into a pool buffer and, once it is full, hands it to one of a
+// few disk writer threads through its own WriteRing; the network thread is
+// back in recv() while the writer sits in pwrite(). Finished files then go
+// to the Committer, which makes a whole batch of them durable at once and
+// only then lets their acks out.
+
+// Buffers (or finish markers) a connection may have queued for its writer.
+const unsigned RING_SLOTS = 32;
+
+uint64_t monotonicMicros();
+
+class DiskWriter;
+
+// Single producer, single consumer: the connection's network thread pushes,
+// the writer thread the ring is bound to pops, in order.
+class WriteRing
+{
+private:
+	friend class DiskWriter;
+
+	struct Slot {
+		int _fd;
+		char* _buf;			// BufferPool buffer, given back once written
+		size_t _len;
+		uint64_t _offset;
+		uint64_t _since;		// when its first byte was received
+		std::function<void(int)> _then;	// run after, with errno of the first failure
+	};
+
+	DiskWriter& _writer;
+	unsigned _thread;
+	std::function<void()> _wake;	// empty: reserve() waits instead
+	Slot _slots[RING_SLOTS];
+	std::atomic<unsigned> _head;	// pushed so far
+	std::atomic<unsigned> _tail;	// done so far
+	std::atomic<bool> _stalled;	// producer is waiting for room
+	int _error;			// writer side, until the next _then
+	std::mutex _lock;
+	std::condition_variable _progress;
+	bool _scheduled;		// on the writer's queue or being serviced
+	bool _released;		// the connection is gone, last one out deletes
+
+	WriteRing(DiskWriter& writer, unsigned thread, std::function<void()> wake);
+	void waitForRoom(unsigned want);
+	void unstall();
+
+public:
+	unsigned room() const { return RING_SLOTS - (_head.load() - _tail.load()); }
+
+	// Without a wake function this waits for want free slots. With one it
+	// returns false instead and calls it from the writer thread once there
+	// is room, so an event loop can go on with its other sockets.
+	bool reserve(unsigned want);
+	// Takes buf (may be null for a bare marker) and calls then, if any,
+	// after it is written. Waits for room if the ring is full.
+	void push(int fd, char* buf, size_t len, uint64_t offset, uint64_t since,
+	          std::function<void(int)> then = nullptr);
+	// Waits until everything pushed so far is done; false with errno set if
+	// a write failed since the last marker.
+	bool drain();
+	// The connection is done with the ring; it goes away after its last slot.
+	void release();
+};
+
+class DiskWriter
+{
+private:
+	struct Worker {
+		std::mutex _lock;
+		std::condition_variable _ready;
+		std::deque<WriteRing*> _queue;
+	};
+
+	std::vector<Worker*> _workers;
+	std::atomic<unsigned> _next;
+	std::atomic<uint64_t> _buffers;
+	std::atomic<uint64_t> _bytes;
+	std::atomic<uint64_t> _stalls;
+	std::atomic<uint64_t> _writeMicros;
+
+	void work(Worker* worker);
+	void service(WriteRing* ring);
+
+public:
+	explicit DiskWriter(unsigned threads);
+
+	// A ring bound to one of the writers, round robin.
+	WriteRing* open(std::function<void()> wake);
+	void schedule(WriteRing* ring);
+	void stalled() { _stalls++; }
+
+	unsigned threads() const { return _workers.size(); }
+	uint64_t buffers() const { return _buffers; }
+	uint64_t bytes() const { return _bytes; }
+	uint64_t stalls() const { return _stalls; }
+	uint64_t writeMicros() const { return _writeMicros; }
+
+	static void configure(unsigned threads);
+	// null unless the server writes behind
+	static DiskWriter* shared();
+};
+
+// Group commit. Files are queued as they finish; one thread takes whatever
+// has piled up, starts writeback on all of it, then waits on each with
+// fdatasync, so a burst of small files costs one round of device flushes
+// rather than one per file. Callbacks run afterwards in submission order,
+// which keeps a session's acks in the order its files arrived.
+class Committer
+{
+private:
+	struct Commit {
+		int _fd;
+		std::function<void(bool)> _done;
+		uint64_t _since;
+		bool _durable;
+	};
+
+	bool _sync;
+	std::mutex _lock;
+	std::condition_variable _ready;
+	std::vector<Commit> _queue;
+	std::atomic<uint64_t> _batches;
+	std::atomic<uint64_t> _files;
+	std::atomic<uint64_t> _maxBatch;
+	std::atomic<uint64_t> _syncMicros;
+	std::atomic<uint64_t> _acks;
+	std::atomic<uint64_t> _ackMicros;
+	std::atomic<uint64_t> _maxAckMicros;
+
+	void work();
+	void finished(Commit& commit, uint64_t now);
+
+public:
+	explicit Committer(bool sync);
+
+	// Takes fd (-1: nothing to sync, only keep done in line) and closes it
+	// once synced; done(durable) then runs on the committer thread. since
+	// is when the file was complete, for the ack latency figures.
+	void submit(int fd, std::function<void(bool)> done, uint64_t since);
+
+	bool syncing() const { return _sync; }
+	uint64_t batches() const { return _batches; }
+	uint64_t files() const { return _files; }
+	uint64_t maxBatch() const { return _maxBatch; }
+	uint64_t syncMicros() const { return _syncMicros; }
+	uint64_t acks() const { return _acks; }
+	uint64_t ackMicros() const { return _ackMicros; }
+	uint64_t maxAckMicros() const { return _maxAckMicros; }
+
+	static void configure(bool sync);
+	static Committer& shared();
+};
+
+#endif
@@ -0,0 +1,300 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include "Admission.h"
+#include "EventLoop.h"
+
+const int MAX_EVENTS = 256;
+
+// Resolution of the idle/transfer deadlines.
+const unsigned TIMER_TICK_MS = 10;
+
+EventLoop::EventLoop(int listenfd, const ServerConfig& config, std::function<std::string()> nextFilename)
+: _epfd(-1), _listenfd(listenfd), _wakefd(-1), _config(config), _nextFilename(nextFilename),
+  _timers(TIMER_TICK_MS)
+{
+  _epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epfd == -1) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+
+  if (!setNonBlocking(_listenfd) || !watch(_listenfd, EPOLLIN | EPOLLET)) {
+    perror("ERROR");
+    exit(EXIT_FAILURE);
+  }
+
+  _wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_wakefd == -1 || !watch(_wakefd, EPOLLIN | EPOLLET)) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+EventLoop::~EventLoop()
+{
+  for (auto& entry : _connections)
+    delete entry.second;
+  close(_wakefd);
+  close(_epfd);
+}
+
+bool EventLoop::watch(int fd, uint32_t events)
+{
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = events;
+  ev.data.fd = fd;
+  return epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+void EventLoop::acceptClients()
+{
+  // Edge-triggered: keep accepting until the backlog is empty or we won't
+  // hear about the rest of it.
+  for (;;) {
+    bool admitted = Admission::enter();
+    if (!admitted && !Admission::refusing()) {
+      pauseAccepting();
+      return;
+    }
+
+    struct sockaddr_storage clientAddr;
+    socklen_t clientAddrSize = sizeof(clientAddr);
+    int clientfd = accept4(_listenfd, (struct sockaddr*)&clientAddr, &clientAddrSize,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (clientfd == -1) {
+      if (admitted)
+        Admission::leave();
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        perror("accept");
+      return;
+    }
+    recordAcceptWait(clientfd);
+    if (!admitted) {
+      shedConnection(clientfd);
+      continue;
+    }
+
+    Connection* conn = new Connection(clientfd, _nextFilename, _config);
+    if (conn->_state == Connection::CLOSED) {
+      delete conn;
+      continue;
+    }
+
+    conn->_wake = [this, clientfd]() { wake(clientfd); };
+    _connections[clientfd] = conn;
+    if (!watch(clientfd, EPOLLIN | EPOLLRDHUP | EPOLLET)) {
+      perror("epoll_ctl");
+      closeConnection(conn);
+      continue;
+    }
+    armTimers(conn);
+  }
+}
+
+void EventLoop::pauseAccepting()
+{
+  // At the connection limit: the rest wait in the listen queue. No edge
+  // comes for them, so look again when one of ours closes or, for a slot
+  // freed on another loop, off the wheel.
+  if (_acceptTimer.armed())
+    return;
+  _acceptTimer._fire = [this]() { acceptClients(); };
+  _timers.schedule(_acceptTimer, ADMISSION_RETRY_MS);
+}
+
+void EventLoop::wake(int fd)
+{
+  // Called from a disk writer thread. By fd rather than Connection*: if
+  // the connection is gone by the time we look, the lookup just misses.
+  {
+    std::lock_guard<std::mutex> guard(_wakeLock);
+    _woken.push_back(fd);
+  }
+  uint64_t one = 1;
+  if (write(_wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+void EventLoop::serviceWoken()
+{
+  uint64_t count;
+  while (read(_wakefd, &count, sizeof(count)) == -1 && errno == EINTR)
+    ;
+
+  std::vector<int> woken;
+  {
+    std::lock_guard<std::mutex> guard(_wakeLock);
+    woken.swap(_woken);
+  }
+  for (int fd : woken) {
+    auto it = _connections.find(fd);
+    if (it != _connections.end() && !it->second->_queued && !it->second->_throttleTimer.armed())
+      serviceConnection(it->second);
+  }
+}
+
+void EventLoop::serviceConnection(Connection* conn)
+{
+  switch (conn->onReadable()) {
+    case Connection::CLOSED:
+      closeConnection(conn);
+      break;
+    case Connection::YIELDED:
+      // Still has data buffered in the kernel but we won't get another edge
+      // for it, so remember to come back after everyone else had a turn.
+      enqueue(conn);
+      break;
+    case Connection::THROTTLED:
+      // Its edges are ignored until the wheel hands it back; queued rather
+      // than serviced from the timer, which may close it.
+      conn->_throttleTimer._fire = [this, conn]() { enqueue(conn); };
+      _timers.schedule(conn->_throttleTimer, conn->_throttleMillis);
+      break;
+    case Connection::RECEIVING:
+      break;
+  }
+}
+
+void EventLoop::enqueue(Connection* conn)
+{
+  if (!conn->_queued) {
+    conn->_queued = true;
+    _ready.push_back(conn);
+  }
+}
+
+void EventLoop::runReadyConnections()
+{
+  std::vector<Connection*> ready;
+  ready.swap(_ready);
+  for (Connection* conn : ready) {
+    conn->_queued = false;
+    serviceConnection(conn);
+  }
+}
+
+void EventLoop::armTimers(Connection* conn)
+{
+  conn->_idleTimer._fire = [this, conn]() { onIdleTimer(conn); };
+  _timers.schedule(conn->_idleTimer, _config.idleTimeoutMs);
+
+  if (_config.transferTimeoutMs > 0) {
+    conn->_transferTimer._fire = [this, conn]() { onTransferTimer(conn); };
+    _timers.schedule(conn->_transferTimer, _config.transferTimeoutMs);
+  }
+}
+
+void EventLoop::onIdleTimer(Connection* conn)
+{
+  // The timer is not pushed back on every recv(); when it fires we check how
+  // long the connection has really been quiet and re-arm for the remainder.
+  uint64_t idle = conn->idleMillis(TimerWheel::nowMillis());
+  if (idle >= _config.idleTimeoutMs)
+    expireConnection(conn);
+  else
+    _timers.schedule(conn->_idleTimer, _config.idleTimeoutMs - idle);
+}
+
+void EventLoop::onTransferTimer(Connection* conn)
+{
+  // Each file of a session gets the whole deadline; the clock restarts
+  // with every file, so see how far the current one really is.
+  uint64_t elapsed = conn->transferMillis(TimerWheel::nowMillis());
+  if (elapsed >= _config.transferTimeoutMs) {
+    std::cerr << "ERROR: " << conn->_filename << " exceeded the transfer deadline\n";
+    expireConnection(conn);
+  } else {
+    _timers.schedule(conn->_transferTimer, _config.transferTimeoutMs - elapsed);
+  }
+}
+
+void EventLoop::expireConnection(Connection* conn)
+{
+  // Deferred: we're inside the wheel's tick and conn owns the timer.
+  _timers.cancel(conn->_idleTimer);
+  _timers.cancel(conn->_transferTimer);
+  _expired.push_back(conn);
+}
+
+void EventLoop::closeExpiredConnections()
+{
+  for (Connection* conn : _expired) {
+    conn->onTimeout();
+    closeConnection(conn);
+  }
+  _expired.clear();
+}
+
+void EventLoop::closeConnection(Connection* conn)
+{
+  if (conn->_queued) {
+    for (size_t i = 0; i < _ready.size(); i++) {
+      if (_ready[i] == conn) {
+        _ready.erase(_ready.begin() + i);
+        break;
+      }
+    }
+  }
+  // The socket itself may stay open a while for acks still on their way,
+  // so it has to leave the epoll set explicitly.
+  epoll_ctl(_epfd, EPOLL_CTL_DEL, conn->_fd, nullptr);
+  _connections.erase(conn->_fd);
+  delete conn;
+
+  if (_acceptTimer.armed()) {
+    _timers.cancel(_acceptTimer);
+    acceptClients();
+  }
+}
+
+void EventLoop::run()
+{
+  struct epoll_event events[MAX_EVENTS];
+
+  for (;;) {
+    // Don't block while some connection is still waiting for its next turn,
+    // otherwise sleep until traffic arrives or the next deadline is due.
+    int timeout = _ready.empty() ? _timers.millisUntilNext() : 0;
+    int n = epoll_wait(_epfd, events, MAX_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == _listenfd) {
+        acceptClients();
+        continue;
+      }
+      if (fd == _wakefd) {
+        serviceWoken();
+        continue;
+      }
+
+      auto it = _connections.find(fd);
+      if (it == _connections.end() || it->second->_queued || it->second->_throttleTimer.armed())
+        continue;
+      // errors and hangups surface through recv() as well
+      serviceConnection(it->second);
+    }
+
+    runReadyConnections();
+    _timers.advance();
+    closeExpiredConnections();
+  }
+}
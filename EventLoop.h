@@ -0,0 +1,61 @@
+#ifndef _event_loop_
+#define _event_loop_
+
+#include <functional>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "Connection.h"
+#include "ServerConfig.h"
+#include "TimerWheel.h"
+
+// Edge-triggered epoll reactor. A single loop owns the listening socket and
+// every accepted client socket; each client is a non-blocking Connection that
+// is advanced one readiness event at a time, so no thread is ever parked on a
+// single upload. Idle and whole-transfer deadlines live on a timer wheel, so
+// epoll_wait sleeps exactly until the next one is due. A connection whose
+// disk writer fell behind stops reading; the writer pokes an eventfd once
+// it has room again and the loop picks the connection back up. One over its
+// bandwidth, or the listener at the connection limit, is picked back up off
+// the wheel instead.
+class EventLoop
+{
+private:
+	int _epfd;
+	int _listenfd;
+	int _wakefd;
+	const ServerConfig& _config;
+	std::function<std::string()> _nextFilename;
+	std::unordered_map<int, Connection*> _connections;
+	std::vector<Connection*> _ready;
+	TimerWheel _timers;
+	std::vector<Connection*> _expired;
+	std::mutex _wakeLock;
+	std::vector<int> _woken;	// sockets whose ring has room again
+	TimerWheel::Timer _acceptTimer;	// armed while accepting is paused
+
+	bool watch(int fd, uint32_t events);
+	void acceptClients();
+	void pauseAccepting();
+	void wake(int fd);
+	void serviceWoken();
+	void serviceConnection(Connection* conn);
+	void enqueue(Connection* conn);
+	void runReadyConnections();
+	void armTimers(Connection* conn);
+	void onIdleTimer(Connection* conn);
+	void onTransferTimer(Connection* conn);
+	void expireConnection(Connection* conn);
+	void closeExpiredConnections();
+	void closeConnection(Connection* conn);
+
+public:
+	EventLoop(int listenfd, const ServerConfig& config, std::function<std::string()> nextFilename);
+	~EventLoop();
+
+	void run();
+};
+
+#endif
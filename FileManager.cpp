@@ -1,4 +1,13 @@
+#include <chrono>
+#include <fcntl.h>
+#include <mutex>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "FileManager.h"
+#include "Sha256.h"
 
 File::File(std::string filename, std::ios_base::openmode mode)
 : _filename(filename), _mode(mode)
@@ -69,6 +78,655 @@ File& File::close()
 	return *this;
 }
 
+bool File::ok() const
+{
+	return !_fs.fail();
+}
+
+int openDirect(const std::string& filename)
+{
+	return ::open(filename.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+}
+
+static uint64_t roundUp(uint64_t n)
+{
+	return (n + DIRECT_BLOCK - 1) / DIRECT_BLOCK * DIRECT_BLOCK;
+}
+
+static bool pwriteFully(int fd, const char* buf, size_t nbytes, off_t offset)
+{
+	while (nbytes > 0) {
+		ssize_t written = ::pwrite(fd, buf, nbytes, offset);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		buf += written;
+		nbytes -= written;
+		offset += written;
+	}
+	return true;
+}
+
+DirectFile::DirectFile(std::string filename, std::ios_base::openmode mode)
+: _filename(filename), _mode(mode), _fd(-1), _direct(false), _buf(nullptr), _bufLen(0),
+  _bufPos(0), _bufOffset(0), _dirty(false), _failed(false)
+{
+	void* buf = nullptr;
+	if (posix_memalign(&buf, DIRECT_BLOCK, DIRECT_BUFFER) != 0) {
+		perror("posix_memalign");
+		exit(EXIT_FAILURE);
+	}
+	_buf = (char*)buf;
+}
+
+DirectFile::~DirectFile()
+{
+	close();
+	free(_buf);
+}
+
+DirectFile& DirectFile::open()
+{
+	return openWith(_mode);
+}
+
+DirectFile& DirectFile::openWith(std::ios_base::openmode mode)
+{
+	if (_fd != -1)
+		return *this;
+
+	// Read-write even to write: a tail block already on disk has to be read
+	// back before more can be put after it.
+	int flags = O_CLOEXEC;
+	if (mode & (WRITE_ONLY | APPEND_ONLY)) {
+		flags |= O_RDWR | O_CREAT;
+		if ((mode & TRUNC_ONLY) || !(mode & (READ_ONLY | APPEND_ONLY)))
+			flags |= O_TRUNC;		// what fstream does with plain out
+	} else {
+		flags |= O_RDONLY;
+	}
+
+	_direct = true;
+	_fd = ::open(_filename.c_str(), flags | O_DIRECT, 0666);
+	if (_fd == -1 && errno == EINVAL) {
+		_direct = false;
+		_fd = ::open(_filename.c_str(), flags, 0666);
+	}
+	if (_fd == -1) {
+		perror("ERROR");
+		_failed = true;
+		return *this;
+	}
+
+	_bufLen = 0;
+	_bufPos = 0;
+	_bufOffset = 0;
+	_dirty = false;
+	if (mode & APPEND_ONLY) {
+		// pick up a partial last block so the next write lands after it
+		struct stat st;
+		if (fstat(_fd, &st) == -1) {
+			_failed = true;
+			return *this;
+		}
+		_bufOffset = st.st_size / DIRECT_BLOCK * DIRECT_BLOCK;
+		size_t tail = st.st_size - _bufOffset;
+		if (tail > 0 && pread(_fd, _buf, DIRECT_BLOCK, _bufOffset) < (ssize_t)tail) {
+			_failed = true;
+			return *this;
+		}
+		_bufLen = tail;
+	}
+	return *this;
+}
+
+bool DirectFile::flush(bool final)
+{
+	// Whole blocks go out as they are; the rest stays for later unless this
+	// is the end, where it is padded out and the file trimmed back.
+	size_t whole = _bufLen / DIRECT_BLOCK * DIRECT_BLOCK;
+	size_t out = final ? roundUp(_bufLen) : whole;
+	if (out == 0)
+		return true;
+	memset(_buf + _bufLen, 0, out - _bufLen);
+	if (!pwriteFully(_fd, _buf, out, _bufOffset))
+		return false;
+
+	if (final && out != _bufLen) {
+		if (ftruncate(_fd, _bufOffset + _bufLen) == -1)
+			return false;
+	}
+	if (!_direct) {
+		// not much of a bypass, but at least don't keep the pages around
+		sync_file_range(_fd, _bufOffset, out, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+		                                      | SYNC_FILE_RANGE_WAIT_AFTER);
+		posix_fadvise(_fd, _bufOffset, out, POSIX_FADV_DONTNEED);
+	}
+
+	if (final) {
+		_dirty = false;
+		return true;
+	}
+	// a partial block carries over to the front of the buffer
+	memmove(_buf, _buf + whole, _bufLen - whole);
+	_bufOffset += whole;
+	_bufLen -= whole;
+	return true;
+}
+
+DirectFile& DirectFile::write(const char* buf, size_t nbytes)
+{
+	if (_fd == -1)
+		openWith(_mode | APPEND_ONLY);
+	if (_failed)
+		return *this;
+
+	while (nbytes > 0) {
+		size_t take = DIRECT_BUFFER - _bufLen < nbytes ? DIRECT_BUFFER - _bufLen : nbytes;
+		memcpy(_buf + _bufLen, buf, take);
+		_bufLen += take;
+		_dirty = true;
+		buf += take;
+		nbytes -= take;
+		if (_bufLen == DIRECT_BUFFER && !flush(false)) {
+			perror("ERROR");
+			_failed = true;
+			break;
+		}
+	}
+	return *this;
+}
+
+DirectFile& DirectFile::read(char* buf, size_t nbytes)
+{
+	if (_fd == -1) {
+		openWith(_mode | READ_ONLY);
+		_bufLen = 0;
+		_bufOffset = 0;
+	}
+	if (_failed || _dirty)
+		return *this;
+
+	while (nbytes > 0) {
+		if (_bufPos == _bufLen) {
+			// refill with the blocks that follow
+			_bufOffset += _bufLen;
+			_bufPos = 0;
+			ssize_t got = pread(_fd, _buf, DIRECT_BUFFER, _bufOffset);
+			if (got <= 0) {
+				_bufLen = 0;
+				_failed = true;		// short read, as fstream reports it
+				break;
+			}
+			_bufLen = got;
+		}
+		size_t take = _bufLen - _bufPos < nbytes ? _bufLen - _bufPos : nbytes;
+		memcpy(buf, _buf + _bufPos, take);
+		_bufPos += take;
+		buf += take;
+		nbytes -= take;
+	}
+	return *this;
+}
+
+DirectFile& DirectFile::truncate(bool leaveOpen)
+{
+	if (_fd != -1) {
+		::close(_fd);
+		_fd = -1;
+	}
+	remove(_filename.c_str());
+	_dirty = false;
+	openWith(_mode);
+
+	if (!leaveOpen)
+		close();
+	return *this;
+}
+
+DirectFile& DirectFile::close()
+{
+	if (_fd == -1)
+		return *this;
+	if (_dirty && !_failed && !flush(true)) {
+		perror("ERROR");
+		_failed = true;
+	}
+	::close(_fd);
+	_fd = -1;
+	_bufLen = 0;
+	_bufPos = 0;
+	_bufOffset = 0;
+	_dirty = false;
+	return *this;
+}
+
+bool DirectFile::ok() const
+{
+	return !_failed;
+}
+
+// IDs recorded as used per write of the counter file
+const uint64_t FILE_ID_BLOCK = 1024;
+const unsigned FILE_BUCKETS = 256 * 256;
+
+static FileNamer* sharedNamer = nullptr;
+static ChunkStore* sharedStore = nullptr;
+
+static uint64_t nowMicros()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The gear table is fixed so the same bytes cut the same way on every run.
+static const uint64_t* gearTable()
+{
+	static uint64_t table[256];
+	static std::once_flag once;
+	std::call_once(once, []() {
+		uint64_t x = 0x9e3779b97f4a7c15ULL;		// splitmix64
+		for (int i = 0; i < 256; i++) {
+			x += 0x9e3779b97f4a7c15ULL;
+			uint64_t z = x;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			table[i] = z ^ (z >> 31);
+		}
+	});
+	return table;
+}
+
+static unsigned log2Of(size_t n)
+{
+	unsigned bits = 0;
+	while ((size_t)1 << (bits + 1) <= n)
+		bits++;
+	return bits;
+}
+
+// top `bits` bits set: the gear hash mixes best at the high end
+static uint64_t topMask(unsigned bits)
+{
+	return bits == 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+template <class F>
+static bool writeChunk(const std::string& path, const char* data, size_t len)
+{
+	F chunk(path, WRITE_ONLY);
+	chunk.write(data, len).close();
+	return chunk.ok();
+}
+
+FileNamer::FileNamer(std::string dir)
+: _dir(dir), _next(1), _reserved(1), _made(FILE_BUCKETS)
+{
+	// everything goes inside dir, not next to it
+	if (!_dir.empty() && _dir.back() != '/')
+		_dir += '/';
+	std::ifstream in(_dir + "next-id");
+	if (in.is_open()) {
+		uint64_t next = 0;
+		in >> next;
+		if (in.fail() || next == 0) {
+			// starting over could hand out names already taken
+			std::cerr << "ERROR: can't read " << _dir << "next-id\n";
+			exit(EXIT_FAILURE);
+		}
+		_next = next;
+		_reserved = next;
+	}
+}
+
+std::string FileNamer::next()
+{
+	uint64_t id = _next++;
+	if (id >= _reserved)
+		reserve(id);
+	return bucket(id) + std::to_string(id) + ".file";
+}
+
+void FileNamer::reserve(uint64_t id)
+{
+	// Everyone else past the end waits here for the one that records the
+	// next block; IDs below it go on without the lock.
+	std::lock_guard<std::mutex> guard(_reserveLock);
+	while (_reserved <= id) {
+		uint64_t upTo = _reserved + FILE_ID_BLOCK;
+		if (!record(upTo)) {
+			// Not reserved, so the next name tries again. Opening the files
+			// won't clobber any meanwhile.
+			perror("ERROR: next-id");
+			return;
+		}
+		_reserved = upTo;
+	}
+}
+
+bool FileNamer::record(uint64_t next)
+{
+	// aside and renamed over, as TransferRegistry saves its checkpoints
+	std::string path = _dir + "next-id";
+	std::string tmp = path + ".tmp";
+	std::string text = std::to_string(next) + "\n";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd == -1)
+		return false;
+	bool ok = write(fd, text.data(), text.size()) == (ssize_t)text.size() && fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(tmp.c_str(), path.c_str()) == -1) {
+		unlink(tmp.c_str());
+		return false;
+	}
+
+	// the rename is only durable once the directory is
+	int dirfd = open(_dir.empty() ? "." : _dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirfd == -1)
+		return false;
+	ok = fsync(dirfd) == 0;
+	close(dirfd);
+	return ok;
+}
+
+std::string FileNamer::bucket(uint64_t id)
+{
+	// splitmix64's finalizer: neighbouring IDs land far apart
+	uint64_t z = id;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	z ^= z >> 31;
+	unsigned index = z % FILE_BUCKETS;
+
+	char name[8];
+	snprintf(name, sizeof(name), "%02x/%02x/", index >> 8, index & 0xff);
+	std::string dir = _dir + name;
+	if (!_made[index]) {
+		// a failure shows up when the file won't open
+		std::string parent = dir.substr(0, _dir.size() + 2);
+		if (mkdir(parent.c_str(), 0777) == -1 && errno != EEXIST)
+			perror("ERROR");
+		else if (mkdir(dir.c_str(), 0777) == -1 && errno != EEXIST)
+			perror("ERROR");
+		else
+			_made[index] = true;
+	}
+	return dir;
+}
+
+void FileNamer::configure(std::string dir)
+{
+	delete sharedNamer;
+	sharedNamer = new FileNamer(dir);
+}
+
+FileNamer* FileNamer::shared()
+{
+	return sharedNamer;
+}
+
+ChunkStore::ChunkStore(std::string dir, size_t avgChunk, bool direct)
+: _dir(dir), _direct(direct), _minChunk(avgChunk / 4), _avgChunk(avgChunk), _maxChunk(avgChunk * 4),
+  _logicalBytes(0), _storedBytes(0), _chunks(0), _newChunks(0), _tmpSeq(0)
+{
+	if (mkdir(_dir.c_str(), 0777) == -1 && errno != EEXIST)
+		perror("ERROR");
+}
+
+bool ChunkStore::put(const char* data, size_t len, std::string& hash, bool& isNew)
+{
+	hash = Sha256::hex(data, len);
+	std::string subdir = _dir + hash.substr(0, 2);
+	std::string path = subdir + "/" + hash;
+	_logicalBytes += len;
+	_chunks++;
+
+	isNew = access(path.c_str(), F_OK) != 0;
+	if (!isNew)
+		return true;
+
+	if (mkdir(subdir.c_str(), 0777) == -1 && errno != EEXIST)
+		return false;
+	std::string tmp = _dir + "tmp." + std::to_string(getpid()) + "." + std::to_string(_tmpSeq++);
+	if (!(_direct ? writeChunk<DirectFile>(tmp, data, len) : writeChunk<File>(tmp, data, len))) {
+		remove(tmp.c_str());
+		return false;
+	}
+
+	// whoever links first wins; a loser's copy is identical anyway
+	if (link(tmp.c_str(), path.c_str()) == -1) {
+		if (errno != EEXIST) {
+			remove(tmp.c_str());
+			return false;
+		}
+		isNew = false;
+	}
+	remove(tmp.c_str());
+
+	if (isNew) {
+		_newChunks++;
+		_storedBytes += len;
+	}
+	return true;
+}
+
+void ChunkStore::configure(std::string dir, size_t avgChunk, bool direct)
+{
+	delete sharedStore;
+	sharedStore = new ChunkStore(dir, avgChunk, direct);
+}
+
+ChunkStore* ChunkStore::shared()
+{
+	return sharedStore;
+}
+
+ChunkedFile::ChunkedFile(ChunkStore& store)
+: _store(store), _scanned(0), _hash(0), _bytes(0), _chunks(0), _newChunks(0), _newBytes(0),
+  _startedAt(nowMicros())
+{
+	_pending.reserve(store.maxChunk() * 2);
+}
+
+size_t ChunkedFile::findCut(bool atEnd)
+{
+	// Returns the chunk length, or 0 if more bytes are needed to decide.
+	const uint64_t* gear = gearTable();
+	size_t size = _pending.size();
+	size_t limit = size < _store.maxChunk() ? size : _store.maxChunk();
+	size_t normal = _store.avgChunk();
+	unsigned bits = log2Of(_store.avgChunk());
+	uint64_t maskSmall = topMask(bits + 2);
+	uint64_t maskLarge = topMask(bits > 2 ? bits - 2 : 0);
+
+	size_t i = _scanned > _store.minChunk() ? _scanned : _store.minChunk();
+	if (i >= limit)
+		return size >= _store.maxChunk() || atEnd ? limit : 0;
+
+	const unsigned char* p = (const unsigned char*)_pending.data();
+	uint64_t hash = _hash;
+	for (; i < limit; i++) {
+		hash = (hash << 1) + gear[p[i]];
+		if (!(hash & (i < normal ? maskSmall : maskLarge))) {
+			_scanned = 0;
+			_hash = 0;
+			return i + 1;
+		}
+	}
+
+	if (size >= _store.maxChunk() || atEnd) {
+		_scanned = 0;
+		_hash = 0;
+		return limit;
+	}
+	_scanned = i;
+	_hash = hash;
+	return 0;
+}
+
+bool ChunkedFile::emit(size_t len)
+{
+	std::string hash;
+	bool isNew;
+	if (!_store.put(_pending.data(), len, hash, isNew))
+		return false;
+
+	_manifest += hash + " " + std::to_string(len) + "\n";
+	_chunks++;
+	if (isNew) {
+		_newChunks++;
+		_newBytes += len;
+	}
+	_pending.erase(_pending.begin(), _pending.begin() + len);
+	return true;
+}
+
+bool ChunkedFile::write(const char* data, size_t len)
+{
+	_pending.insert(_pending.end(), data, data + len);
+	_bytes += len;
+
+	size_t cut;
+	while ((cut = findCut(false)) > 0) {
+		if (!emit(cut))
+			return false;
+	}
+	return true;
+}
+
+bool ChunkedFile::finish()
+{
+	size_t cut;
+	while (!_pending.empty() && (cut = findCut(true)) > 0) {
+		if (!emit(cut))
+			return false;
+	}
+	return true;
+}
+
+void ChunkedFile::report(const std::string& name) const
+{
+	double seconds = (nowMicros() - _startedAt) / 1e6;
+	double ratio = _newBytes > 0 ? (double)_bytes / _newBytes : 0;
+	std::cerr << name << ": " << _bytes << " bytes in " << _chunks << " chunks, "
+	          << _newChunks << " new (" << _newBytes << " bytes stored), dedup ";
+	if (_newBytes > 0)
+		std::cerr << ratio << "x";
+	else
+		std::cerr << "all";
+	std::cerr << ", " << (seconds > 0 ? _bytes / seconds / (1 << 20) : 0) << " MB/s\n";
+}
+
+FileManager::FileManager(Reactor& reactor, int fd)
+: _reactor(reactor), _fd(fd), _timeoutMs(0)
+{
+}
+
+// Each call below tries first and waits only on EAGAIN, so a descriptor
+// that always has data (or room) never touches the reactor.
+
+Task<ssize_t> FileManager::readBytesFromFileToBuffer(char* buf, size_t nbytes)
+{
+	for (;;) {
+		ssize_t n = read(_fd, buf, nbytes);
+		if (n >= 0)
+			co_return n;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (!co_await _reactor.readable(_fd, _timeoutMs)) {
+			errno = ETIMEDOUT;
+			co_return -1;
+		}
+	}
+}
+
+Task<ssize_t> FileManager::writeBytesFromBufferToFile(const char* buf, size_t nbytes)
+{
+	size_t done = 0;
+	while (done < nbytes) {
+		ssize_t n = write(_fd, buf + done, nbytes - done);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (!co_await _reactor.writable(_fd, _timeoutMs)) {
+			errno = ETIMEDOUT;
+			co_return -1;
+		}
+	}
+	co_return done;
+}
+
+Task<ssize_t> FileManager::readBytesFromSocketToBuffer(int socket, char* buf, size_t nbytes)
+{
+	for (;;) {
+		ssize_t n = recv(socket, buf, nbytes, MSG_DONTWAIT);
+		if (n >= 0)
+			co_return n;
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (!co_await _reactor.readable(socket, _timeoutMs)) {
+			errno = ETIMEDOUT;
+			co_return -1;
+		}
+	}
+}
+
+Task<ssize_t> FileManager::writeBytesFromBufferToSocket(const char* buf, size_t nbytes, int socket)
+{
+	size_t done = 0;
+	while (done < nbytes) {
+		ssize_t n = send(socket, buf + done, nbytes - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (!co_await _reactor.writable(socket, _timeoutMs)) {
+			errno = ETIMEDOUT;
+			co_return -1;
+		}
+	}
+	co_return done;
+}
+
+Task<ssize_t> FileManager::sendFileToSocket(int socket, off_t& offset, size_t count)
+{
+	// sendfile() blocks on a blocking socket whatever the flags, so this only
+	// interleaves with other coroutines when the socket is non-blocking.
+	size_t done = 0;
+	while (done < count) {
+		ssize_t n = sendfile(socket, _fd, &offset, count - done);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n == 0)
+			break;		// the file ended early
+		if (errno == EINTR)
+			continue;
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			co_return -1;
+		if (!co_await _reactor.writable(socket, _timeoutMs)) {
+			errno = ETIMEDOUT;
+			co_return -1;
+		}
+	}
+	co_return done;
+}
+
 #ifdef TEST
 const char* testCaseSeparator = "\n\n================================================================================\n";
 
@@ -163,6 +821,30 @@ void testMultiObjectmethodAccessor() {
 	std::cerr << "contents of \"test5.txt\": " << buf << std::endl;
 }
 
+void testDirect() {
+	std::cerr << testCaseSeparator;
+	std::cerr << "Testing \"DirectFile\" with a multi-buffer write and an unaligned tail\n";
+
+	std::string data;
+	while (data.size() < DIRECT_BUFFER * 2 + 1000)
+		data += buf3;
+	DirectFile f("test6.txt", WRITE_ONLY);
+	f.write(data.data(), data.size() / 2).write(data.data() + data.size() / 2, data.size() - data.size() / 2).close();
+	std::cerr << "O_DIRECT " << (f._direct ? "used" : "refused, fell back") << "\n";
+
+	struct stat st;
+	stat("test6.txt", &st);
+	std::vector<char> back(data.size());
+	f.read(back.data(), back.size()).close();
+	bool same = f.ok() && (size_t)st.st_size == data.size() && memcmp(back.data(), data.data(), data.size()) == 0;
+	std::cerr << "wrote " << data.size() << " bytes, file has " << st.st_size << ", contents "
+	          << (same ? "match" : "DIFFER") << std::endl;
+
+	f.write(buf1, strlen(buf1)).close();
+	stat("test6.txt", &st);
+	std::cerr << "appended " << strlen(buf1) << " bytes, file has " << st.st_size << std::endl;
+}
+
 int main(void)
 {
 	testWrite();
@@ -173,6 +855,8 @@ int main(void)
 
 	testMultiObjectmethodAccessor();
 
+	testDirect();
+
 	return 0;
 }
 #endif
\ No newline at end of file
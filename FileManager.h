@@ -3,13 +3,21 @@
 
 #include <iostream>
 #include <fstream>
+#include <atomic>
 #include <cerrno>
+#include <stdint.h>
 #include <unistd.h>
 // #include <cstdio>
 #include <cstdlib>
-// #include <string>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
 #include <sys/types.h>
 
+#include "Reactor.h"
+#include "Task.h"
+
 #ifndef READ_ONLY
 #define READ_ONLY std::ios_base::in
 #endif
@@ -27,6 +35,14 @@
 #define KEEP_OPEN true
 #endif
 
+// O_DIRECT transfers have to start, end and sit in memory on this boundary.
+#ifndef DIRECT_BLOCK
+#define DIRECT_BLOCK 4096
+#endif
+#ifndef DIRECT_BUFFER
+#define DIRECT_BUFFER (256 << 10)
+#endif
+
 struct File {
 	std::string _filename;
 	std::fstream _fs;
@@ -39,20 +55,169 @@ struct File {
 	File& read(char* buf, size_t nbytes);
 	File& write(const char* buf, size_t nbytes);
 	File& truncate(bool leaveOpen);
+	bool ok() const;
+};
+
+// Same chained interface as File, but the bytes bypass the page cache: the
+// file is opened O_DIRECT and written in whole blocks out of an aligned
+// buffer, so a big ingest doesn't evict everybody else's working set. A
+// tail that doesn't fill a block goes out padded and the file is trimmed
+// back to its real length on close. Where the filesystem refuses O_DIRECT
+// the writes are ordinary ones and the pages are dropped once written.
+struct DirectFile {
+	std::string _filename;
+	std::ios_base::openmode _mode;
+	int _fd;
+	bool _direct;		// O_DIRECT took
+	char* _buf;		// DIRECT_BLOCK aligned, DIRECT_BUFFER long
+	size_t _bufLen;		// staged for writing, or read ahead
+	size_t _bufPos;		// next byte read() hands out
+	uint64_t _bufOffset;	// where _buf sits in the file
+	bool _dirty;		// _buf holds unwritten bytes
+	bool _failed;
+
+	DirectFile(std::string filename, std::ios_base::openmode mode);
+	~DirectFile();
+
+	DirectFile& open();
+	DirectFile& close();
+	DirectFile& read(char* buf, size_t nbytes);
+	DirectFile& write(const char* buf, size_t nbytes);
+	DirectFile& truncate(bool leaveOpen);
+	bool ok() const;
+
+private:
+	DirectFile& openWith(std::ios_base::openmode mode);
+	bool flush(bool final);
+};
+
+// Opens filename for writing with O_DIRECT, -1 if the filesystem won't.
+int openDirect(const std::string& filename);
+
+// Names for received files, <dir>/<xx>/<yy>/<id>.file. IDs are 64-bit, one
+// atomic add each from any thread, and never handed out twice, restarts
+// included: the next free one is kept in <dir>/next-id and moved ahead a
+// block at a time, so one name in FILE_ID_BLOCK touches that file and a
+// restart skips the rest of the last block. The two directory levels come
+// from a hash of the ID, which spreads files evenly over 65536 directories
+// however many there are; each is made the first time a name lands in it.
+class FileNamer
+{
+private:
+	std::string _dir;
+	std::atomic<uint64_t> _next;
+	std::atomic<uint64_t> _reserved;	// IDs below this are on record
+	std::mutex _reserveLock;
+	std::vector<std::atomic<bool> > _made;	// per bucket
+
+	void reserve(uint64_t id);
+	bool record(uint64_t next);
+	std::string bucket(uint64_t id);
+
+public:
+	explicit FileNamer(std::string dir);
+
+	std::string next();
+
+	static void configure(std::string dir);
+	static FileNamer* shared();		// nullptr unless configured
 };
 
+// Content-addressed store for deduplicated uploads. Every chunk lives once,
+// under <dir>/<first two hex digits>/<sha256>, no matter how many uploads
+// contain it. Safe to share between threads: a chunk is written aside and
+// linked into place, so two uploads storing the same chunk can't clash.
+class ChunkStore
+{
+private:
+	std::string _dir;
+	bool _direct;		// chunks go to disk through DirectFile
+	size_t _minChunk;
+	size_t _avgChunk;
+	size_t _maxChunk;
+	std::atomic<uint64_t> _logicalBytes;	// everything uploaded
+	std::atomic<uint64_t> _storedBytes;	// what actually hit the disk
+	std::atomic<uint64_t> _chunks;
+	std::atomic<uint64_t> _newChunks;
+	std::atomic<unsigned> _tmpSeq;
+
+public:
+	ChunkStore(std::string dir, size_t avgChunk, bool direct);
+
+	// Stores the chunk unless it is already there; hash gets its name.
+	bool put(const char* data, size_t len, std::string& hash, bool& isNew);
+
+	size_t minChunk() const { return _minChunk; }
+	size_t avgChunk() const { return _avgChunk; }
+	size_t maxChunk() const { return _maxChunk; }
+	uint64_t logicalBytes() const { return _logicalBytes; }
+	uint64_t storedBytes() const { return _storedBytes; }
+	uint64_t chunks() const { return _chunks; }
+	uint64_t newChunks() const { return _newChunks; }
+
+	static void configure(std::string dir, size_t avgChunk, bool direct);
+	static ChunkStore* shared();		// nullptr unless configured
+};
+
+// One upload being cut into chunks as it streams in, FastCDC style: a gear
+// hash rolls over the bytes and a chunk ends where its top bits are all
+// zero, with a stricter mask before the average size and a looser one after
+// so chunk sizes cluster around it. An insert early in a file only moves
+// the boundaries near it, so the rest of the file dedups against the
+// previous version. The manifest lists "<sha256> <length>" per chunk.
+class ChunkedFile
+{
+private:
+	ChunkStore& _store;
+	std::vector<char> _pending;	// bytes not cut into a chunk yet
+	size_t _scanned;		// how far into _pending the hash has rolled
+	uint64_t _hash;
+	std::string _manifest;
+	uint64_t _bytes;
+	uint64_t _chunks;
+	uint64_t _newChunks;
+	uint64_t _newBytes;
+	uint64_t _startedAt;
+
+	size_t findCut(bool atEnd);
+	bool emit(size_t len);
+
+public:
+	ChunkedFile(ChunkStore& store);
+
+	bool write(const char* data, size_t len);
+	// Flush the tail; afterwards manifest() is complete.
+	bool finish();
+	const std::string& manifest() const { return _manifest; }
+	void report(const std::string& name) const;
+};
+
+// Transfers for coroutines on a Reactor. Every call is co_awaited and
+// returns what read(2) or write(2) would, -1 with errno set on failure,
+// ETIMEDOUT once the timeout passes without the descriptor becoming ready.
+// Nothing blocks: on EAGAIN the coroutine waits on the reactor and lets the
+// others run. Reads return whatever is there, up to nbytes, and 0 at end
+// of file; writes return only once all nbytes went out. The file is the one
+// given at construction, its position advancing like read()/write().
 class FileManager
 {
 private:
-	std::string _filename;
-	FILE* _ofile;
+	Reactor& _reactor;
+	int _fd;			// the file side, -1: none
+	unsigned _timeoutMs;	// per wait, 0: none
+
 public:
-	FileManager(std::string filename);
-	~FileManager();
-	
-	int readBytesFromFileToBuffer(char* buf, size_t nbytes);
-	int writeBytesFromBufferToFile(const char* buf, size_t nbytes);
-	int readBytesFromSocketToBuffer(int socket, char* buf, size_t nbytes);
-	int writeBytesFromBufferToSocket(const char* buf, size_t nbytes, int socket);
+	FileManager(Reactor& reactor, int fd = -1);
+
+	int fd() const { return _fd; }
+	void setTimeout(unsigned millis) { _timeoutMs = millis; }
+
+	Task<ssize_t> readBytesFromFileToBuffer(char* buf, size_t nbytes);
+	Task<ssize_t> writeBytesFromBufferToFile(const char* buf, size_t nbytes);
+	Task<ssize_t> readBytesFromSocketToBuffer(int socket, char* buf, size_t nbytes);
+	Task<ssize_t> writeBytesFromBufferToSocket(const char* buf, size_t nbytes, int socket);
+	// sendfile(2) of count bytes of the file from offset on, which advances;
+	// -1 with EINVAL straight away if this file or socket can't do it.
+	Task<ssize_t> sendFileToSocket(int socket, off_t& offset, size_t count);
 };
 #endif
\ No newline at end of file
@@ -0,0 +1,98 @@
+#ifndef _mpmc_queue_
+#define _mpmc_queue_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Bounded multi-producer/multi-consumer queue (Vyukov's sequenced ring).
+// Every slot carries a sequence number that tells producers and consumers
+// whose turn it is, so push/pop are a single CAS on the shared cursor and
+// never take a lock. Capacity is rounded up to a power of two.
+template <typename T>
+class MPMCQueue
+{
+private:
+	struct Slot {
+		std::atomic<size_t> _seq;
+		T _value;
+	};
+
+	std::vector<Slot> _slots;
+	size_t _mask;
+	// keep the cursors on separate cache lines, producers and consumers
+	// hammer them from different cores
+	alignas(64) std::atomic<size_t> _head;
+	alignas(64) std::atomic<size_t> _tail;
+
+	static size_t roundUp(size_t n)
+	{
+		size_t cap = 2;
+		while (cap < n)
+			cap <<= 1;
+		return cap;
+	}
+
+public:
+	MPMCQueue(size_t capacity)
+	: _slots(roundUp(capacity)), _mask(roundUp(capacity) - 1), _head(0), _tail(0)
+	{
+		for (size_t i = 0; i < _slots.size(); i++)
+			_slots[i]._seq.store(i, std::memory_order_relaxed);
+	}
+
+	bool tryPush(const T& value)
+	{
+		size_t pos = _tail.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot& slot = _slots[pos & _mask];
+			size_t seq = slot._seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0) {
+				if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					slot._value = value;
+					slot._seq.store(pos + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;		// full
+			} else {
+				pos = _tail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool tryPop(T& value)
+	{
+		size_t pos = _head.load(std::memory_order_relaxed);
+		for (;;) {
+			Slot& slot = _slots[pos & _mask];
+			size_t seq = slot._seq.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0) {
+				if (_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+					value = slot._value;
+					slot._seq.store(pos + _mask + 1, std::memory_order_release);
+					return true;
+				}
+			} else if (diff < 0) {
+				return false;		// empty
+			} else {
+				pos = _head.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	// Approximate; only meaningful as a gauge.
+	size_t size() const
+	{
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		size_t head = _head.load(std::memory_order_relaxed);
+		return tail > head ? tail - head : 0;
+	}
+
+	size_t capacity() const { return _mask + 1; }
+};
+
+#endif
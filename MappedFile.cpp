@@ -0,0 +1,71 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MappedFile.h"
+
+MappedFile::MappedFile(int fd, size_t window)
+: _fd(fd), _window(0), _fileSize(0), _base(nullptr), _start(0), _len(0), _failed(true)
+{
+  struct stat st;
+  if (window == 0 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    return;
+  size_t page = sysconf(_SC_PAGESIZE);
+  _window = (window + page - 1) / page * page;
+  _fileSize = st.st_size;
+  _failed = false;
+}
+
+MappedFile::~MappedFile()
+{
+  if (_base != nullptr)
+    munmap(_base, _len);
+}
+
+bool MappedFile::slide(uint64_t offset)
+{
+  if (_base != nullptr) {
+    munmap(_base, _len);
+    _base = nullptr;
+  }
+
+  // mmap() wants a page-aligned file offset, and _window is whole pages
+  _start = offset - offset % sysconf(_SC_PAGESIZE);
+  _len = _fileSize - _start < _window ? _fileSize - _start : _window;
+  void* base = mmap(nullptr, _len, PROT_READ, MAP_SHARED, _fd, _start);
+  if (base == MAP_FAILED) {
+    perror("ERROR");
+    _failed = true;
+    return false;
+  }
+  _base = (char*)base;
+
+  // Advice only; a kernel that ignores it still gets the bytes right.
+  madvise(_base, _len, MADV_SEQUENTIAL);
+  madvise(_base, _len, MADV_WILLNEED);
+  uint64_t next = _start + _len;
+  if (next < _fileSize)
+    posix_fadvise(_fd, next, _window, POSIX_FADV_WILLNEED);
+  return true;
+}
+
+const char* MappedFile::view(uint64_t offset, size_t& len)
+{
+  if (_failed)
+    return nullptr;
+  if (offset >= _fileSize) {
+    len = 0;
+    return nullptr;
+  }
+  if (_base == nullptr || offset < _start || offset >= _start + _len) {
+    if (!slide(offset))
+      return nullptr;
+  }
+
+  size_t left = _start + _len - offset;
+  if (len > left)
+    len = left;
+  return _base + (offset - _start);
+}
@@ -0,0 +1,47 @@
+#ifndef _mapped_file_
+#define _mapped_file_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// --mmap window when none is given
+const size_t DEFAULT_MMAP_WINDOW = 64 << 20;
+// what the copy loops hand write() at a time out of a mapping
+const size_t MMAP_SLICE = 4 << 20;
+
+// Read-only view of a regular file through a window of mmap() that slides
+// forward as the file is read, so a file of any size costs at most one
+// window of address space. Each window is mapped with MADV_SEQUENTIAL and
+// MADV_WILLNEED, and readahead for the one after it starts as soon as it is
+// mapped, so the bytes are usually in the page cache before they're needed.
+//
+// A file truncated underneath a mapping raises SIGBUS on the next touch of
+// the missing pages; the client sends files that are at rest, as the
+// header's size already assumes.
+class MappedFile
+{
+private:
+	int _fd;
+	size_t _window;
+	uint64_t _fileSize;
+	char* _base;		// current window, null before the first view
+	uint64_t _start;		// file offset _base maps
+	size_t _len;
+	bool _failed;
+
+	bool slide(uint64_t offset);
+
+public:
+	// window 0, or a file that isn't regular, gives a MappedFile that never
+	// maps and leaves the reading to the caller
+	MappedFile(int fd, size_t window);
+	~MappedFile();
+
+	bool usable() const { return !_failed; }
+	// Points at the bytes at offset and cuts len down to what the window
+	// holds from there. Null when the mapping failed (usable() is false from
+	// then on), or, with len set to 0, past the end of the file.
+	const char* view(uint64_t offset, size_t& len);
+};
+
+#endif
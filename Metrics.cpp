@@ -0,0 +1,180 @@
+#include <time.h>
+
+#include <atomic>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+#include "Metrics.h"
+
+struct Shard {
+	std::atomic<uint64_t> _counters[Metrics::COUNTERS];
+	// the last bucket of each is the overflow past HISTOGRAM_MAX_BITS
+	std::atomic<uint64_t> _buckets[Metrics::HISTOGRAMS][HISTOGRAM_BUCKETS + 1];
+	std::atomic<uint64_t> _sums[Metrics::HISTOGRAMS];
+
+	Shard()
+	{
+		for (auto& counter : _counters)
+			counter = 0;
+		for (auto& buckets : _buckets)
+			for (auto& bucket : buckets)
+				bucket = 0;
+		for (auto& sum : _sums)
+			sum = 0;
+	}
+};
+
+// Shards outlive their threads, or the totals would go backwards.
+static std::mutex shardsLock;
+static std::vector<Shard*> shards;
+static thread_local Shard* localShard = nullptr;
+
+static Shard& local()
+{
+  if (localShard == nullptr) {
+    localShard = new Shard();
+    std::lock_guard<std::mutex> guard(shardsLock);
+    shards.push_back(localShard);
+  }
+  return *localShard;
+}
+
+// Only the owning thread writes a shard, so there is no need for an atomic
+// read-modify-write; readers just see the old or the new value.
+static void bump(std::atomic<uint64_t>& value, uint64_t n)
+{
+  value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static unsigned bucketOf(uint64_t micros)
+{
+  if (micros < HISTOGRAM_STEPS)
+    return micros;
+  unsigned bits = 63 - __builtin_clzll(micros);
+  if (bits >= HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_BUCKETS;
+  unsigned shift = bits - HISTOGRAM_STEP_BITS;
+  return HISTOGRAM_STEPS * (shift + 1) + (unsigned)(micros >> shift) - HISTOGRAM_STEPS;
+}
+
+// the largest value that lands in bucket
+static uint64_t bucketTop(unsigned bucket)
+{
+  if (bucket < HISTOGRAM_STEPS)
+    return bucket;
+  unsigned shift = bucket / HISTOGRAM_STEPS - 1;
+  uint64_t step = bucket % HISTOGRAM_STEPS;
+  return ((HISTOGRAM_STEPS + step + 1) << shift) - 1;
+}
+
+void Metrics::count(Counter counter, uint64_t n)
+{
+  bump(local()._counters[counter], n);
+}
+
+void Metrics::record(Histogram histogram, uint64_t micros)
+{
+  Shard& shard = local();
+  bump(shard._buckets[histogram][bucketOf(micros)], 1);
+  bump(shard._sums[histogram], micros);
+}
+
+static const struct {
+	const char* _name;
+	const char* _help;
+} counterNames[Metrics::COUNTERS] = {
+	{ "fileserver_connections_accepted_total", "Client connections accepted." },
+	{ "fileserver_connections_closed_total", "Client connections closed." },
+	{ "fileserver_received_bytes_total", "Bytes read from client sockets." },
+	{ "fileserver_sent_bytes_total", "Reply bytes written to client sockets." },
+	{ "fileserver_timeouts_total", "Connections dropped for being idle or too slow." },
+	{ "fileserver_write_errors_total", "Failed writes or syncs of received file data." },
+	{ "fileserver_files_total", "Uploads finished, stored or refused." },
+	{ "fileserver_connections_shed_total", "Connections refused at the connection limit." },
+	{ "fileserver_throttled_total", "Times a connection was held back for exceeding its bandwidth." },
+}, histogramNames[Metrics::HISTOGRAMS] = {
+	{ "fileserver_first_byte_seconds", "Time from accept to the first byte from the client." },
+	{ "fileserver_transfer_seconds", "Time from the start of a file to its end." },
+	{ "fileserver_recv_to_write_seconds", "Time from receiving a buffer to writing it to the file." },
+	{ "fileserver_accept_wait_seconds", "Time a connection waited in the listen queue to be accepted." },
+};
+
+static double monotonicSeconds()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// for the accept rate: what the previous render saw, and when
+static std::mutex rateLock;
+static uint64_t lastAccepted = 0;
+static double lastRendered = monotonicSeconds();
+
+static void header(std::ostream& out, const char* name, const char* help, const char* type)
+{
+  out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n";
+}
+
+void Metrics::render(std::ostream& out)
+{
+  uint64_t counters[COUNTERS] = {};
+  uint64_t buckets[HISTOGRAMS][HISTOGRAM_BUCKETS + 1] = {};
+  uint64_t sums[HISTOGRAMS] = {};
+  {
+    std::lock_guard<std::mutex> guard(shardsLock);
+    for (Shard* shard : shards) {
+      for (unsigned c = 0; c < COUNTERS; c++)
+        counters[c] += shard->_counters[c].load(std::memory_order_relaxed);
+      for (unsigned h = 0; h < HISTOGRAMS; h++) {
+        for (unsigned b = 0; b <= HISTOGRAM_BUCKETS; b++)
+          buckets[h][b] += shard->_buckets[h][b].load(std::memory_order_relaxed);
+        sums[h] += shard->_sums[h].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Accepts per second since whoever rendered last (a scrape or a
+  // SIGUSR1 dump); the first time, since the server started.
+  double rate = 0;
+  {
+    std::lock_guard<std::mutex> guard(rateLock);
+    double now = monotonicSeconds();
+    if (now > lastRendered)
+      rate = (counters[ACCEPTED] - lastAccepted) / (now - lastRendered);
+    lastAccepted = counters[ACCEPTED];
+    lastRendered = now;
+  }
+
+  std::ios::fmtflags flags = out.flags();
+  std::streamsize precision = out.precision(10);
+
+  for (unsigned c = 0; c < COUNTERS; c++) {
+    header(out, counterNames[c]._name, counterNames[c]._help, "counter");
+    out << counterNames[c]._name << " " << counters[c] << "\n";
+  }
+  header(out, "fileserver_connections_active", "Client connections open now.", "gauge");
+  // the shards aren't read at one instant, so a close can show up before its accept
+  uint64_t active = counters[ACCEPTED] > counters[CLOSED] ? counters[ACCEPTED] - counters[CLOSED] : 0;
+  out << "fileserver_connections_active " << active << "\n";
+  header(out, "fileserver_accepts_per_second", "Accept rate since the previous scrape.", "gauge");
+  out << "fileserver_accepts_per_second " << rate << "\n";
+
+  for (unsigned h = 0; h < HISTOGRAMS; h++) {
+    const char* name = histogramNames[h]._name;
+    header(out, name, histogramNames[h]._help, "histogram");
+    uint64_t cumulative = 0;
+    for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+      cumulative += buckets[h][b];
+      out << name << "_bucket{le=\"" << bucketTop(b) / 1e6 << "\"} " << cumulative << "\n";
+    }
+    cumulative += buckets[h][HISTOGRAM_BUCKETS];
+    out << name << "_bucket{le=\"+Inf\"} " << cumulative << "\n";
+    out << name << "_sum " << sums[h] / 1e6 << "\n";
+    out << name << "_count " << cumulative << "\n";
+  }
+
+  out.precision(precision);
+  out.flags(flags);
+}
@@ -0,0 +1,52 @@
+#ifndef _metrics_
+#define _metrics_
+
+#include <iosfwd>
+#include <stdint.h>
+
+// Server-wide counters and latency histograms, cheap enough for the receive
+// path. Every thread that records anything gets its own shard, written only
+// by that thread with plain relaxed stores, so recording is a load and a
+// store on a cache line nobody else writes; a reader sums the shards.
+//
+// Histograms are log-linear in the manner of HdrHistogram: each power of
+// two of microseconds is split into HISTOGRAM_STEPS equal buckets, so any
+// value is placed within a quarter of itself, from 1us up to about 19 hours.
+
+const unsigned HISTOGRAM_STEP_BITS = 2;
+const unsigned HISTOGRAM_STEPS = 1 << HISTOGRAM_STEP_BITS;
+const unsigned HISTOGRAM_MAX_BITS = 36;	// 2^36us; anything longer only counts in +Inf
+const unsigned HISTOGRAM_BUCKETS = HISTOGRAM_STEPS * (HISTOGRAM_MAX_BITS - HISTOGRAM_STEP_BITS + 1);
+
+class Metrics
+{
+public:
+	enum Counter {
+		ACCEPTED,			// connections
+		CLOSED,
+		BYTES_RECEIVED,		// off the sockets, before decoding
+		BYTES_SENT,			// replies
+		TIMEOUTS,
+		WRITE_ERRORS,		// file data that didn't make it to disk
+		FILES,			// uploads finished, stored or not
+		SHED,				// turned away at the connection limit
+		THROTTLED,			// reads held back for bandwidth
+		COUNTERS
+	};
+
+	enum Histogram {
+		FIRST_BYTE,			// accept to the first byte from the client
+		TRANSFER,			// a file's start to its finish
+		RECV_TO_WRITE,		// a buffer's first byte received to it being written
+		ACCEPT_WAIT,		// in the listen queue, to the nearest millisecond
+		HISTOGRAMS
+	};
+
+	static void count(Counter counter, uint64_t n = 1);
+	static void record(Histogram histogram, uint64_t micros);
+
+	// Everything so far in the Prometheus text format.
+	static void render(std::ostream& out);
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <string.h>
+
+#include "Protocol.h"
+
+static const unsigned char MAGIC[UPLOAD_MAGIC_LEN] = { 0x89, 'M', 'C', 'S' };
+static const unsigned char REPLY_MAGIC[UPLOAD_MAGIC_LEN] = { 0x89, 'M', 'C', 'R' };
+
+static uint16_t get16(const char* p)
+{
+  const unsigned char* u = (const unsigned char*)p;
+  return (uint16_t)(u[0] << 8 | u[1]);
+}
+
+static uint32_t get32(const char* p)
+{
+  return (uint32_t)get16(p) << 16 | get16(p + 2);
+}
+
+static uint64_t get64(const char* p)
+{
+  return (uint64_t)get32(p) << 32 | get32(p + 4);
+}
+
+static void put16(std::string& out, uint16_t v)
+{
+  out.push_back((char)(v >> 8));
+  out.push_back((char)v);
+}
+
+static void put32(std::string& out, uint32_t v)
+{
+  put16(out, (uint16_t)(v >> 16));
+  put16(out, (uint16_t)v);
+}
+
+static void put64(std::string& out, uint64_t v)
+{
+  put32(out, (uint32_t)(v >> 32));
+  put32(out, (uint32_t)v);
+}
+
+int parseUploadHeader(const char* data, size_t len, UploadHeader& header)
+{
+  // the first byte that differs from the magic settles it
+  size_t check = len < sizeof(MAGIC) ? len : sizeof(MAGIC);
+  if (memcmp(data, MAGIC, check) != 0)
+    return HEADER_ABSENT;
+  if (len < UPLOAD_HEADER_FIXED)
+    return HEADER_INCOMPLETE;
+
+  header.version = get16(data + 4);
+  size_t headerLen = get16(data + 6);
+  header.flags = get32(data + 8);
+  header.fileSize = get64(data + 12);
+  size_t nameLen = get16(data + 20);
+
+  size_t needed = UPLOAD_HEADER_FIXED + nameLen;
+  if (header.flags & (UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE))
+    needed += UPLOAD_ID_FIELDS;
+  if (header.flags & UPLOAD_FLAG_RANGE)
+    needed += UPLOAD_RANGE_FIELDS;
+  if (header.flags & UPLOAD_FLAG_COMPRESSED)
+    needed += UPLOAD_CODEC_FIELDS;
+  if (header.version != PROTOCOL_VERSION || nameLen > UPLOAD_NAME_MAX || headerLen < needed)
+    return HEADER_INVALID;
+  if (len < headerLen)
+    return HEADER_INCOMPLETE;
+
+  const char* p = data + UPLOAD_HEADER_FIXED;
+  header.name.assign(p, nameLen);
+  p += nameLen;
+
+  if (header.flags & (UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE)) {
+    header.transferId = get64(p);
+    p += UPLOAD_ID_FIELDS;
+  }
+  if (header.flags & UPLOAD_FLAG_RANGE) {
+    header.rangeOffset = get64(p);
+    header.rangeLength = get64(p + 8);
+    header.streams = get16(p + 16);
+    p += UPLOAD_RANGE_FIELDS;
+    if (header.streams == 0 || header.rangeOffset > header.fileSize
+        || header.rangeLength > header.fileSize - header.rangeOffset)
+      return HEADER_INVALID;
+  }
+  if (header.flags & UPLOAD_FLAG_COMPRESSED)
+    header.codec = (uint8_t)*p;
+  return (int)headerLen;
+}
+
+std::string encodeUploadHeader(const UploadHeader& header)
+{
+  size_t nameLen = header.name.size() < UPLOAD_NAME_MAX ? header.name.size() : UPLOAD_NAME_MAX;
+  size_t headerLen = UPLOAD_HEADER_FIXED + nameLen;
+  if (header.flags & (UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE))
+    headerLen += UPLOAD_ID_FIELDS;
+  if (header.flags & UPLOAD_FLAG_RANGE)
+    headerLen += UPLOAD_RANGE_FIELDS;
+  if (header.flags & UPLOAD_FLAG_COMPRESSED)
+    headerLen += UPLOAD_CODEC_FIELDS;
+
+  std::string out((const char*)MAGIC, sizeof(MAGIC));
+  put16(out, header.version);
+  put16(out, (uint16_t)headerLen);
+  put32(out, header.flags);
+  put64(out, header.fileSize);
+  put16(out, (uint16_t)nameLen);
+  out.append(header.name, 0, nameLen);
+
+  if (header.flags & (UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE))
+    put64(out, header.transferId);
+  if (header.flags & UPLOAD_FLAG_RANGE) {
+    put64(out, header.rangeOffset);
+    put64(out, header.rangeLength);
+    put16(out, header.streams);
+  }
+  if (header.flags & UPLOAD_FLAG_COMPRESSED)
+    out.push_back((char)header.codec);
+  return out;
+}
+
+bool parseUploadReply(const char* data, UploadReply& reply)
+{
+  if (memcmp(data, REPLY_MAGIC, sizeof(REPLY_MAGIC)) != 0)
+    return false;
+  reply.status = get16(data + 4);
+  reply.offset = get64(data + 6);
+  return true;
+}
+
+std::string encodeUploadReply(const UploadReply& reply)
+{
+  std::string out((const char*)REPLY_MAGIC, sizeof(REPLY_MAGIC));
+  put16(out, reply.status);
+  put64(out, reply.offset);
+  return out;
+}
+
+uint32_t parseUploadTrailer(const char* data)
+{
+  return get32(data);
+}
+
+std::string encodeUploadTrailer(uint32_t crc)
+{
+  std::string out;
+  put32(out, crc);
+  return out;
+}
@@ -0,0 +1,144 @@
+#ifndef _protocol_
+#define _protocol_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Optional header a client may put in front of the upload body. Everything is
+// big-endian:
+//
+//   0  magic      4 bytes, 0x89 'M' 'C' 'S'
+//   4  version    u16, PROTOCOL_VERSION
+//   6  headerLen  u16, whole header including the magic
+//   8  flags      u32, UPLOAD_FLAG_* bits
+//  12  fileSize   u64, bytes of body that follow
+//  20  nameLen    u16
+//  22  name       nameLen bytes, the client's file name (no path)
+//
+// Fields added later go after the name; headerLen lets an older server skip
+// them. A stream that doesn't start with the magic is a raw upload, which is
+// all the original client ever sent.
+//
+// With UPLOAD_FLAG_RANGE the connection carries one slice of a file that is
+// being sent over several connections at once; with UPLOAD_FLAG_RESUMABLE a
+// broken upload can be picked up again later. Either way the name is
+// followed by
+//
+//   +0  transferId   u64, picked by the client, the same on every stream
+//                    and on every attempt
+//
+// and for UPLOAD_FLAG_RANGE only
+//
+//   +8  rangeOffset  u64, where this stream's body goes in the file
+//  +16  rangeLength  u64, bytes of body on this stream
+//  +24  streams      u16, how many ranges make up the file
+//
+// With UPLOAD_FLAG_COMPRESSED the body is a run of compressed blocks (see
+// Compression.h) and fileSize still counts the bytes they unpack to. After
+// any fields above comes
+//
+//   +0  codec        u8, UploadCodec
+//
+// With UPLOAD_FLAG_CHECKSUM the body is followed by
+//
+//   +0  crc32c       u32, CRC-32C of the body bytes this connection carried
+//                    (before compression, from the resume offset on)
+//
+// and the server keeps the upload only if it matches.
+//
+// With UPLOAD_FLAG_SESSION the connection carries any number of framed files
+// back to back, each header straight after the previous body (and trailer),
+// and each file is stored on its own. The server answers every file with
+// an UploadReply as soon as it is done, REPLY_DONE with the bytes stored or
+// REPLY_REFUSED, and the client reads them back while it keeps sending.
+// Sessions don't mix with ranges or resuming.
+//
+// A compressed upload is negotiated: the client sends no body until an
+// UploadReply says the server will take it that way. A server that won't
+// answers REPLY_REFUSED or just hangs up, and the client starts over without.
+// Inside a session there is no go-ahead; a refusal is the file's ack.
+//
+// A resumable upload is a conversation: after the header the client waits
+// for an UploadReply before sending any body, and after shutting down its
+// side it waits for a second one saying the file is on disk.
+//
+//   0  magic   4 bytes, 0x89 'M' 'C' 'R'
+//   4  status  u16, ReplyStatus
+//   6  offset  u64, bytes the server has durably stored
+
+const uint16_t PROTOCOL_VERSION = 1;
+const size_t UPLOAD_MAGIC_LEN = 4;
+const size_t UPLOAD_HEADER_FIXED = 22;
+const size_t UPLOAD_NAME_MAX = 255;
+const size_t UPLOAD_ID_FIELDS = 8;
+const size_t UPLOAD_RANGE_FIELDS = 18;
+const size_t UPLOAD_CODEC_FIELDS = 1;
+const size_t UPLOAD_REPLY_LEN = 14;
+const size_t UPLOAD_TRAILER_LEN = 4;
+
+const uint32_t UPLOAD_FLAG_RANGE = 1 << 0;
+const uint32_t UPLOAD_FLAG_RESUMABLE = 1 << 1;
+const uint32_t UPLOAD_FLAG_COMPRESSED = 1 << 2;
+const uint32_t UPLOAD_FLAG_CHECKSUM = 1 << 3;
+const uint32_t UPLOAD_FLAG_SESSION = 1 << 4;
+
+// Flags this build understands; anything else changes the body in a way we
+// can't read, so the upload is refused.
+const uint32_t UPLOAD_FLAGS_KNOWN = UPLOAD_FLAG_RANGE | UPLOAD_FLAG_RESUMABLE | UPLOAD_FLAG_COMPRESSED
+                                   | UPLOAD_FLAG_CHECKSUM | UPLOAD_FLAG_SESSION;
+
+enum UploadCodec {
+	CODEC_DEFLATE = 1	// zlib
+};
+
+struct UploadHeader {
+	uint16_t version;
+	uint32_t flags;
+	uint64_t fileSize;
+	std::string name;
+	uint64_t transferId;		// UPLOAD_FLAG_RANGE or UPLOAD_FLAG_RESUMABLE
+	uint64_t rangeOffset;
+	uint64_t rangeLength;
+	uint16_t streams;
+	uint8_t codec;			// UPLOAD_FLAG_COMPRESSED
+
+	UploadHeader()
+	: version(PROTOCOL_VERSION), flags(0), fileSize(0), transferId(0), rangeOffset(0),
+	  rangeLength(0), streams(1), codec(0) {}
+};
+
+enum HeaderStatus {
+	HEADER_INCOMPLETE = 0,	// need more bytes to decide
+	HEADER_ABSENT = -1,	// raw stream, every byte is body
+	HEADER_INVALID = -2	// starts with the magic but makes no sense
+};
+
+enum ReplyStatus {
+	REPLY_RESUME = 0,	// send the body from offset on (0 unless resumable)
+	REPLY_DONE = 1,		// offset bytes, the whole file, are on disk
+	REPLY_BUSY = 2,		// an earlier connection still holds the transfer
+	REPLY_REFUSED = 3	// won't take it at all (quota, bad header)
+};
+
+struct UploadReply {
+	uint16_t status;
+	uint64_t offset;
+
+	UploadReply(uint16_t status = REPLY_RESUME, uint64_t offset = 0) : status(status), offset(offset) {}
+};
+
+// Returns the header length (> 0) once a whole header is in data, or one of
+// the HeaderStatus values.
+int parseUploadHeader(const char* data, size_t len, UploadHeader& header);
+std::string encodeUploadHeader(const UploadHeader& header);
+
+// data must hold UPLOAD_REPLY_LEN bytes; false if they aren't a reply
+bool parseUploadReply(const char* data, UploadReply& reply);
+std::string encodeUploadReply(const UploadReply& reply);
+
+// data must hold UPLOAD_TRAILER_LEN bytes
+uint32_t parseUploadTrailer(const char* data);
+std::string encodeUploadTrailer(uint32_t crc);
+
+#endif
@@ -0,0 +1,209 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "Reactor.h"
+
+const int REACTOR_EVENTS = 256;
+
+// Resolution of wait timeouts and sleeps.
+const unsigned REACTOR_TICK_MS = 10;
+
+bool Reactor::Wait::await_ready()
+{
+  if (_fd < 0)
+    return false;
+  // an edge that came while nobody was waiting; the caller tries again
+  Watch* watch = _reactor.watch(_fd);
+  if (watch->_always)
+    return true;
+  bool& pending = _write ? watch->_writable : watch->_readable;
+  if (!pending)
+    return false;
+  pending = false;
+  return true;
+}
+
+void Reactor::Wait::await_suspend(std::coroutine_handle<> handle)
+{
+  _handle = handle;
+  if (_fd >= 0) {
+    Watch* watch = _reactor.watch(_fd);
+    (_write ? watch->_writer : watch->_reader) = this;
+  }
+  if (_fd < 0 || _timeoutMs > 0) {
+    _timer._fire = [this]() { _reactor.expire(this); };
+    _reactor._timers.schedule(_timer, _timeoutMs);
+  }
+}
+
+Reactor::Reactor() : _timers(REACTOR_TICK_MS), _live(0)
+{
+  _epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (_epfd == -1) {
+    perror("epoll_create1");
+    exit(EXIT_FAILURE);
+  }
+
+  // level-triggered and never in _watches: takePosted() drains it
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  _postfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  ev.data.fd = _postfd;
+  if (_postfd == -1 || epoll_ctl(_epfd, EPOLL_CTL_ADD, _postfd, &ev) == -1) {
+    perror("eventfd");
+    exit(EXIT_FAILURE);
+  }
+}
+
+Reactor::~Reactor()
+{
+  close(_postfd);
+  close(_epfd);
+}
+
+Reactor::Watch* Reactor::watch(int fd)
+{
+  auto it = _watches.find(fd);
+  if (it != _watches.end())
+    return &it->second;
+
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = fd;
+  if (epoll_ctl(_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+    // Not pollable (a regular file) or not open: there is nothing to wait
+    // for, so let the caller go ahead and find out from the I/O itself.
+    Watch& watch = _watches[fd];
+    watch._always = true;
+    return &watch;
+  }
+  return &_watches[fd];
+}
+
+void Reactor::forget(int fd)
+{
+  auto it = _watches.find(fd);
+  if (it == _watches.end())
+    return;
+  if (!it->second._always)
+    epoll_ctl(_epfd, EPOLL_CTL_DEL, fd, nullptr);
+  _watches.erase(it);
+}
+
+void Reactor::wake(Wait* wait)
+{
+  _timers.cancel(wait->_timer);
+  _ready.push_back(wait->_handle);
+}
+
+void Reactor::expire(Wait* wait)
+{
+  if (wait->_fd >= 0) {
+    auto it = _watches.find(wait->_fd);
+    if (it != _watches.end()) {
+      Wait*& slot = wait->_write ? it->second._writer : it->second._reader;
+      if (slot == wait)
+        slot = nullptr;
+    }
+  }
+  wait->_timedOut = true;
+  _ready.push_back(wait->_handle);
+}
+
+void Reactor::dispatch(int fd, uint32_t events)
+{
+  auto it = _watches.find(fd);
+  if (it == _watches.end())
+    return;
+  Watch& watch = it->second;
+
+  // errors and hangups wake both sides; the I/O reports what happened
+  if (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+    if (watch._reader != nullptr) {
+      wake(watch._reader);
+      watch._reader = nullptr;
+    } else {
+      watch._readable = true;
+    }
+  }
+  if (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) {
+    if (watch._writer != nullptr) {
+      wake(watch._writer);
+      watch._writer = nullptr;
+    } else {
+      watch._writable = true;
+    }
+  }
+}
+
+void Reactor::post(std::coroutine_handle<> handle)
+{
+  {
+    std::lock_guard<std::mutex> guard(_postLock);
+    _posted.push_back(handle);
+  }
+  uint64_t one = 1;
+  if (write(_postfd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+    perror("eventfd");
+}
+
+void Reactor::takePosted()
+{
+  uint64_t count;
+  while (read(_postfd, &count, sizeof(count)) == -1 && errno == EINTR)
+    ;
+  std::lock_guard<std::mutex> guard(_postLock);
+  _ready.insert(_ready.end(), _posted.begin(), _posted.end());
+  _posted.clear();
+}
+
+Reactor::Detached Reactor::launch(Reactor* reactor, Task<void> task)
+{
+  co_await task;
+  reactor->_live--;
+}
+
+void Reactor::spawn(Task<void> task)
+{
+  _live++;
+  launch(this, std::move(task));
+}
+
+void Reactor::run()
+{
+  struct epoll_event events[REACTOR_EVENTS];
+  std::vector<std::coroutine_handle<> > resuming;
+
+  while (_live > 0) {
+    int timeout = _ready.empty() ? _timers.millisUntilNext() : 0;
+    int n = epoll_wait(_epfd, events, REACTOR_EVENTS, timeout);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("epoll_wait");
+      exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == _postfd)
+        takePosted();
+      else
+        dispatch(events[i].data.fd, events[i].events);
+    }
+    _timers.advance();
+
+    // Resumed outside the wheel's tick and the dispatch loop: a coroutine
+    // may forget descriptors or finish and take its timers with it.
+    resuming.swap(_ready);
+    for (std::coroutine_handle<> handle : resuming)
+      handle.resume();
+    resuming.clear();
+  }
+}
@@ -0,0 +1,118 @@
+#ifndef _reactor_
+#define _reactor_
+
+#include <coroutine>
+#include <mutex>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+#include "Task.h"
+#include "TimerWheel.h"
+
+// Readiness-based scheduler for coroutines, one per thread. A coroutine
+// tries its I/O, and when the kernel says EAGAIN it co_awaits readable() or
+// writable() on the descriptor; epoll then says when to resume it. Every
+// descriptor is registered once, edge-triggered, the first time anyone
+// waits on it, and must be forgotten before it is closed. Waits can carry a
+// timeout, and sleep() is a wait on nothing but the clock; both run off a
+// timer wheel, like the event loop's deadlines. A coroutine that has had a
+// long turn can yield() to the rest, and another thread can hand one back
+// with post(), the only call that is safe from outside the reactor's own.
+//
+// Regular files are always "ready" to epoll's way of thinking (it refuses
+// them outright), so file I/O from a coroutine simply runs in line.
+class Reactor
+{
+public:
+	// What co_await readable()/writable()/sleep() suspends on. Lives in the
+	// waiting coroutine's frame for as long as it is suspended. Resumes
+	// true when the descriptor is ready, false when the time ran out.
+	struct Wait {
+		Reactor& _reactor;
+		int _fd;			// -1: sleep()
+		bool _write;
+		unsigned _timeoutMs;		// 0: none
+		bool _timedOut;
+		std::coroutine_handle<> _handle;
+		TimerWheel::Timer _timer;
+
+		Wait(Reactor& reactor, int fd, bool write, unsigned timeoutMs)
+		: _reactor(reactor), _fd(fd), _write(write), _timeoutMs(timeoutMs), _timedOut(false) {}
+
+		bool await_ready();
+		void await_suspend(std::coroutine_handle<> handle);
+		bool await_resume() { return !_timedOut; }
+	};
+
+	// What co_await yield() suspends on: back in line behind everybody else
+	// who is ready already.
+	struct Yield {
+		Reactor& _reactor;
+
+		bool await_ready() { return false; }
+		void await_suspend(std::coroutine_handle<> handle) { _reactor._ready.push_back(handle); }
+		void await_resume() {}
+	};
+
+private:
+	struct Watch {
+		Wait* _reader;
+		Wait* _writer;
+		bool _readable;		// an edge came with nobody waiting
+		bool _writable;
+		bool _always;			// epoll won't have it: never wait
+
+		Watch() : _reader(nullptr), _writer(nullptr), _readable(false), _writable(false), _always(false) {}
+	};
+
+	// Runs a spawned Task to the end and frees it; nothing awaits it.
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() {}
+			void unhandled_exception() { std::terminate(); }
+		};
+	};
+
+	int _epfd;
+	std::unordered_map<int, Watch> _watches;
+	TimerWheel _timers;
+	std::vector<std::coroutine_handle<> > _ready;	// resumed after this round of events
+	unsigned long _live;		// spawned tasks not finished yet
+	int _postfd;			// eventfd, poked by post()
+	std::mutex _postLock;
+	std::vector<std::coroutine_handle<> > _posted;
+
+	Watch* watch(int fd);
+	void dispatch(int fd, uint32_t events);
+	void wake(Wait* wait);
+	void expire(Wait* wait);
+	void takePosted();
+	static Detached launch(Reactor* reactor, Task<void> task);
+
+public:
+	Reactor();
+	~Reactor();
+
+	Wait readable(int fd, unsigned timeoutMs = 0) { return Wait(*this, fd, false, timeoutMs); }
+	Wait writable(int fd, unsigned timeoutMs = 0) { return Wait(*this, fd, true, timeoutMs); }
+	Wait sleep(unsigned millis) { return Wait(*this, -1, false, millis); }
+	Yield yield() { return Yield{*this}; }
+
+	// Resumes handle on the reactor's thread at its next round. From any
+	// thread; handle must stay suspended until then.
+	void post(std::coroutine_handle<> handle);
+
+	// Call before closing fd, with nobody waiting on it.
+	void forget(int fd);
+
+	// Starts task right away, up to its first suspension.
+	void spawn(Task<void> task);
+	// Until every spawned task has finished.
+	void run();
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef _server_config_
+#define _server_config_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+#include "BufferPool.h"
+
+#ifndef TIMEOUT
+#define TIMEOUT 15
+#endif
+
+// Everything the command line can tune, handed to whichever backend runs.
+struct ServerConfig {
+	std::string backend;
+	unsigned workers;		// 0: one per core
+	size_t queueDepth;
+	unsigned statsInterval;
+	unsigned idleTimeoutMs;
+	unsigned transferTimeoutMs;	// 0: no limit on a whole upload
+	bool splice;			// socket -> pipe -> file receive path
+	size_t bufferSize;		// BufferPool buffers, also the uring buffer size
+	size_t bufferCacheBytes;	// idle buffers the pool may hold on to
+	uint64_t maxFileSize;		// per-upload quota, 0: none
+	bool dedup;			// store uploads as chunks plus a manifest
+	size_t chunkSize;		// average dedup chunk
+	unsigned diskThreads;		// write-behind threads, 0: write from the network thread
+	bool fsync;			// group-commit finished files before acking them
+	bool directIo;			// O_DIRECT for whole buffers and dedup chunks
+	std::string statsSocket;	// UNIX socket serving the metrics, empty: none
+	bool reusePort;		// a SO_REUSEPORT listener and pinned loop per worker
+	unsigned backlog;		// listen() queue, capped by net.core.somaxconn
+	unsigned deferAcceptSecs;	// TCP_DEFER_ACCEPT, 0: accept on the handshake
+	unsigned maxConnections;	// 0: no limit
+	bool refuseWhenFull;		// at the limit: refuse, instead of leaving them queued
+	uint64_t clientRate;		// bytes/s per client address, 0: no limit
+	uint64_t totalRate;		// bytes/s for the whole server, 0: no limit
+	uint64_t rateBurst;		// bucket depth for both
+
+	ServerConfig()
+	: backend("coro"), workers(0), queueDepth(1024), statsInterval(0),
+	  idleTimeoutMs(TIMEOUT * 1000), transferTimeoutMs(0), splice(false),
+	  bufferSize(DEFAULT_BUFFER_SIZE), bufferCacheBytes(64 << 20),
+	  maxFileSize(0), dedup(false), chunkSize(64 << 10),
+	  diskThreads(2), fsync(true), directIo(false), reusePort(false),
+	  backlog(1024), deferAcceptSecs(5), maxConnections(0), refuseWhenFull(false),
+	  clientRate(0), totalRate(0), rateBurst(1 << 20) {}
+};
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _sha256_
+#define _sha256_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Plain FIPS 180-4 SHA-256, enough to name chunks by their content without
+// pulling in a crypto library.
+class Sha256
+{
+private:
+	uint32_t _state[8];
+	unsigned char _block[64];
+	size_t _blockLen;
+	uint64_t _totalLen;
+
+	void compress(const unsigned char* block);
+
+public:
+	Sha256();
+
+	void update(const void* data, size_t len);
+	void digest(unsigned char out[32]);
+
+	// lowercase hex of the digest of data
+	static std::string hex(const void* data, size_t len);
+};
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef _task_
+#define _task_
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// The result of a coroutine, for whoever co_awaits it. Lazy: the body only
+// starts once awaited, and finishing hands control straight back to the
+// awaiting coroutine, so a chain of calls costs no trips through the
+// Reactor. There are no exceptions in this code; one escaping a coroutine
+// is fatal, same as anywhere else.
+struct TaskPromiseBase {
+	std::coroutine_handle<> _continuation;
+
+	struct FinalAwaiter {
+		bool await_ready() noexcept { return false; }
+		template <typename Promise>
+		std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> done) noexcept
+		{
+			std::coroutine_handle<> next = done.promise()._continuation;
+			return next ? next : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+class Task
+{
+public:
+	struct promise_type : TaskPromiseBase {
+		T _value;
+
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		void return_value(T value) { _value = std::move(value); }
+	};
+
+	Task(Task&& other) noexcept : _handle(other._handle) { other._handle = nullptr; }
+	~Task()
+	{
+		if (_handle)
+			_handle.destroy();
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		_handle.promise()._continuation = caller;
+		return _handle;
+	}
+	T await_resume() { return std::move(_handle.promise()._value); }
+
+private:
+	std::coroutine_handle<promise_type> _handle;
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+};
+
+template <>
+class Task<void>
+{
+public:
+	struct promise_type : TaskPromiseBase {
+		Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+		void return_void() {}
+	};
+
+	Task(Task&& other) noexcept : _handle(other._handle) { other._handle = nullptr; }
+	~Task()
+	{
+		if (_handle)
+			_handle.destroy();
+	}
+	Task(const Task&) = delete;
+	Task& operator=(const Task&) = delete;
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller) noexcept
+	{
+		_handle.promise()._continuation = caller;
+		return _handle;
+	}
+	void await_resume() {}
+
+private:
+	std::coroutine_handle<promise_type> _handle;
+
+	explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+};
+
+#endif
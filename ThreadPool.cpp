@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <chrono>
+#include "ThreadPool.h"
+
+static unsigned long long nowNanos()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+unsigned ThreadPool::defaultWorkers()
+{
+  unsigned cores = std::thread::hardware_concurrency();
+  return cores > 0 ? cores : 1;
+}
+
+ThreadPool::ThreadPool(unsigned workers, size_t depth, std::function<void(int)> handler)
+: _handler(handler), _queue(depth), _depth(depth), _stopping(false), _busy(0),
+  _busyNanos(0), _completed(0), _startedAt(nowNanos())
+{
+  if (sem_init(&_freeSlots, 0, depth) == -1 || sem_init(&_filledSlots, 0, 0) == -1) {
+    perror("sem_init");
+    exit(EXIT_FAILURE);
+  }
+
+  for (unsigned i = 0; i < workers; i++)
+    _workers.push_back(std::thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+  _stopping = true;
+  for (size_t i = 0; i < _workers.size(); i++)
+    sem_post(&_filledSlots);
+  for (std::thread& t : _workers)
+    t.join();
+
+  // anything still queued never got a worker
+  int clientfd;
+  while (_queue.tryPop(clientfd))
+    close(clientfd);
+
+  sem_destroy(&_freeSlots);
+  sem_destroy(&_filledSlots);
+}
+
+void ThreadPool::submit(int clientfd)
+{
+  // Wait for a free slot. Once every worker is busy and the queue is full
+  // this is what stops the acceptor from pulling in more sockets.
+  while (sem_wait(&_freeSlots) == -1 && errno == EINTR)
+    ;
+  _queue.tryPush(clientfd);
+  sem_post(&_filledSlots);
+}
+
+void ThreadPool::work()
+{
+  for (;;) {
+    while (sem_wait(&_filledSlots) == -1 && errno == EINTR)
+      ;
+    if (_stopping)
+      return;
+
+    int clientfd;
+    if (!_queue.tryPop(clientfd))
+      continue;
+    sem_post(&_freeSlots);
+
+    _busy++;
+    unsigned long long start = nowNanos();
+    _handler(clientfd);
+    _busyNanos += nowNanos() - start;
+    _busy--;
+    _completed++;
+  }
+}
+
+size_t ThreadPool::queueDepth() const { return _queue.size(); }
+
+size_t ThreadPool::queueCapacity() const { return _depth; }
+
+unsigned ThreadPool::workerCount() const { return _workers.size(); }
+
+unsigned ThreadPool::busyWorkers() const { return _busy; }
+
+unsigned long long ThreadPool::completed() const { return _completed; }
+
+double ThreadPool::utilization() const
+{
+  // share of the pool's thread-time spent inside the handler so far
+  unsigned long long elapsed = nowNanos() - _startedAt;
+  if (elapsed == 0 || _workers.empty())
+    return 0.0;
+  return (double)_busyNanos / ((double)elapsed * _workers.size());
+}
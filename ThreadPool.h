@@ -0,0 +1,50 @@
+#ifndef _thread_pool_
+#define _thread_pool_
+
+#include <atomic>
+#include <functional>
+#include <semaphore.h>
+#include <thread>
+#include <vector>
+
+#include "MPMCQueue.h"
+
+// Fixed set of worker threads fed accepted client sockets through a bounded
+// lock-free queue. The queue itself never blocks; two semaphores count free
+// and filled slots so the acceptor waits when every slot is taken (leaving
+// the rest in the kernel's listen backlog) and idle workers sleep instead
+// of spinning.
+class ThreadPool
+{
+private:
+	std::function<void(int)> _handler;
+	MPMCQueue<int> _queue;
+	size_t _depth;
+	sem_t _freeSlots;
+	sem_t _filledSlots;
+	std::vector<std::thread> _workers;
+	std::atomic<bool> _stopping;
+	std::atomic<unsigned> _busy;
+	std::atomic<unsigned long long> _busyNanos;
+	std::atomic<unsigned long long> _completed;
+	unsigned long long _startedAt;
+
+	void work();
+
+public:
+	ThreadPool(unsigned workers, size_t depth, std::function<void(int)> handler);
+	~ThreadPool();
+
+	void submit(int clientfd);
+
+	size_t queueDepth() const;
+	size_t queueCapacity() const;
+	unsigned workerCount() const;
+	unsigned busyWorkers() const;
+	unsigned long long completed() const;
+	double utilization() const;
+
+	static unsigned defaultWorkers();
+};
+
+#endif
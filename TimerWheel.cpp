@@ -0,0 +1,159 @@
+#include <time.h>
+
+#include "TimerWheel.h"
+
+TimerWheel::Timer::Timer() : _prev(nullptr), _next(nullptr), _expires(0) {}
+
+TimerWheel::Timer::~Timer()
+{
+  unlink();
+}
+
+bool TimerWheel::Timer::armed() const
+{
+  return _next != nullptr;
+}
+
+void TimerWheel::Timer::unlink()
+{
+  if (_next == nullptr)
+    return;
+  _prev->_next = _next;
+  _next->_prev = _prev;
+  _prev = _next = nullptr;
+}
+
+uint64_t TimerWheel::nowMillis()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+TimerWheel::TimerWheel(unsigned tickMillis)
+: _tickMillis(tickMillis > 0 ? tickMillis : 1), _current(0), _epoch(nowMillis())
+{
+  for (unsigned level = 0; level < LEVELS; level++) {
+    for (unsigned slot = 0; slot < SLOTS; slot++) {
+      Timer& head = _slots[level][slot];
+      head._prev = head._next = &head;
+    }
+  }
+}
+
+void TimerWheel::place(Timer& t)
+{
+  const uint64_t horizon = ((uint64_t)1 << (SLOT_BITS * LEVELS)) - 1;
+
+  if (t._expires - _current > horizon)
+    t._expires = _current + horizon;
+
+  uint64_t delta = t._expires - _current;
+  unsigned level = 0;
+  while (level < LEVELS - 1 && delta >= ((uint64_t)1 << (SLOT_BITS * (level + 1))))
+    level++;
+
+  Timer& head = _slots[level][(t._expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+  t._next = &head;
+  t._prev = head._prev;
+  head._prev->_next = &t;
+  head._prev = &t;
+}
+
+void TimerWheel::schedule(Timer& t, uint64_t delayMillis)
+{
+  t.unlink();
+  uint64_t elapsed = nowMillis() - _epoch;
+  // round up so a timer never fires before its delay has passed
+  t._expires = (elapsed + delayMillis + _tickMillis - 1) / _tickMillis;
+  // this tick's slot has already run, anything due goes off on the next one
+  if (t._expires <= _current)
+    t._expires = _current + 1;
+  place(t);
+}
+
+void TimerWheel::cancel(Timer& t)
+{
+  t.unlink();
+}
+
+void TimerWheel::cascade(unsigned level)
+{
+  unsigned index = (_current >> (SLOT_BITS * level)) & (SLOTS - 1);
+
+  // Pull the whole slot off first; place() may put timers back into it if
+  // they still belong at this level.
+  Timer& head = _slots[level][index];
+  Timer pending;
+  if (head._next != &head) {
+    pending._next = head._next;
+    pending._prev = head._prev;
+    pending._next->_prev = &pending;
+    pending._prev->_next = &pending;
+    head._prev = head._next = &head;
+  }
+
+  while (pending._next != nullptr && pending._next != &pending) {
+    Timer* t = pending._next;
+    t->unlink();
+    place(*t);
+  }
+  pending._prev = pending._next = nullptr;
+
+  if (index == 0 && level + 1 < LEVELS)
+    cascade(level + 1);
+}
+
+void TimerWheel::tick()
+{
+  _current++;
+  if ((_current & (SLOTS - 1)) == 0)
+    cascade(1);
+
+  Timer& head = _slots[0][_current & (SLOTS - 1)];
+  // callbacks are free to cancel or reschedule any timer, including the
+  // next one in this slot, so always restart from the head
+  while (head._next != &head) {
+    Timer* t = head._next;
+    t->unlink();
+    if (t->_fire) {
+      std::function<void()> fire = t->_fire;
+      fire();
+    }
+  }
+}
+
+void TimerWheel::advance()
+{
+  uint64_t target = (nowMillis() - _epoch) / _tickMillis;
+  while (_current < target)
+    tick();
+}
+
+int TimerWheel::millisUntilNext() const
+{
+  uint64_t elapsed = nowMillis() - _epoch;
+  uint64_t tickStart = _current * _tickMillis;
+  uint64_t late = elapsed > tickStart ? elapsed - tickStart : 0;
+
+  for (unsigned j = 1; j <= SLOTS; j++) {
+    const Timer& head = _slots[0][(_current + j) & (SLOTS - 1)];
+    if (head._next != &head) {
+      uint64_t wait = j * _tickMillis;
+      return wait > late ? (int)(wait - late) : 0;
+    }
+  }
+
+  for (unsigned level = 1; level < LEVELS; level++) {
+    for (unsigned slot = 0; slot < SLOTS; slot++) {
+      const Timer& head = _slots[level][slot];
+      if (head._next != &head) {
+        // nothing due before level 0 wraps and the next cascade runs
+        uint64_t wait = (SLOTS - (_current & (SLOTS - 1))) * _tickMillis;
+        return wait > late ? (int)(wait - late) : 0;
+      }
+    }
+  }
+
+  return -1;
+}
@@ -0,0 +1,54 @@
+#ifndef _timer_wheel_
+#define _timer_wheel_
+
+#include <functional>
+#include <stdint.h>
+
+// Hierarchical timing wheel (Varghese & Lauck). Four levels of 64 slots;
+// level 0 advances one slot per tick and each higher level covers 64 times
+// the span of the one below, so with 10 ms ticks a timer can sit up to ~46
+// hours out. Scheduling and cancelling are O(1) list splices; a timer only
+// moves when its level's slot comes around and it cascades one level down.
+class TimerWheel
+{
+public:
+	// Intrusive list node; embed one per deadline in whatever owns it.
+	// Destroying a Timer takes it off the wheel.
+	struct Timer {
+		Timer* _prev;
+		Timer* _next;
+		uint64_t _expires;		// absolute tick
+		std::function<void()> _fire;
+
+		Timer();
+		~Timer();
+		bool armed() const;
+		void unlink();
+	};
+
+	static const unsigned LEVELS = 4;
+	static const unsigned SLOT_BITS = 6;
+	static const unsigned SLOTS = 1 << SLOT_BITS;
+
+private:
+	unsigned _tickMillis;
+	uint64_t _current;		// ticks elapsed since _epoch
+	uint64_t _epoch;		// monotonic ms at tick 0
+	Timer _slots[LEVELS][SLOTS];	// list heads
+
+	void place(Timer& t);
+	void cascade(unsigned level);
+	void tick();
+
+public:
+	TimerWheel(unsigned tickMillis);
+
+	void schedule(Timer& t, uint64_t delayMillis);
+	void cancel(Timer& t);
+	void advance();
+	int millisUntilNext() const;
+
+	static uint64_t nowMillis();
+};
+
+#endif
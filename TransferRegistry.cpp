@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include "TimerWheel.h"
+#include "TransferRegistry.h"
+
+TransferRegistry::TransferRegistry() : _lingerMs(15000) {}
+
+void TransferRegistry::setLinger(uint64_t lingerMs)
+{
+  _lingerMs = lingerMs;
+}
+
+void TransferRegistry::setStatePrefix(const std::string& prefix)
+{
+  _statePrefix = prefix;
+}
+
+TransferRegistry& TransferRegistry::shared()
+{
+  static TransferRegistry registry;
+  return registry;
+}
+
+int TransferRegistry::join(const UploadHeader& header, int ofd, std::string& filename, bool& created)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+
+  auto it = _transfers.find(header.transferId);
+  if (it == _transfers.end()) {
+    Transfer t;
+    t._filename = filename;
+    t._fd = fcntl(ofd, F_DUPFD_CLOEXEC, 0);
+    if (t._fd == -1)
+      return -1;
+    t._fileSize = header.fileSize;
+    t._streams = header.streams;
+    t._active = 1;
+    t._landed = 0;
+    t._coveredBytes = 0;
+    t._bytesLanded = 0;
+    t._failed = false;
+    t._idleSince = 0;
+    _transfers[header.transferId] = t;
+    created = true;
+    return ofd;
+  }
+
+  Transfer& t = it->second;
+  if (t._fileSize != header.fileSize || t._streams != header.streams || t._failed) {
+    errno = EPROTO;
+    return -1;
+  }
+  t._active++;
+  filename = t._filename;
+  created = false;
+  return fcntl(t._fd, F_DUPFD_CLOEXEC, 0);
+}
+
+void TransferRegistry::leave(uint64_t id, uint64_t offset, uint64_t bytesWritten, bool complete, bool failed)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  auto it = _transfers.find(id);
+  if (it == _transfers.end())
+    return;
+
+  Transfer& t = it->second;
+  t._active--;
+  t._bytesLanded += bytesWritten;
+  if (complete) {
+    t._landed++;
+    cover(t, offset, bytesWritten);
+  }
+  if (failed)
+    t._failed = true;
+
+  // Counting streams isn't enough: a retried range lands twice and
+  // overlapping ones can leave a hole. Wait for any retry still writing.
+  if (t._coveredBytes == t._fileSize && t._active == 0) {
+    std::cerr << t._filename << ": " << t._landed << " ranges landed, "
+              << t._bytesLanded << " bytes\n";
+    finish(id, t, nullptr);
+  } else if (t._active == 0 && t._failed) {
+    finish(id, t, "a range failed");
+  } else if (t._active == 0) {
+    t._idleSince = TimerWheel::nowMillis();
+  }
+}
+
+void TransferRegistry::cover(Transfer& t, uint64_t offset, uint64_t length)
+{
+  uint64_t start = offset;
+  uint64_t end = offset + length;
+  if (start == end)
+    return;
+
+  // swallow every interval that touches [start, end)
+  auto it = t._covered.upper_bound(start);
+  if (it != t._covered.begin() && std::prev(it)->second >= start)
+    --it;
+  while (it != t._covered.end() && it->first <= end) {
+    start = std::min(start, it->first);
+    end = std::max(end, it->second);
+    t._coveredBytes -= it->second - it->first;
+    it = t._covered.erase(it);
+  }
+  t._covered[start] = end;
+  t._coveredBytes += end - start;
+}
+
+void TransferRegistry::finish(uint64_t id, Transfer& t, const char* why)
+{
+  if (why != nullptr) {
+    // same marker a single-stream upload leaves when it goes wrong
+    std::cerr << "ERROR: " << t._filename << ": " << why << ", " << t._coveredBytes << " of "
+              << t._fileSize << " bytes covered\n";
+    const char* msg = "ERROR";
+    if (ftruncate(t._fd, 0) == -1 || pwrite(t._fd, msg, strlen(msg), 0) == -1)
+      perror("ERROR");
+  }
+  close(t._fd);
+  _transfers.erase(id);
+}
+
+void TransferRegistry::sweep()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  if (!_transfers.empty())
+    sweepLocked(TimerWheel::nowMillis());
+}
+
+void TransferRegistry::sweepLocked(uint64_t now)
+{
+  for (auto it = _transfers.begin(); it != _transfers.end(); ) {
+    Transfer& t = it->second;
+    auto next = std::next(it);
+    if (t._active == 0 && t._idleSince > 0 && now - t._idleSince >= _lingerMs)
+      finish(it->first, t, "ranges missing");
+    it = next;
+  }
+}
+
+bool TransferRegistry::claim(uint64_t id)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  return _claimed.insert(id).second;
+}
+
+void TransferRegistry::release(uint64_t id)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _claimed.erase(id);
+}
+
+std::string TransferRegistry::statePath(uint64_t id) const
+{
+  char hex[17];
+  snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)id);
+  return _statePrefix + hex + ".state";
+}
+
+bool TransferRegistry::loadCheckpoint(uint64_t id, Checkpoint& checkpoint)
+{
+  std::ifstream in(statePath(id));
+  std::getline(in, checkpoint._filename);
+  in >> checkpoint._fileSize >> checkpoint._committed;
+  return !in.fail() && !checkpoint._filename.empty();
+}
+
+bool TransferRegistry::saveCheckpoint(uint64_t id, const Checkpoint& checkpoint)
+{
+  // Write it aside and rename over the old one, so a crash leaves either
+  // checkpoint intact and never half of one.
+  std::ostringstream out;
+  out << checkpoint._filename << "\n" << checkpoint._fileSize << "\n" << checkpoint._committed << "\n";
+  std::string text = out.str();
+  std::string path = statePath(id);
+  std::string tmp = path + ".tmp";
+
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd == -1)
+    return false;
+  bool ok = write(fd, text.data(), text.size()) == (ssize_t)text.size() && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tmp.c_str(), path.c_str()) == -1) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+void TransferRegistry::dropCheckpoint(uint64_t id)
+{
+  unlink(statePath(id).c_str());
+}
@@ -0,0 +1,84 @@
+#ifndef _transfer_registry_
+#define _transfer_registry_
+
+#include <map>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "Protocol.h"
+
+// Uploads that outlive a single connection. Files that arrive as several
+// ranges over concurrent connections: the first stream of a transfer lends it
+// its output file, the others write into that same file at their own offsets
+// and the transfer is reported complete once the ranges that landed cover
+// the whole file, however many streams that took. And
+// resumable uploads: how much of each is safely on disk is kept in a small
+// state file next to the uploads, so a client can carry on from there even
+// after a server restart. Shared by all backends and threads.
+class TransferRegistry
+{
+public:
+	struct Checkpoint {
+		std::string _filename;
+		uint64_t _fileSize;
+		uint64_t _committed;	// fdatasync'd before the checkpoint was written
+	};
+
+private:
+	struct Transfer {
+		std::string _filename;
+		int _fd;			// our own dup, for the final trim or ERROR marker
+		uint64_t _fileSize;
+		unsigned _streams;
+		unsigned _active;		// connections attached right now
+		unsigned _landed;		// ranges written in full
+		std::map<uint64_t, uint64_t> _covered;	// start -> end of what they cover, merged
+		uint64_t _coveredBytes;
+		uint64_t _bytesLanded;
+		bool _failed;
+		uint64_t _idleSince;	// when _active last dropped to 0
+	};
+
+	std::mutex _lock;
+	std::unordered_map<uint64_t, Transfer> _transfers;
+	std::unordered_set<uint64_t> _claimed;	// resumable uploads with a live connection
+	uint64_t _lingerMs;
+	std::string _statePrefix;
+
+	void cover(Transfer& t, uint64_t offset, uint64_t length);
+	void finish(uint64_t id, Transfer& t, const char* why);
+	void sweepLocked(uint64_t now);
+	std::string statePath(uint64_t id) const;
+
+public:
+	TransferRegistry();
+
+	// Attach a stream. The first stream of a transfer gets ofd back and its
+	// file becomes the transfer's; later ones get a descriptor of their own
+	// for that file and filename is set to it. Returns -1 with errno set if
+	// the header contradicts the streams already attached.
+	int join(const UploadHeader& header, int ofd, std::string& filename, bool& created);
+	// Detach a stream; complete if all of its range, at offset, was written.
+	void leave(uint64_t id, uint64_t offset, uint64_t bytesWritten, bool complete, bool failed);
+	// Give up on transfers whose missing ranges never showed up. Cheap; run
+	// on every accept so nothing needs its own timer.
+	void sweep();
+
+	// One connection per resumable upload at a time; false if it is taken.
+	bool claim(uint64_t id);
+	void release(uint64_t id);
+	bool loadCheckpoint(uint64_t id, Checkpoint& checkpoint);
+	bool saveCheckpoint(uint64_t id, const Checkpoint& checkpoint);
+	void dropCheckpoint(uint64_t id);
+
+	// How long a transfer waits for missing ranges once no stream is attached.
+	void setLinger(uint64_t lingerMs);
+	// State files are named prefix + transfer ID.
+	void setStatePrefix(const std::string& prefix);
+	static TransferRegistry& shared();
+};
+
+#endif
@@ -0,0 +1,177 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include "Uring.h"
+
+Uring::Uring()
+: _fd(-1), _entries(0), _sqRing(MAP_FAILED), _sqRingSize(0), _sqHead(nullptr), _sqTail(nullptr),
+  _sqMask(nullptr), _sqArray(nullptr), _sqes((struct io_uring_sqe*)MAP_FAILED), _sqesSize(0),
+  _sqeTail(0), _sqeSubmitted(0), _cqRing(MAP_FAILED), _cqRingSize(0),
+  _cqHead(nullptr), _cqTail(nullptr), _cqMask(nullptr), _cqes(nullptr)
+{
+}
+
+Uring::~Uring()
+{
+  if (_sqes != MAP_FAILED)
+    munmap(_sqes, _sqesSize);
+  if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+    munmap(_cqRing, _cqRingSize);
+  if (_sqRing != MAP_FAILED)
+    munmap(_sqRing, _sqRingSize);
+  if (_fd != -1)
+    close(_fd);
+}
+
+int Uring::enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize)
+{
+  return syscall(__NR_io_uring_enter, _fd, toSubmit, minComplete, flags, arg, argSize);
+}
+
+bool Uring::setup(unsigned entries)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  // completions for multishot accept/recv pile up faster than submissions
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = entries * 4;
+
+  _fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (_fd < 0) {
+    _fd = -1;
+    return false;
+  }
+  _entries = p.sq_entries;
+
+  _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+  if (single)
+    _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+
+  _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                 _fd, IORING_OFF_SQ_RING);
+  if (_sqRing == MAP_FAILED)
+    return false;
+
+  _cqRing = single ? _sqRing : mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE,
+                                    MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+  if (_cqRing == MAP_FAILED)
+    return false;
+
+  _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+  _sqes = (struct io_uring_sqe*)mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+  if (_sqes == MAP_FAILED)
+    return false;
+
+  char* sq = (char*)_sqRing;
+  _sqHead = (unsigned*)(sq + p.sq_off.head);
+  _sqTail = (unsigned*)(sq + p.sq_off.tail);
+  _sqMask = (unsigned*)(sq + p.sq_off.ring_mask);
+  _sqArray = (unsigned*)(sq + p.sq_off.array);
+
+  char* cq = (char*)_cqRing;
+  _cqHead = (unsigned*)(cq + p.cq_off.head);
+  _cqTail = (unsigned*)(cq + p.cq_off.tail);
+  _cqMask = (unsigned*)(cq + p.cq_off.ring_mask);
+  _cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+  // SQEs are always used in order, so the indirection array never changes
+  for (unsigned i = 0; i < _entries; i++)
+    _sqArray[i] = i;
+  _sqeTail = _sqeSubmitted = *_sqTail;
+  return true;
+}
+
+struct io_uring_sqe* Uring::getSqe()
+{
+  unsigned head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+  if (_sqeTail - head >= _entries) {
+    // full: push what we have, the kernel consumes it synchronously
+    submit();
+    head = __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+    if (_sqeTail - head >= _entries)
+      return nullptr;
+  }
+
+  struct io_uring_sqe* sqe = &_sqes[_sqeTail & *_sqMask];
+  memset(sqe, 0, sizeof(*sqe));
+  _sqeTail++;
+  return sqe;
+}
+
+void Uring::flushSqes()
+{
+  __atomic_store_n(_sqTail, _sqeTail, __ATOMIC_RELEASE);
+}
+
+int Uring::submit()
+{
+  unsigned toSubmit = _sqeTail - _sqeSubmitted;
+  if (toSubmit == 0)
+    return 0;
+
+  flushSqes();
+  int ret;
+  do {
+    ret = enter(toSubmit, 0, 0, nullptr, 0);
+  } while (ret == -1 && errno == EINTR);
+  _sqeSubmitted = _sqeTail;
+  return ret;
+}
+
+int Uring::submitAndWait(int timeoutMs)
+{
+  unsigned toSubmit = _sqeTail - _sqeSubmitted;
+  flushSqes();
+  _sqeSubmitted = _sqeTail;
+
+  // nothing to wait for if completions are already queued
+  unsigned minComplete = peekCqe() != nullptr ? 0 : 1;
+  int ret;
+  if (timeoutMs < 0 || minComplete == 0) {
+    ret = enter(toSubmit, minComplete, IORING_ENTER_GETEVENTS, nullptr, 0);
+  } else {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeoutMs / 1000;
+    ts.tv_nsec = (long long)(timeoutMs % 1000) * 1000000;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+    ret = enter(toSubmit, minComplete, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                &arg, sizeof(arg));
+  }
+
+  if (ret == -1 && (errno == ETIME || errno == EINTR))
+    return 0;
+  return ret;
+}
+
+struct io_uring_cqe* Uring::peekCqe()
+{
+  unsigned head = *_cqHead;
+  unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+  if (head == tail)
+    return nullptr;
+  return &_cqes[head & *_cqMask];
+}
+
+void Uring::seen()
+{
+  __atomic_store_n(_cqHead, *_cqHead + 1, __ATOMIC_RELEASE);
+}
+
+bool Uring::registerBufferRing(struct io_uring_buf_ring* ring, unsigned entries, unsigned short group)
+{
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring;
+  reg.ring_entries = entries;
+  reg.bgid = group;
+  return syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PBUF_RING, &reg, 1) == 0;
+}
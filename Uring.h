@@ -0,0 +1,53 @@
+#ifndef _uring_
+#define _uring_
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Just enough io_uring to run the server: set up and map one SQ/CQ pair,
+// hand out SQEs, submit, reap CQEs and register provided-buffer rings. Talks
+// to the kernel through the raw syscalls so the build doesn't need liburing.
+class Uring
+{
+private:
+	int _fd;
+	unsigned _entries;
+
+	// submission queue
+	void* _sqRing;
+	size_t _sqRingSize;
+	unsigned* _sqHead;
+	unsigned* _sqTail;
+	unsigned* _sqMask;
+	unsigned* _sqArray;
+	struct io_uring_sqe* _sqes;
+	size_t _sqesSize;
+	unsigned _sqeTail;		// next SQE we hand out
+	unsigned _sqeSubmitted;	// up to here the kernel has been told
+
+	// completion queue
+	void* _cqRing;
+	size_t _cqRingSize;
+	unsigned* _cqHead;
+	unsigned* _cqTail;
+	unsigned* _cqMask;
+	struct io_uring_cqe* _cqes;
+
+	int enter(unsigned toSubmit, unsigned minComplete, unsigned flags, void* arg, size_t argSize);
+	void flushSqes();
+
+public:
+	Uring();
+	~Uring();
+
+	bool setup(unsigned entries);
+	struct io_uring_sqe* getSqe();
+	int submit();
+	int submitAndWait(int timeoutMs);
+	struct io_uring_cqe* peekCqe();
+	void seen();
+	bool registerBufferRing(struct io_uring_buf_ring* ring, unsigned entries, unsigned short group);
+};
+
+#endif
@@ -0,0 +1,502 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <iostream>
+#include "UringLoop.h"
+#include "Admission.h"
+#include "Metrics.h"
+
+const unsigned RING_ENTRIES = 1024;
+const unsigned short BUFFER_GROUP = 0;
+// Provided-buffer ring: buffers are --buffer-size each and there are as
+// many as fit in this much memory, rounded down to a power of two.
+const size_t URING_BUFFER_MEMORY = 16 << 20;
+const unsigned URING_MIN_BUFFERS = 16;
+const unsigned URING_MAX_BUFFERS = 32768;
+
+static unsigned bufferCount(size_t bufferSize)
+{
+  unsigned count = URING_MIN_BUFFERS;
+  while (count < URING_MAX_BUFFERS && (size_t)count * 2 * bufferSize <= URING_BUFFER_MEMORY)
+    count *= 2;
+  return count;
+}
+
+// Older uapi headers declare io_uring_buf_ring's flexible array in a way
+// that g++ lays out 8 bytes too far in, so index the entries and the tail
+// (which overlays the first entry's resv field) by hand.
+static struct io_uring_buf* bufEntries(struct io_uring_buf_ring* ring)
+{
+  return (struct io_uring_buf*)ring;
+}
+
+static uint16_t* bufTail(struct io_uring_buf_ring* ring)
+{
+  return &bufEntries(ring)[0].resv;
+}
+
+UringLoop::UringLoop(int listenfd, const ServerConfig& config, std::function<std::string()> nextFilename)
+: _listenfd(listenfd), _config(config), _nextFilename(nextFilename), _timers(10),
+  _acceptOp(Op::ACCEPT), _acceptArmed(false), _acceptPaused(false), _bufRing((struct io_uring_buf_ring*)MAP_FAILED), _bufRingSize(0),
+  _bufBase((char*)MAP_FAILED), _bufCount(bufferCount(config.bufferSize)), _bufSize(config.bufferSize),
+  _bufAdded(0)
+{
+}
+
+UringLoop::~UringLoop()
+{
+  for (WriteOp* op : _freeWrites)
+    delete op;
+  if (_bufBase != MAP_FAILED)
+    munmap(_bufBase, (size_t)_bufCount * _bufSize);
+  if (_bufRing != MAP_FAILED)
+    munmap(_bufRing, _bufRingSize);
+}
+
+bool UringLoop::init()
+{
+  return _ring.setup(RING_ENTRIES) && setupBuffers();
+}
+
+bool UringLoop::setupBuffers()
+{
+  _bufRingSize = _bufCount * sizeof(struct io_uring_buf);
+  _bufRing = (struct io_uring_buf_ring*)mmap(nullptr, _bufRingSize, PROT_READ | PROT_WRITE,
+                                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (_bufRing == MAP_FAILED)
+    return false;
+
+  _bufBase = (char*)mmap(nullptr, (size_t)_bufCount * _bufSize, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (_bufBase == MAP_FAILED)
+    return false;
+
+  if (!_ring.registerBufferRing(_bufRing, _bufCount, BUFFER_GROUP))
+    return false;
+
+  *bufTail(_bufRing) = 0;
+  for (unsigned bid = 0; bid < _bufCount; bid++)
+    recycleBuffer(bid);
+  publishBuffers();
+  return true;
+}
+
+void UringLoop::recycleBuffer(uint16_t bid)
+{
+  struct io_uring_buf* buf = &bufEntries(_bufRing)[(*bufTail(_bufRing) + _bufAdded) & (_bufCount - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(_bufBase + (size_t)bid * _bufSize);
+  buf->len = _bufSize;
+  buf->bid = bid;
+  _bufAdded++;
+}
+
+void UringLoop::publishBuffers()
+{
+  if (_bufAdded == 0)
+    return;
+  uint16_t* tail = bufTail(_bufRing);
+  __atomic_store_n(tail, (uint16_t)(*tail + _bufAdded), __ATOMIC_RELEASE);
+  _bufAdded = 0;
+}
+
+struct io_uring_sqe* UringLoop::sqe()
+{
+  struct io_uring_sqe* s = _ring.getSqe();
+  if (s == nullptr) {
+    // can only happen if the kernel stopped consuming; nothing sane to do
+    std::cerr << "ERROR: io_uring submission queue stuck\n";
+    exit(EXIT_FAILURE);
+  }
+  return s;
+}
+
+void UringLoop::armAccept()
+{
+  struct io_uring_sqe* s = sqe();
+  s->opcode = IORING_OP_ACCEPT;
+  s->fd = _listenfd;
+  s->ioprio = IORING_ACCEPT_MULTISHOT;
+  s->accept_flags = SOCK_CLOEXEC;
+  s->user_data = (uint64_t)(uintptr_t)&_acceptOp;
+  _acceptArmed = true;
+}
+
+void UringLoop::pauseAccepting()
+{
+  if (_acceptPaused)
+    return;
+  _acceptPaused = true;
+  if (_acceptArmed) {
+    struct io_uring_sqe* s = sqe();
+    s->opcode = IORING_OP_ASYNC_CANCEL;
+    s->fd = -1;
+    s->addr = (uint64_t)(uintptr_t)&_acceptOp;
+    s->user_data = 0;
+  }
+  // a slot freed on another ring doesn't tell us
+  _acceptTimer._fire = [this]() { resumeAccepting(); };
+  _timers.schedule(_acceptTimer, ADMISSION_RETRY_MS);
+}
+
+void UringLoop::resumeAccepting()
+{
+  while (!_waiting.empty() && Admission::enter()) {
+    start(_waiting.front());
+    _waiting.pop_front();
+  }
+  if (!_waiting.empty() || !Admission::hasRoom()) {
+    if (!_acceptTimer.armed())
+      _timers.schedule(_acceptTimer, ADMISSION_RETRY_MS);
+    return;
+  }
+  _timers.cancel(_acceptTimer);
+  _acceptPaused = false;
+  // still armed if the cancel hasn't come back yet; it re-arms then
+  if (!_acceptArmed)
+    armAccept();
+}
+
+void UringLoop::armRecv(UringConnection* uc)
+{
+  struct io_uring_sqe* s = sqe();
+  s->opcode = IORING_OP_RECV;
+  s->fd = uc->_conn._fd;
+  s->ioprio = IORING_RECV_MULTISHOT;
+  s->flags = IOSQE_BUFFER_SELECT;
+  s->buf_group = BUFFER_GROUP;
+  s->user_data = (uint64_t)(uintptr_t)uc;
+  uc->_recvArmed = true;
+}
+
+void UringLoop::cancelRecv(UringConnection* uc)
+{
+  if (!uc->_recvArmed)
+    return;
+  struct io_uring_sqe* s = sqe();
+  s->opcode = IORING_OP_ASYNC_CANCEL;
+  s->fd = -1;
+  s->addr = (uint64_t)(uintptr_t)uc;
+  s->user_data = 0;
+}
+
+void UringLoop::pace(UringConnection* uc, bool armed)
+{
+  if (uc->_conn._throttleTimer.armed())
+    return;		// re-armed off the wheel
+  unsigned wait = uc->_conn.throttleMillis();
+  if (wait == 0) {
+    if (!armed)
+      armRecv(uc);
+  } else if (armed) {
+    // over its bandwidth; the -ECANCELED completion comes back here
+    cancelRecv(uc);
+  } else {
+    uc->_conn._throttleTimer._fire = [this, uc]() {
+      if (!uc->_done)
+        armRecv(uc);
+    };
+    _timers.schedule(uc->_conn._throttleTimer, wait);
+  }
+}
+
+void UringLoop::queueWrite(UringConnection* uc, WriteOp* op)
+{
+  struct io_uring_sqe* s = sqe();
+  s->opcode = IORING_OP_WRITE;
+  s->fd = uc->_conn._ofd;
+  s->addr = (uint64_t)(uintptr_t)op->_data;
+  s->len = op->_len;
+  s->off = op->_offset;
+  s->user_data = (uint64_t)(uintptr_t)op;
+  // Not linked: every write says where it goes, so they may land in any
+  // order, and a link would chain whatever SQE comes next in the ring,
+  // another client's included.
+}
+
+void UringLoop::onAccept(struct io_uring_cqe* cqe)
+{
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    _acceptArmed = false;
+    if (!_acceptPaused)
+      armAccept();
+  }
+
+  if (cqe->res < 0) {
+    if (cqe->res != -ECANCELED) {
+      errno = -cqe->res;
+      perror("accept");
+    }
+    return;
+  }
+
+  recordAcceptWait(cqe->res);
+  // A multishot accept can't be told to hold back. Past the limit the
+  // client is turned away, or parked unread until a slot frees up, with the
+  // accept cancelled so that the rest stay in the listen queue.
+  if (!Admission::enter()) {
+    if (Admission::refusing()) {
+      shedConnection(cqe->res);
+    } else {
+      _waiting.push_back(cqe->res);
+      pauseAccepting();
+    }
+    return;
+  }
+  if (!Admission::refusing() && !Admission::hasRoom())
+    pauseAccepting();
+  start(cqe->res);
+}
+
+void UringLoop::start(int fd)
+{
+  UringConnection* uc = new UringConnection(fd, _nextFilename, _config);
+  if (uc->_conn._state == Connection::CLOSED) {
+    delete uc;
+    return;
+  }
+
+  uc->_conn._idleTimer._fire = [this, uc]() { onIdleTimer(uc); };
+  _timers.schedule(uc->_conn._idleTimer, _config.idleTimeoutMs);
+  if (_config.transferTimeoutMs > 0) {
+    uc->_conn._transferTimer._fire = [this, uc]() { onTransferTimer(uc); };
+    _timers.schedule(uc->_conn._transferTimer, _config.transferTimeoutMs);
+  }
+
+  armRecv(uc);
+}
+
+void UringLoop::onRecv(UringConnection* uc, struct io_uring_cqe* cqe)
+{
+  bool more = cqe->flags & IORING_CQE_F_MORE;
+  if (!more)
+    uc->_recvArmed = false;
+
+  if (cqe->res > 0) {
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    const char* data = _bufBase + (size_t)bid * _bufSize;
+    size_t len = cqe->res;
+    uc->_conn.received(len);
+
+    if (!uc->_done && !uc->_conn._headerDone && !uc->_conn._session) {
+      ssize_t used = uc->_conn.consumeHeader(data, len);
+      if (used < 0) {
+        fail(uc);
+      } else {
+        data += used;
+        len -= used;
+      }
+    }
+
+    if (!uc->_done && len > 0
+        && (uc->_conn._chunked != nullptr || uc->_conn._unpacker != nullptr || uc->_conn._session)) {
+      // Inflated, or chunked and hashed, right here on the loop; what lands
+      // in the file isn't this buffer, so there is no write to queue. A
+      // session's files are small and one closes before the next opens, so
+      // they are written here too.
+      if (uc->_conn.consume(data, len) < 0)
+        fail(uc);
+      len = 0;
+    }
+
+    if (!uc->_done && len > 0) {
+      size_t body = uc->_conn.bodyPart(len);
+      if (body + uc->_conn.takeTrailer(data + body, len - body) < len) {
+        uc->_conn._rejected = true;
+        errno = EPROTO;		// more than the header promised
+        fail(uc);
+      }
+      len = body;
+    }
+
+    uint64_t offset = uc->_conn._bodyOffset + uc->_conn._totalBytesRead;
+    if (!uc->_done && len > 0 && !uc->_conn.acceptBody(len))
+      fail(uc);
+    if (!uc->_done && len > 0)
+      uc->_conn.checksum(data, len);
+
+    if (uc->_done || len == 0) {
+      recycleBuffer(bid);
+    } else {
+      WriteOp* op;
+      if (_freeWrites.empty()) {
+        op = new WriteOp();
+      } else {
+        op = _freeWrites.back();
+        _freeWrites.pop_back();
+      }
+      op->_owner = uc;
+      op->_bid = bid;
+      op->_data = data;
+      op->_len = len;
+      op->_offset = offset;
+      op->_since = uc->_conn._receivedAt;
+
+      uc->_inflight++;
+      queueWrite(uc, op);
+    }
+
+    if (!uc->_done)
+      pace(uc, more);
+  } else if (cqe->res == 0) {
+    // eof reached and client closed cxn
+    uc->_done = true;
+  } else if (cqe->res == -ENOBUFS) {
+    // every buffer is waiting on a write; try again once some come back
+    if (!uc->_done)
+      _starved.push_back(uc);
+  } else if (cqe->res == -ECANCELED) {
+    // stopped by pace(); fail() and expiry mark the connection done first
+    if (!uc->_done)
+      pace(uc, false);
+  } else {
+    errno = -cqe->res;
+    fail(uc);
+  }
+
+  maybeFinish(uc);
+}
+
+void UringLoop::onWrite(WriteOp* op, struct io_uring_cqe* cqe)
+{
+  UringConnection* uc = op->_owner;
+
+  if (cqe->res >= 0 && (uint32_t)cqe->res < op->_len) {
+    op->_data += cqe->res;
+    op->_len -= cqe->res;
+    op->_offset += cqe->res;
+    uc->_conn._totalBytesWritten += cqe->res;
+    queueWrite(uc, op);
+    return;
+  }
+
+  if (cqe->res < 0) {
+    errno = -cqe->res;
+    Metrics::count(Metrics::WRITE_ERRORS);
+    fail(uc);
+  } else {
+    uc->_conn._totalBytesWritten += cqe->res;
+    Metrics::record(Metrics::RECV_TO_WRITE, monotonicMicros() - op->_since);
+  }
+
+  recycleBuffer(op->_bid);
+  _freeWrites.push_back(op);
+  uc->_inflight--;
+  maybeFinish(uc);
+}
+
+void UringLoop::fail(UringConnection* uc)
+{
+  // errno says why; the file is dealt with once the last write lands
+  perror("ERROR");
+  uc->_done = true;
+  cancelRecv(uc);
+}
+
+void UringLoop::onIdleTimer(UringConnection* uc)
+{
+  uint64_t idle = uc->_conn.idleMillis(TimerWheel::nowMillis());
+  if (idle >= _config.idleTimeoutMs)
+    expire(uc);
+  else
+    _timers.schedule(uc->_conn._idleTimer, _config.idleTimeoutMs - idle);
+}
+
+void UringLoop::onTransferTimer(UringConnection* uc)
+{
+  // restarted for every file of a session
+  uint64_t elapsed = uc->_conn.transferMillis(TimerWheel::nowMillis());
+  if (elapsed >= _config.transferTimeoutMs) {
+    std::cerr << "ERROR: " << uc->_conn._filename << " exceeded the transfer deadline\n";
+    expire(uc);
+  } else {
+    _timers.schedule(uc->_conn._transferTimer, _config.transferTimeoutMs - elapsed);
+  }
+}
+
+void UringLoop::expire(UringConnection* uc)
+{
+  // Deferred: we're inside the wheel's tick and uc owns the timer.
+  if (uc->_expired || uc->_done)
+    return;
+  uc->_expired = true;
+  _expiredQueue.push_back(uc);
+}
+
+void UringLoop::maybeFinish(UringConnection* uc)
+{
+  if (!uc->_done || uc->_recvArmed || uc->_inflight > 0)
+    return;
+  for (UringConnection* starved : _starved) {
+    if (starved == uc)
+      return;		// picked up when the starved list is drained
+  }
+
+  if (uc->_expired)
+    uc->_conn.onTimeout();
+  delete uc;
+
+  if (_acceptPaused)
+    resumeAccepting();
+}
+
+void UringLoop::run()
+{
+  armAccept();
+
+  for (;;) {
+    _ring.submitAndWait(_timers.millisUntilNext());
+
+    struct io_uring_cqe* next;
+    while ((next = _ring.peekCqe()) != nullptr) {
+      // copy out and hand the slot back before we queue more work
+      struct io_uring_cqe cqe = *next;
+      _ring.seen();
+
+      Op* op = (Op*)(uintptr_t)cqe.user_data;
+      if (op == nullptr)
+        continue;	// cancel request acknowledgements
+
+      switch (op->_type) {
+        case Op::ACCEPT:
+          onAccept(&cqe);
+          break;
+        case Op::RECV:
+          onRecv(static_cast<UringConnection*>(op), &cqe);
+          break;
+        case Op::WRITE:
+          onWrite(static_cast<WriteOp*>(op), &cqe);
+          break;
+      }
+    }
+
+    // Buffers freed by this batch of writes go back to the kernel in one
+    // store, then anyone who ran dry gets their recv re-armed.
+    bool returned = _bufAdded > 0;
+    publishBuffers();
+    if (returned && !_starved.empty()) {
+      std::vector<UringConnection*> starved;
+      starved.swap(_starved);
+      for (UringConnection* uc : starved) {
+        if (uc->_done)
+          maybeFinish(uc);
+        else
+          armRecv(uc);
+      }
+    }
+
+    _timers.advance();
+    std::vector<UringConnection*> expired;
+    expired.swap(_expiredQueue);
+    for (UringConnection* uc : expired) {
+      uc->_done = true;
+      _timers.cancel(uc->_conn._idleTimer);
+      _timers.cancel(uc->_conn._transferTimer);
+      cancelRecv(uc);
+      maybeFinish(uc);
+    }
+  }
+}
@@ -0,0 +1,114 @@
+#ifndef _uring_loop_
+#define _uring_loop_
+
+#include <deque>
+#include <functional>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "Connection.h"
+#include "ServerConfig.h"
+#include "TimerWheel.h"
+#include "Uring.h"
+
+// io_uring flavour of the server. One ring per thread carries the whole
+// pipeline: a multishot accept on the listener, a multishot recv per client
+// that picks its buffer from a shared provided-buffer ring, and a write of
+// each filled buffer to the client's file at its offset. The buffer goes
+// back to the ring when the write completes. The writes are positional, so
+// a client's may complete in any order. A client
+// over its bandwidth has its recv cancelled and re-armed off the wheel; at
+// the connection limit the accept is cancelled the same way, and whoever it
+// took meanwhile waits unread for a slot.
+class UringLoop
+{
+private:
+	struct Op {
+		enum Type { ACCEPT, RECV, WRITE };
+		Type _type;
+		Op(Type type) : _type(type) {}
+	};
+
+	struct UringConnection : Op {
+		Connection _conn;
+		bool _recvArmed;
+		bool _done;			// EOF, error or timeout: no more recv
+		bool _expired;
+		unsigned _inflight;		// writes not completed yet
+
+		UringConnection(int fd, std::function<std::string()> nextFilename, const ServerConfig& config)
+		: Op(RECV), _conn(fd, nextFilename, config), _recvArmed(false), _done(false),
+		  _expired(false), _inflight(0)
+		{
+			// the ring already writes behind; the rest is written in line
+			_conn._writeBehind = false;
+		}
+	};
+
+	struct WriteOp : Op {
+		UringConnection* _owner;
+		uint16_t _bid;
+		const char* _data;
+		uint32_t _len;
+		uint64_t _offset;
+		uint64_t _since;		// when the buffer was received
+
+		WriteOp() : Op(WRITE), _owner(nullptr), _bid(0), _data(nullptr), _len(0), _offset(0), _since(0) {}
+	};
+
+	int _listenfd;
+	const ServerConfig& _config;
+	std::function<std::string()> _nextFilename;
+	Uring _ring;
+	TimerWheel _timers;
+	Op _acceptOp;
+	bool _acceptArmed;
+	bool _acceptPaused;		// at the connection limit
+	TimerWheel::Timer _acceptTimer;
+	std::deque<int> _waiting;	// accepted past the limit, not started
+
+	// provided buffers
+	struct io_uring_buf_ring* _bufRing;
+	size_t _bufRingSize;
+	char* _bufBase;
+	unsigned _bufCount;
+	unsigned _bufSize;
+	unsigned _bufAdded;		// returned since the last publish
+
+	std::vector<WriteOp*> _freeWrites;
+	std::vector<UringConnection*> _starved;	// recv stopped for lack of buffers
+	std::vector<UringConnection*> _expiredQueue;
+
+	bool setupBuffers();
+	void recycleBuffer(uint16_t bid);
+	void publishBuffers();
+
+	struct io_uring_sqe* sqe();
+	void armAccept();
+	void pauseAccepting();
+	void resumeAccepting();
+	void armRecv(UringConnection* uc);
+	void queueWrite(UringConnection* uc, WriteOp* op);
+	void cancelRecv(UringConnection* uc);
+	void pace(UringConnection* uc, bool armed);
+
+	void onAccept(struct io_uring_cqe* cqe);
+	void start(int fd);
+	void onRecv(UringConnection* uc, struct io_uring_cqe* cqe);
+	void onWrite(WriteOp* op, struct io_uring_cqe* cqe);
+	void fail(UringConnection* uc);
+	void onIdleTimer(UringConnection* uc);
+	void onTransferTimer(UringConnection* uc);
+	void expire(UringConnection* uc);
+	void maybeFinish(UringConnection* uc);
+
+public:
+	UringLoop(int listenfd, const ServerConfig& config, std::function<std::string()> nextFilename);
+	~UringLoop();
+
+	bool init();
+	void run();
+};
+
+#endif
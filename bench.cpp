@@ -0,0 +1,297 @@
+#include <csignal>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <thread>
+
+#include "bench.h"
+#include "BufferPool.h"
+#include "Protocol.h"
+
+#ifndef ARG_ERROR
+#define ARG_ERROR 1
+#endif
+
+#define TIMEOUT 15 // seconds
+
+// Bodies go out in writes of up to this, cut from twice as much random data.
+const size_t BENCH_SLICE = 1 << 20;
+// Sizes are kept to this, whatever the distribution's tail says.
+const uint64_t MAX_UPLOAD = (uint64_t)1 << 40;
+
+bool SizeDistribution::parse(const std::string& spec)
+{
+  size_t colon = spec.find(':');
+  if (colon == std::string::npos)
+    return false;
+  std::string kindName = spec.substr(0, colon);
+  std::string args = spec.substr(colon + 1);
+  sigma = 1.0;
+
+  if (kindName == "fixed") {
+    kind = FIXED;
+    low = high = parseSize(args.c_str());
+    return low > 0;
+  }
+  if (kindName == "uniform") {
+    kind = UNIFORM;
+    size_t dash = args.find('-');
+    if (dash == std::string::npos)
+      return false;
+    low = parseSize(args.substr(0, dash).c_str());
+    high = parseSize(args.substr(dash + 1).c_str());
+    return low > 0 && high >= low;
+  }
+  if (kindName == "lognormal") {
+    kind = LOGNORMAL;
+    size_t comma = args.find(',');
+    low = high = parseSize(args.substr(0, comma).c_str());
+    if (comma != std::string::npos)
+      sigma = atof(args.c_str() + comma + 1);
+    return low > 0 && sigma > 0;
+  }
+  return false;
+}
+
+uint64_t SizeDistribution::sample(std::mt19937_64& random) const
+{
+  switch (kind) {
+    case UNIFORM:
+      return std::uniform_int_distribution<uint64_t>(low, high)(random);
+    case LOGNORMAL: {
+      double size = std::lognormal_distribution<double>(log((double)low), sigma)(random);
+      return size < 1 ? 1 : size > MAX_UPLOAD ? MAX_UPLOAD : (uint64_t)size;
+    }
+    default:
+      return low;
+  }
+}
+
+bool BenchClient::upload(const std::string& name, uint64_t size, const std::string& data,
+                         uint64_t start)
+{
+  initializeNetworkSettings();
+
+  UploadHeader header;
+  header.fileSize = size;
+  header.name = name;
+  std::string encoded = encodeUploadHeader(header);
+  if (writeBytesFromBufferToSocket(&encoded[0], encoded.size(), sockfd) == -1)
+    return false;
+
+  for (uint64_t sent = 0; sent < size;) {
+    size_t len = std::min((uint64_t)BENCH_SLICE, size - sent);
+    char* slice = (char*)data.data() + (start + sent) % BENCH_SLICE;
+    if (writeBytesFromBufferToSocket(slice, len, sockfd) == -1)
+      return false;
+    sent += len;
+  }
+
+  // The server closes its end once the file is finished with; anything it
+  // says before then (a refusal) is read and ignored.
+  shutdown(sockfd, SHUT_WR);
+  struct timeval tv;
+  tv.tv_sec = TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  char buf[256];
+  for (;;) {
+    ssize_t n = recv(sockfd, buf, sizeof(buf), 0);
+    if (n == 0)
+      return true;
+    if (n == -1 && errno != EINTR) {
+      perror("ERROR");
+      return false;
+    }
+  }
+}
+
+bench::bench(int argc, char* argv[])
+: concurrency(64), uploads(1000), serverPid(0), next(0)
+{
+  sizes.parse("fixed:64k");
+  int first = parseOptions(argc, argv);
+  if (argc - first != 2) {
+    std::cerr << "ERROR: Incorrect number of arguments." << std::endl;
+    usage();
+    exit(ARG_ERROR);
+  }
+  hostname = argv[first];
+  port = argv[first + 1];
+
+  std::mt19937_64 random(1);
+  data.resize(2 * BENCH_SLICE);
+  for (size_t i = 0; i + 8 <= data.size(); i += 8) {
+    uint64_t word = random();
+    memcpy(&data[i], &word, 8);
+  }
+}
+
+int bench::parseOptions(int argc, char* argv[])
+{
+  static struct option longopts[] = {
+    { "concurrency", required_argument, nullptr, 'c' },
+    { "uploads", required_argument, nullptr, 'n' },
+    { "sizes", required_argument, nullptr, 's' },
+    { "server-pid", required_argument, nullptr, 'P' },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "c:n:s:P:", longopts, nullptr)) != -1) {
+    switch (opt) {
+      case 'c':
+        concurrency = atoi(optarg);
+        if (concurrency == 0) {
+          std::cerr << "ERROR: need at least one connection" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      case 'n':
+        uploads = strtoul(optarg, nullptr, 10);
+        if (uploads == 0) {
+          std::cerr << "ERROR: need at least one upload" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      case 's':
+        if (!sizes.parse(optarg)) {
+          std::cerr << "ERROR: invalid size distribution \"" << optarg << "\"" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      case 'P':
+        serverPid = atoi(optarg);
+        break;
+      default:
+        usage();
+        exit(ARG_ERROR);
+    }
+  }
+  return optind;
+}
+
+void bench::usage()
+{
+  std::cerr << "Usage: ./bench [OPTIONS] <HOSTNAME-OR-IP> <PORT>\n";
+  std::cerr << "  Uploads generated files to a running server and reports how it kept up.\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -c, --concurrency=N     uploads in flight at once, one thread each (default 64)\n";
+  std::cerr << "  -n, --uploads=N         uploads in all (default 1000)\n";
+  std::cerr << "  -s, --sizes=DIST        fixed:SIZE, uniform:MIN-MAX or lognormal:MEDIAN[,SIGMA],\n";
+  std::cerr << "                          k/m/g suffixes ok (default fixed:64k)\n";
+  std::cerr << "  -P, --server-pid=PID    also report the server's resident memory\n";
+}
+
+void bench::work(unsigned thread, Results& results)
+{
+  std::mt19937_64 random(thread + 1);
+  for (;;) {
+    unsigned long upload = next++;
+    if (upload >= uploads)
+      return;
+    uint64_t size = sizes.sample(random);
+
+    auto started = std::chrono::steady_clock::now();
+    BenchClient c(hostname, port);
+    if (!c.upload("bench-" + std::to_string(upload), size, data, random())) {
+      results.failed++;
+      continue;
+    }
+    auto took = std::chrono::steady_clock::now() - started;
+    results.latencies.push_back(std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+    results.bytes += size;
+  }
+}
+
+bool bench::serverMemory(uint64_t& rss, uint64_t& peak)
+{
+  std::ifstream status("/proc/" + std::to_string(serverPid) + "/status");
+  std::string line;
+  rss = peak = 0;
+  while (std::getline(status, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0)
+      rss = strtoull(line.c_str() + 6, nullptr, 10) << 10;
+    else if (line.compare(0, 6, "VmHWM:") == 0)
+      peak = strtoull(line.c_str() + 6, nullptr, 10) << 10;
+  }
+  return rss > 0;
+}
+
+static double percentile(const std::vector<uint64_t>& sorted, double fraction)
+{
+  size_t rank = (size_t)ceil(fraction * sorted.size());
+  return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+void bench::report(std::vector<Results>& results, double seconds)
+{
+  std::vector<uint64_t> latencies;
+  uint64_t bytes = 0;
+  unsigned long failed = 0;
+  for (Results& r : results) {
+    latencies.insert(latencies.end(), r.latencies.begin(), r.latencies.end());
+    bytes += r.bytes;
+    failed += r.failed;
+  }
+  std::sort(latencies.begin(), latencies.end());
+
+  std::cout << "uploads: " << latencies.size() << " done, " << failed << " failed, "
+            << concurrency << " at a time, " << seconds << " s\n";
+  std::cout << "throughput: " << bytes / seconds / (1 << 20) << " MB/s, "
+            << latencies.size() / seconds << " connections/s\n";
+  if (!latencies.empty()) {
+    std::cout << "latency ms: p50=" << percentile(latencies, 0.5)
+              << " p99=" << percentile(latencies, 0.99)
+              << " p999=" << percentile(latencies, 0.999)
+              << " max=" << latencies.back() / 1000.0 << "\n";
+  }
+  uint64_t rss, peak;
+  if (serverPid > 0 && serverMemory(rss, peak))
+    std::cout << "server rss: " << (rss >> 20) << " MB, peak " << (peak >> 20) << " MB\n";
+}
+
+void bench::run()
+{
+  ::signal(SIGPIPE, SIG_IGN);
+
+  // every upload in flight is a socket here and another one in the server
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  std::vector<Results> results(concurrency);
+  std::vector<std::thread> threads;
+  auto started = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < concurrency; i++)
+    threads.push_back(std::thread(&bench::work, this, i, std::ref(results[i])));
+  for (std::thread& t : threads)
+    t.join();
+  std::chrono::duration<double> took = std::chrono::steady_clock::now() - started;
+
+  report(results, took.count());
+}
+
+int
+main(int argc, char* argv[])
+{
+  bench b(argc, argv);
+
+  b.run();
+
+  exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,73 @@
+#ifndef _bench_
+#define _bench_
+
+#include <atomic>
+#include <random>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "client.h"
+
+// File sizes for the generated uploads:
+//   fixed:SIZE            every upload the same
+//   uniform:MIN-MAX       evenly spread
+//   lognormal:MEDIAN[,S]  long tail, most near MEDIAN; S is sigma (default 1)
+struct SizeDistribution {
+	enum Kind { FIXED, UNIFORM, LOGNORMAL };
+
+	Kind kind;
+	uint64_t low;
+	uint64_t high;
+	double sigma;
+
+	bool parse(const std::string& spec);
+	uint64_t sample(std::mt19937_64& random) const;
+};
+
+// One upload over the client's connect and send code. The body is cut from
+// a block of random bytes held in memory, so the disk on this side never
+// gets in the way of what is being measured.
+class BenchClient : public client
+{
+public:
+	BenchClient(const std::string& hostname, const std::string& port) : client(hostname, port) {}
+
+	// Sends a framed upload of size bytes and waits for the server to hang
+	// up, which it does once it is done with the file.
+	bool upload(const std::string& name, uint64_t size, const std::string& data, uint64_t start);
+};
+
+class bench
+{
+private:
+	std::string hostname;
+	std::string port;
+	unsigned concurrency;
+	unsigned long uploads;
+	SizeDistribution sizes;
+	int serverPid;		// 0: no RSS figures
+	std::string data;		// what every body is cut from
+	std::atomic<unsigned long> next;
+
+	struct Results {
+		std::vector<uint64_t> latencies;	// us, of the uploads that worked
+		uint64_t bytes;
+		unsigned long failed;
+
+		Results() : bytes(0), failed(0) {}
+	};
+
+	int parseOptions(int argc, char* argv[]);
+	void work(unsigned thread, Results& results);
+	void report(std::vector<Results>& results, double seconds);
+	bool serverMemory(uint64_t& rss, uint64_t& peak);
+
+public:
+	bench(int argc, char* argv[]);
+
+	void usage();
+	void run();
+};
+
+#endif
@@ -1,21 +1,38 @@
 #include <arpa/inet.h>
+#include <csignal>
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <getopt.h>
+#include <poll.h>
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <limits.h>
 #include <unistd.h>
 
-#include <thread>
+#include <algorithm>
 #include <chrono>
+#include <random>
+#include <thread>
+#include <vector>
 
+#include <fstream>
 #include <iostream>
 #include "client.h"
+#include "BufferPool.h"
+#include "Compression.h"
+#include "Crc32c.h"
+#include "MappedFile.h"
+#include "Protocol.h"
 
 #ifndef ARG_ERROR
 #define ARG_ERROR 1
@@ -31,24 +48,51 @@
 
 #define TIMEOUT 15 // seconds
 
+// Connect retries back off from this ceiling, doubling up to the next.
+const unsigned BACKOFF_BASE_MS = 50;
+const unsigned BACKOFF_MAX_MS = 2000;
+
+// sendfile() moves at most this much per call so progress can be reported
+const size_t SENDFILE_RANGE = 16 << 20;
+// --streams ranges start on a multiple of this, and are never smaller
+const unsigned long STREAM_ALIGN = 1 << 20;
+
 client::client() : hostname(nullptr), port(nullptr), filename(nullptr) {}
 
+client::client(const std::string& hostname, const std::string& port)
+: hostname(hostname), port(port), fstream(nullptr), useSendfile(false), showProgress(false),
+  fileSize(0), bytesSent(0), lastProgress(0), bufferSize(DEFAULT_BUFFER_SIZE), sizeKnown(false),
+  rawStream(false), framed(false), streams(1), resumable(false), retries(30), compressLevel(0),
+  checksum(false), mmapWindow(0), sockfd(-1) {}
+
 client::client(int argc, char* argv[])
+: fstream(nullptr), useSendfile(false), showProgress(false), fileSize(0), bytesSent(0),
+  lastProgress(0), bufferSize(DEFAULT_BUFFER_SIZE), sizeKnown(false), rawStream(false),
+  framed(false), streams(1), resumable(false), retries(30), compressLevel(0),
+  checksum(false), mmapWindow(0), sockfd(-1)
 {
-	// We should have exactly 4 arguments
-  if (argc != 4) {
+  int first = parseOptions(argc, argv);
+  if (resumable && (rawStream || streams > 1)) {
+    std::cerr << "ERROR: --resume needs the upload header and a single stream" << std::endl;
+    exit(ARG_ERROR);
+  }
+
+	// After the options: host, port and at least one file, unless they come
+	// from --files-from
+  int minArgs = filesFrom.empty() ? 3 : 2;
+  if (argc - first < minArgs) {
     std::cerr << "ERROR: Incorrect number of arguments." << std::endl;
     usage();
     exit(ARG_ERROR);
   }
 
-  hostname = getArg(argv[1]);
+  hostname = getArg(argv[first]);
   if (hostname.empty()) {
     std::cerr << "ERROR: Unable to get HOSTNAME-OR-IP" << std::endl;
     exit(ARG_ERROR);
   }
 
-  port = getArg(argv[2]);
+  port = getArg(argv[first+1]);
   port = checkPortNo(port);
   if (port.empty()) {
     std::cerr << "ERROR: invalid PORT number" << std::endl;
@@ -56,17 +100,123 @@ client::client(int argc, char* argv[])
   }
 
   // Then we move onto getting the dirName
-  filename = getArg(argv[3]);
-  if (filename.empty()) {
+  for (int i = first + 2; i < argc; i++)
+    filenames.push_back(getArg(argv[i]));
+  if (!filesFrom.empty())
+    readFileList();
+  if (filenames.empty() || filenames[0].empty()) {
     std::cerr << "ERROR: Unable to get FILENAME" << std::endl;
     exit(ARG_ERROR);
   }
+  filename = filenames[0];
+
+  if (filenames.size() > 1 && (resumable || rawStream || streams > 1)) {
+    std::cerr << "ERROR: several files go over one session, without --resume, --raw or --streams"
+              << std::endl;
+    exit(ARG_ERROR);
+  }
+}
+
+void client::readFileList()
+{
+  std::ifstream file;
+  if (filesFrom != "-") {
+    file.open(filesFrom);
+    if (!file) {
+      std::cerr << "ERROR: Unable to open " << filesFrom << std::endl;
+      exit(ARG_ERROR);
+    }
+  }
+  std::istream& in = filesFrom == "-" ? std::cin : file;
+  std::string line;
+  while (std::getline(in, line))
+    if (!line.empty())
+      filenames.push_back(line);
 }
 
 client::~client()
 {
-  fclose(fstream);
-  close(sockfd);
+  if (fstream != nullptr)
+    fclose(fstream);
+  if (sockfd != -1)
+    close(sockfd);
+}
+
+int client::parseOptions(int argc, char* argv[])
+{
+  static struct option longopts[] = {
+    { "sendfile", no_argument, nullptr, 'z' },
+    { "progress", no_argument, nullptr, 'p' },
+    { "buffer-size", required_argument, nullptr, 'B' },
+    { "raw", no_argument, nullptr, 'r' },
+    { "streams", required_argument, nullptr, 'n' },
+    { "resume", no_argument, nullptr, 'R' },
+    { "retries", required_argument, nullptr, 'T' },
+    { "compress", optional_argument, nullptr, 'Z' },
+    { "checksum", no_argument, nullptr, 'K' },
+    { "files-from", required_argument, nullptr, 'F' },
+    { "mmap", optional_argument, nullptr, 'M' },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "zpB:rn:RT:Z::KF:M::", longopts, nullptr)) != -1) {
+    switch (opt) {
+      case 'z':
+        useSendfile = true;
+        break;
+      case 'p':
+        showProgress = true;
+        break;
+      case 'B':
+        bufferSize = parseSize(optarg);
+        if (bufferSize < 4096 || bufferSize > (16 << 20)) {
+          std::cerr << "ERROR: buffer size must be between 4k and 16m" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      case 'r':
+        rawStream = true;
+        break;
+      case 'n':
+        streams = atoi(optarg);
+        if (streams == 0 || streams > 64) {
+          std::cerr << "ERROR: streams must be between 1 and 64" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      case 'R':
+        resumable = true;
+        break;
+      case 'T':
+        retries = atoi(optarg);
+        break;
+      case 'Z':
+        compressLevel = optarg != nullptr ? atoi(optarg) : 1;
+        if (compressLevel < 1 || compressLevel > 9) {
+          std::cerr << "ERROR: compression level must be between 1 and 9" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      case 'K':
+        checksum = true;
+        break;
+      case 'F':
+        filesFrom = optarg;
+        break;
+      case 'M':
+        mmapWindow = optarg != nullptr ? parseSize(optarg) : DEFAULT_MMAP_WINDOW;
+        if (mmapWindow < (1 << 20)) {
+          std::cerr << "ERROR: mmap window must be at least 1m" << std::endl;
+          exit(ARG_ERROR);
+        }
+        break;
+      default:
+        usage();
+        exit(ARG_ERROR);
+    }
+  }
+  return optind;
 }
 
 std::string client::getArg(const char* arg)
@@ -83,10 +233,26 @@ int client::getSockFd() {return sockfd;}
 
 void client::usage()
 {
-  std::cerr << "Usage: ./client <HOSTNAME-OR-IP> <PORT> <FILENAME>\n";
+  std::cerr << "Usage: ./client [OPTIONS] <HOSTNAME-OR-IP> <PORT> <FILENAME>...\n";
   std::cerr << "  <HOSTNAME-OR-IP> hostname or IP address of the server to connect with.\n";
   std::cerr << "  <PORT>           port number of the server to connect with.\n";
-  std::cerr << "  <FILENAME>       name of the file to transfer to the server\n";
+  std::cerr << "  <FILENAME>       name of the file to transfer to the server; several\n";
+  std::cerr << "                   files all go over one connection\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -z, --sendfile          send straight from the page cache with sendfile(2)\n";
+  std::cerr << "  -p, --progress          report bytes sent while the upload runs\n";
+  std::cerr << "  -B, --buffer-size=BYTES copy loop buffer, k/m suffixes ok (default 64k)\n";
+  std::cerr << "  -r, --raw               no upload header, for servers that predate it\n";
+  std::cerr << "  -n, --streams=N         split the file over N parallel connections\n";
+  std::cerr << "  -R, --resume            reconnect and carry on where the server left off\n";
+  std::cerr << "  -T, --retries=N         reconnects --resume may make (default 30)\n";
+  std::cerr << "  -Z, --compress[=LEVEL]  deflate the body if the server agrees (level 1-9,\n";
+  std::cerr << "                          default 1); blocks that don't shrink go as they are\n";
+  std::cerr << "  -K, --checksum          have the server check a CRC-32C of the body (no sendfile)\n";
+  std::cerr << "  -F, --files-from=LIST   also send the files named in LIST, one per line\n";
+  std::cerr << "                          (- for stdin)\n";
+  std::cerr << "  -M, --mmap[=WINDOW]     read regular files through a sliding mmap() window\n";
+  std::cerr << "                          (default 64m) and write from it in large slices\n";
 }
 
 void client::setupHints(struct addrinfo& hints)
@@ -108,15 +274,24 @@ struct addrinfo* client::getAddrInfo(struct addrinfo& hints)
   return res;
 }
 
-ushort client::sleepForOneSecond()
+// Sleeps before the next connect attempt and returns for how long, in ms:
+// a random time up to a ceiling that doubles with every failed attempt.
+// Clients turned away together then come back spread out instead of all at
+// once on the same second.
+unsigned client::backOff(unsigned attempt)
 {
-  std::this_thread::sleep_for(std::chrono::seconds(1));
-  return 1;
+  static thread_local std::mt19937 random(std::random_device{}());
+  unsigned ceiling = BACKOFF_MAX_MS;
+  if (attempt < 16)
+    ceiling = std::min(ceiling, BACKOFF_BASE_MS << attempt);
+  unsigned millis = std::uniform_int_distribution<unsigned>(1, ceiling)(random);
+  std::this_thread::sleep_for(std::chrono::milliseconds(millis));
+  return millis;
 }
 
-bool client::timedOut(ushort secondsAsleep) 
+bool client::timedOut(unsigned millisAsleep)
 {
-  return TIMEOUT <= secondsAsleep;
+  return TIMEOUT * 1000 <= millisAsleep;
 }
 
 int client::createSocketAndConnect(struct addrinfo* results)
@@ -124,8 +299,9 @@ int client::createSocketAndConnect(struct addrinfo* results)
   struct addrinfo* rp;
   int fd;
   int status = -1;
-  int secondsAsleep = 0;
-  while( !timedOut(secondsAsleep) && (status == -1) ) {
+  unsigned millisAsleep = 0;
+  unsigned attempt = 0;
+  while( !timedOut(millisAsleep) && (status == -1) ) {
     for( rp = results; rp != nullptr; rp = rp->ai_next ) {
       fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
       if( fd == -1)
@@ -139,10 +315,10 @@ int client::createSocketAndConnect(struct addrinfo* results)
     }// end for
 
     if( status == -1 )
-      secondsAsleep += sleepForOneSecond();
+      millisAsleep += backOff(attempt++);
   }
 
-  if( timedOut(secondsAsleep) ) {
+  if( timedOut(millisAsleep) ) {
     errno = ETIMEDOUT;
     perror("ERROR");
     exit(TIMEOUT);
@@ -169,71 +345,717 @@ FILE* client::openFile()
     std::cerr << "ERROR: Unable to open file.\n";
     exit(2);
   }
+
+  struct stat st;
+  if (fstat(fileno(fstream), &st) == 0) {
+    fileSize = st.st_size;
+    sizeKnown = S_ISREG(st.st_mode);
+  }
   return fstream;
 }
 
-const unsigned short CHUNK = 1024;
+std::string client::baseName()
+{
+  size_t slash = filename.find_last_of('/');
+  return slash == std::string::npos ? filename : filename.substr(slash + 1);
+}
 
-int client::readBytesFromFileToBuffer(FILE* file, char* buf, unsigned long nbyte)
+void client::addFlags(UploadHeader& header)
 {
-  int bytesRead = fread(buf, sizeof(char), nbyte-1, file);
-  if ( bytesRead == -1 ) {
-    perror("ERROR");
-    // fclose(file);
+  if (compressLevel > 0) {
+    header.flags |= UPLOAD_FLAG_COMPRESSED;
+    header.codec = CODEC_DEFLATE;
+  }
+  if (checksum)
+    header.flags |= UPLOAD_FLAG_CHECKSUM;
+}
+
+Task<bool> client::sendTrailer(FileManager& io, int socket, uint32_t crc)
+{
+  if (!checksum)
+    co_return true;
+  std::string encoded = encodeUploadTrailer(crc);
+  co_return co_await io.writeBytesFromBufferToSocket(encoded.data(), encoded.size(), socket) != -1;
+}
+
+bool client::sendHeader(int socket)
+{
+  // Without a size up front (a pipe, say) there is nothing for the server
+  // to preallocate, so such uploads stay raw.
+  if (rawStream || !sizeKnown)
+    return true;
+
+  UploadHeader header;
+  header.fileSize = fileSize;
+  header.name = baseName();
+  addFlags(header);
+
+  std::string encoded = encodeUploadHeader(header);
+  if (writeBytesFromBufferToSocket(&encoded[0], encoded.size(), socket) == -1)
     exit(IOERROR);
-  } 
-  return bytesRead;
+  framed = true;
+
+  // a compressed body waits for the server to say it can read one
+  UploadReply reply;
+  if (compressLevel > 0)
+    return readReply(socket, reply, TIMEOUT) && reply.status == REPLY_RESUME;
+  return true;
 }
 
 int client::writeBytesFromBufferToSocket(char* buf, unsigned long nbyte, int socket)
 {
-  int bytesWritten = ::write(socket, buf, nbyte);
-  if (bytesWritten == -1) {
-    perror("ERROR");
-    exit(IOERROR);
+  unsigned long bytesWritten = 0;
+  while (bytesWritten < nbyte) {
+    int n = ::write(socket, buf + bytesWritten, nbyte - bytesWritten);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      perror("ERROR");
+      return -1;
+    }
+    bytesWritten += n;
   }
   return bytesWritten;
 }
 
-void client::sendFileOverNetworkSocket(int socket)
+const char* client::readSlice(int fd, MappedFile& map, BufferPool::Lease& buf, unsigned long offset,
+                              size_t& want)
 {
-  FILE* file = openFile();
+  if (map.usable()) {
+    size_t len = want;
+    const char* data = map.view(offset, len);
+    if (data != nullptr) {
+      want = len;
+      return data;
+    }
+    if (len == 0) {
+      // file shrank underneath us; the server is expecting every byte
+      errno = EIO;
+      perror("ERROR");
+      exit(IOERROR);
+    }
+    // couldn't map it: read the rest into buf instead
+    want = std::min(want, buf.size());
+  }
+
+  for (;;) {
+    ssize_t bytesRead = pread(fd, buf.data(), want, offset);
+    if (bytesRead == -1 && errno == EINTR)
+      continue;
+    if (bytesRead <= 0) {
+      errno = bytesRead == 0 ? EIO : errno;
+      perror("ERROR");
+      exit(IOERROR);
+    }
+    want = bytesRead;
+    return buf.data();
+  }
+}
+
+static Task<void> storeResult(Task<bool> task, bool& ok)
+{
+  ok = co_await task;
+}
+
+// Runs task on reactor to the end, for the callers with one stream to send
+// and nothing else to do meanwhile.
+static bool complete(Reactor& reactor, Task<bool> task)
+{
+  bool ok = false;
+  reactor.spawn(storeResult(std::move(task), ok));
+  reactor.run();
+  return ok;
+}
+
+bool client::readReply(int socket, UploadReply& reply, unsigned timeoutSeconds)
+{
+  Reactor reactor;
+  FileManager io(reactor);
+  io.setTimeout(timeoutSeconds * 1000);
+  return complete(reactor, readReply(io, socket, reply));
+}
+
+Task<bool> client::readReply(FileManager& io, int socket, UploadReply& reply)
+{
+  char buf[UPLOAD_REPLY_LEN];
+  size_t got = 0;
+  while (got < sizeof(buf)) {
+    ssize_t n = co_await io.readBytesFromSocketToBuffer(socket, buf + got, sizeof(buf) - got);
+    if (n <= 0) {
+      if (n == 0)
+        std::cerr << "ERROR: server closed the connection\n";
+      else
+        perror("ERROR");
+      co_return false;
+    }
+    got += n;
+  }
+  if (!parseUploadReply(buf, reply)) {
+    std::cerr << "ERROR: garbled reply from server\n";
+    co_return false;
+  }
+  co_return true;
+}
 
-  int bytesRead; 
-  int bytesWritten;
+void client::reportProgress(bool done)
+{
+  if (!showProgress)
+    return;
+  std::lock_guard<std::mutex> guard(progressLock);
+
+  // At most one line per percent (per MB when reading from a pipe and the
+  // size is unknown), plus the final one.
+  unsigned step = fileSize > 0 ? (unsigned)(bytesSent * 100 / fileSize) : (unsigned)(bytesSent >> 20);
+  if (!done && step == lastProgress)
+    return;
+  lastProgress = step;
+
+  std::cerr << "sent " << bytesSent;
+  if (fileSize > 0)
+    std::cerr << "/" << fileSize << " bytes (" << step << "%)";
+  else
+    std::cerr << " bytes";
+  std::cerr << (done ? "\n" : "\r") << std::flush;
+}
+
+Task<bool> client::sendFileWithSendfile(FileManager& io, int socket)
+{
+  off_t offset = 0;
+
+  // only regular files have a size we can trust to stop at
+  struct stat st;
+  if (fstat(io.fd(), &st) == -1 || !S_ISREG(st.st_mode))
+    co_return false;
+
+  while ((unsigned long)offset < fileSize) {
+    size_t count = std::min((unsigned long)SENDFILE_RANGE, fileSize - offset);
+    ssize_t n = co_await io.sendFileToSocket(socket, offset, count);
+    if (n == -1) {
+      if ((errno == EINVAL || errno == ENOSYS) && offset == 0)
+        co_return false;
+      perror("ERROR");
+      exit(IOERROR);
+    }
+    if (n == 0)
+      break;  // file shrank underneath us
+    bytesSent = offset;
+    reportProgress(false);
+  }
+  co_return true;
+}
+
+Task<void> client::sendFileWithCopy(FileManager& io, int socket)
+{
+  BufferPool::configure(bufferSize, 1);
+  BufferPool::Lease buf(BufferPool::shared());
+  uint32_t crc = 0;
+  // --mmap needs a size to stop at, so not for pipes
+  MappedFile map(io.fd(), sizeKnown ? mmapWindow : 0);
+  bool mapped = map.usable();
 
   while (true) {
-    char buf[CHUNK];
-    bzero(buf, CHUNK);
-    
-    bytesRead = readBytesFromFileToBuffer(file, buf, CHUNK-1);
-    if( bytesRead == 0 ) {
+    // the header promised fileSize bytes; a file that grew since stops there
+    size_t want = mapped ? MMAP_SLICE : buf.size();
+    if (framed || mapped)
+      want = std::min((unsigned long)want, fileSize - bytesSent);
+    if (want == 0)
       break;
+
+    const char* data;
+    ssize_t bytesRead;
+    if (mapped) {
+      data = readSlice(io.fd(), map, buf, bytesSent, want);
+      bytesRead = want;
     } else {
-      bytesWritten = writeBytesFromBufferToSocket(buf, CHUNK-1, socket);
-      if( bytesWritten > 0 )
+      data = buf.data();
+      bytesRead = co_await io.readBytesFromFileToBuffer(buf.data(), want);
+      if (bytesRead == -1) {
+        perror("ERROR");
+        exit(IOERROR);
+      }
+    }
+    if( bytesRead == 0 )
+      break;
+
+    if (framed)
+      crc = crc32c(crc, data, bytesRead);
+    ssize_t bytesWritten = co_await io.writeBytesFromBufferToSocket(data, bytesRead, socket);
+    if( bytesWritten <= 0 ) {
+      std::cerr << "Error writing bytes\n";
+      exit(-1);
+    }
+    bytesSent += bytesWritten;
+    reportProgress(false);
+  }
+
+  // A file that shrank since the header gets no trailer; the server sees a
+  // short upload rather than one that checks out.
+  if (framed && bytesSent == fileSize) {
+    bool ok = co_await sendTrailer(io, socket, crc);
+    if (!ok)
+      exit(IOERROR);
+  }
+}
+
+Task<bool> client::sendPacked(FileManager& io, int socket, unsigned long offset, unsigned long length,
+                              BlockPacker& packer)
+{
+  // One block per buffer; progress counts file bytes, not wire bytes.
+  BufferPool::Lease buf(BufferPool::shared());
+  MappedFile map(io.fd(), mmapWindow);
+  std::string block;
+  uint32_t crc = 0;
+  unsigned long end = offset + length;
+
+  while (offset < end) {
+    size_t want = std::min((unsigned long)buf.size(), end - offset);
+    const char* data = readSlice(io.fd(), map, buf, offset, want);
+    size_t bytesRead = want;
+    if (checksum)
+      crc = crc32c(crc, data, bytesRead);
+    if (!packer.pack(data, bytesRead, block)) {
+      perror("ERROR");
+      exit(IOERROR);
+    }
+    if (co_await io.writeBytesFromBufferToSocket(block.data(), block.size(), socket) == -1)
+      co_return false;
+    offset += bytesRead;
+    bytesSent += bytesRead;
+    reportProgress(false);
+  }
+  co_return co_await sendTrailer(io, socket, crc);
+}
+
+Task<bool> client::sendRange(FileManager& io, int socket, unsigned long offset, unsigned long length)
+{
+  if (compressLevel > 0) {
+    BlockPacker packer(compressLevel);
+    if (!co_await sendPacked(io, socket, offset, length, packer))
+      co_return false;
+    std::lock_guard<std::mutex> guard(progressLock);
+    packer.report(std::cerr);
+    std::cerr << "\n";
+    co_return true;
+  }
+
+  unsigned long end = offset + length;
+
+  // the checksum needs the bytes in hand, which sendfile() never gives us
+  if (useSendfile && !checksum) {
+    off_t pos = offset;
+    while ((unsigned long)pos < end) {
+      size_t count = std::min((unsigned long)SENDFILE_RANGE, end - pos);
+      ssize_t n = co_await io.sendFileToSocket(socket, pos, count);
+      if (n == -1 && (errno == EINVAL || errno == ENOSYS) && (unsigned long)pos == offset)
+        break;	// fall back to copying the whole range
+      if (n <= 0) {
+        errno = n == 0 ? EIO : errno;
+        perror("ERROR");
+        co_return false;
+      }
+      bytesSent += n;
+      reportProgress(false);
+    }
+    if ((unsigned long)pos == end)
+      co_return true;
+  }
+
+  BufferPool::Lease buf(BufferPool::shared());
+  MappedFile map(io.fd(), mmapWindow);
+  uint32_t crc = 0;
+  while (offset < end) {
+    size_t want = std::min((unsigned long)(map.usable() ? MMAP_SLICE : buf.size()), end - offset);
+    const char* data = readSlice(io.fd(), map, buf, offset, want);
+    size_t bytesRead = want;
+    if (checksum)
+      crc = crc32c(crc, data, bytesRead);
+    if (co_await io.writeBytesFromBufferToSocket(data, bytesRead, socket) == -1)
+      co_return false;
+    offset += bytesRead;
+    bytesSent += bytesRead;
+    reportProgress(false);
+  }
+  co_return co_await sendTrailer(io, socket, crc);
+}
+
+Task<void> client::sendStream(Reactor& reactor, int fd, int socket, unsigned long offset,
+                              unsigned long length)
+{
+  // The ranges are read at their offsets, never at the file position, so
+  // they all share the one file.
+  FileManager io(reactor, fd);
+  UploadReply reply;
+  if (compressLevel > 0) {
+    io.setTimeout(TIMEOUT * 1000);
+    bool ok = co_await readReply(io, socket, reply);
+    if (!ok || reply.status != REPLY_RESUME) {
+      std::cerr << "ERROR: server won't take compressed ranges, try without --compress\n";
+      exit(IOERROR);
+    }
+    io.setTimeout(0);
+  }
+  bool ok = co_await sendRange(io, socket, offset, length);
+  if (!ok)
+    exit(IOERROR);
+  // Closed as soon as it is sent: the server may be holding the other
+  // streams back until this one ends.
+  reactor.forget(socket);
+  close(socket);
+}
+
+void client::sendFileInRanges(FILE* file)
+{
+  // Fewer, bigger ranges for small files; the last range takes the remainder.
+  unsigned long count = std::min((unsigned long)streams, (fileSize + STREAM_ALIGN - 1) / STREAM_ALIGN);
+  unsigned long rangeSize = (fileSize / count + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+  count = (fileSize + rangeSize - 1) / rangeSize;
+
+  UploadHeader header;
+  header.flags = UPLOAD_FLAG_RANGE;
+  header.fileSize = fileSize;
+  header.name = baseName();
+  header.streams = count;
+  std::random_device random;
+  header.transferId = (uint64_t)random() << 32 | random();
+  addFlags(header);
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(struct addrinfo));
+  setupHints(hints);
+  struct addrinfo* results = getAddrInfo(hints);
+  BufferPool::configure(bufferSize, count);
+
+  // One coroutine per stream, all on this thread; each is off as soon as
+  // its header is out, so the server starts on them all at once.
+  Reactor reactor;
+  for (unsigned long i = 0; i < count; i++) {
+    UploadHeader range = header;
+    range.rangeOffset = i * rangeSize;
+    range.rangeLength = std::min(rangeSize, fileSize - range.rangeOffset);
+    int socket = createSocketAndConnect(results);
+    std::string encoded = encodeUploadHeader(range);
+    if (writeBytesFromBufferToSocket(&encoded[0], encoded.size(), socket) == -1)
+      exit(IOERROR);
+    if (fcntl(socket, F_SETFL, fcntl(socket, F_GETFL) | O_NONBLOCK) == -1) {
+      perror("ERROR");
+      exit(IOERROR);
+    }
+    reactor.spawn(sendStream(reactor, fileno(file), socket, range.rangeOffset, range.rangeLength));
+  }
+  freeaddrinfo(results);
+  reactor.run();
+  reportProgress(true);
+}
+
+uint64_t client::resumeId(FILE* file)
+{
+  // The same file, unchanged, gets the same ID on every run, so simply
+  // running the client again picks up an interrupted upload.
+  struct stat st;
+  char path[PATH_MAX];
+  if (fstat(fileno(file), &st) == -1 || realpath(filename.c_str(), path) == nullptr) {
+    perror("ERROR");
+    exit(IOERROR);
+  }
+  std::ostringstream key;
+  key << path << '\0' << st.st_size << '\0' << st.st_mtim.tv_sec << '.' << st.st_mtim.tv_nsec;
+
+  uint64_t hash = 14695981039346656037ULL;	// FNV-1a
+  for (char ch : key.str()) {
+    hash ^= (unsigned char)ch;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+void client::sendResumable(FILE* file)
+{
+  UploadHeader header;
+  header.flags = UPLOAD_FLAG_RESUMABLE;
+  header.fileSize = fileSize;
+  header.name = baseName();
+  header.transferId = resumeId(file);
+  addFlags(header);
+  std::string encoded = encodeUploadHeader(header);
+  BufferPool::configure(bufferSize, 1);
+
+  for (unsigned attempt = 0; ; attempt++) {
+    if (attempt > 0) {
+      if (attempt > retries) {
+        std::cerr << "ERROR: giving up after " << attempt << " attempts\n";
+        exit(IOERROR);
+      }
+      backOff(attempt - 1);
+      close(sockfd);
+    }
+    initializeNetworkSettings();
+
+    UploadReply reply;
+    if (writeBytesFromBufferToSocket(&encoded[0], encoded.size(), sockfd) == -1
+        || !readReply(sockfd, reply, TIMEOUT))
+      continue;
+    if (reply.status == REPLY_BUSY)
+      continue;		// the server hasn't noticed our last connection died yet
+    if (reply.status == REPLY_REFUSED && compressLevel > 0) {
+      // maybe just the compression; ask again for a plain upload
+      std::cerr << "server declined compression, sending uncompressed\n";
+      compressLevel = 0;
+      header.flags &= ~UPLOAD_FLAG_COMPRESSED;
+      encoded = encodeUploadHeader(header);
+      continue;
+    }
+    if (reply.status != REPLY_RESUME || reply.offset > fileSize) {
+      std::cerr << "ERROR: server refused the upload\n";
+      exit(IOERROR);
+    }
+
+    if (reply.offset > 0)
+      std::cerr << "resuming at " << reply.offset << " of " << fileSize << " bytes\n";
+    bytesSent = reply.offset;
+    // a new one every attempt: the last socket's number may come back
+    Reactor reactor;
+    FileManager io(reactor, fileno(file));
+    if (!complete(reactor, sendRange(io, sockfd, reply.offset, fileSize - reply.offset)))
+      continue;
+
+    // It only counts once the server says the whole file is on disk.
+    shutdown(sockfd, SHUT_WR);
+    if (readReply(sockfd, reply, TIMEOUT * 10) && reply.status == REPLY_DONE
+        && reply.offset == fileSize)
+      break;
+  }
+  reportProgress(true);
+}
+
+static bool writeAllVectors(int socket, struct iovec* iov, int count)
+{
+  while (count > 0) {
+    ssize_t n = writev(socket, iov, count);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n == -1)
+      return false;
+    // step past what went out, which may end part way into a vector
+    for (; count > 0 && (size_t)n >= iov->iov_len; count--, iov++)
+      n -= iov->iov_len;
+    if (count > 0) {
+      iov->iov_base = (char*)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return true;
+}
+
+bool client::sendSessionFile(Reactor& reactor, int socket, int fd, unsigned long size, BlockPacker& packer)
+{
+  UploadHeader header;
+  header.flags = UPLOAD_FLAG_SESSION;
+  header.fileSize = size;
+  header.name = baseName();
+  addFlags(header);
+  std::string encoded = encodeUploadHeader(header);
+
+  if (compressLevel == 0 && size <= bufferSize) {
+    // The common case, a small file: header, body and trailer leave in a
+    // single writev(). Not worth mapping even with --mmap; one pread() is
+    // cheaper than mmap() and munmap().
+    BufferPool::Lease buf(BufferPool::shared());
+    size_t got = 0;
+    while (got < size) {
+      ssize_t n = pread(fd, buf.data() + got, size - got, got);
+      if (n == -1 && errno == EINTR)
         continue;
-      else {
-        std::cerr << "Error writing bytes\n";
-        exit(-1);
+      if (n <= 0) {
+        errno = n == 0 ? EIO : errno;
+        return false;
       }
+      got += n;
     }
+    std::string trailer = checksum ? encodeUploadTrailer(crc32c(0, buf.data(), size)) : "";
+
+    struct iovec iov[3];
+    iov[0].iov_base = &encoded[0];
+    iov[0].iov_len = encoded.size();
+    iov[1].iov_base = buf.data();
+    iov[1].iov_len = size;
+    iov[2].iov_base = &trailer[0];
+    iov[2].iov_len = trailer.size();
+    if (!writeAllVectors(socket, iov, 3))
+      return false;
+    bytesSent += size;
+    return true;
   }
+
+  if (writeBytesFromBufferToSocket(&encoded[0], encoded.size(), socket) == -1)
+    return false;
+  FileManager io(reactor, fd);
+  if (compressLevel > 0)
+    return complete(reactor, sendPacked(io, socket, 0, size, packer));
+  return complete(reactor, sendRange(io, socket, 0, size));
+}
+
+void client::sendSession()
+{
+  // Every file goes out back to back on one connection; the server acks
+  // each as it lands and a second thread collects those while we send.
+  std::vector<std::string> sent(filenames.size());
+  std::atomic<size_t> sentCount(0);
+  std::atomic<bool> sending(true);	// sentCount is final once this drops
+  size_t acked = 0, refused = 0;	// the reader's
+  size_t skipped = 0;
+  BufferPool::configure(bufferSize, 1);
+  BlockPacker packer(compressLevel);
+  auto started = std::chrono::steady_clock::now();
+  initializeNetworkSettings();
+  Reactor reactor;
+
+  std::thread ackReader([this, &sent, &sentCount, &sending, &acked, &refused]() {
+    char buf[UPLOAD_REPLY_LEN * 256];
+    size_t have = 0;
+    while (sending || acked < sentCount) {
+      if (acked == sentCount) {
+        // caught up; don't sit in recv past the last file
+        struct pollfd pfd = { sockfd, POLLIN, 0 };
+        if (poll(&pfd, 1, 50) == 0)
+          continue;
+      }
+      ssize_t n = recv(sockfd, buf + have, sizeof(buf) - have, 0);
+      if (n == -1 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      have += n;
+      size_t used = 0;
+      for (; have - used >= UPLOAD_REPLY_LEN; used += UPLOAD_REPLY_LEN) {
+        UploadReply reply;
+        if (!parseUploadReply(buf + used, reply) || acked >= sentCount) {
+          std::cerr << "ERROR: garbled reply from server\n";
+          return;
+        }
+        if (reply.status != REPLY_DONE) {
+          std::cerr << "ERROR: server refused " << sent[acked] << "\n";
+          refused++;
+        }
+        acked++;
+      }
+      memmove(buf, buf + used, have - used);
+      have -= used;
+    }
+  });
+
+  for (const std::string& name : filenames) {
+    filename = name;
+    int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    const char* problem = nullptr;
+    if (fd == -1 || fstat(fd, &st) == -1)
+      problem = strerror(errno);
+    else if (!S_ISREG(st.st_mode))
+      problem = "not a regular file";
+    if (problem != nullptr) {
+      // nothing went out for it, so no ack to wait for
+      std::cerr << "ERROR: skipping " << name << ": " << problem << "\n";
+      if (fd != -1)
+        close(fd);
+      skipped++;
+      continue;
+    }
+    sent[sentCount] = name;
+    sentCount++;
+    bool ok = sendSessionFile(reactor, sockfd, fd, st.st_size, packer);
+    close(fd);
+    if (!ok) {
+      perror("ERROR");
+      break;
+    }
+    reportProgress(false);
+  }
+  sending = false;
+  shutdown(sockfd, SHUT_WR);
+  ackReader.join();
+  reportProgress(true);
+
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  std::cerr << "session: " << acked << " of " << sentCount << " files acked, " << bytesSent
+            << " bytes in " << seconds << " s";
+  if (acked > 0)
+    std::cerr << ", " << seconds * 1e6 / acked << " us per file";
+  std::cerr << "\n";
+  if (compressLevel > 0) {
+    packer.report(std::cerr);
+    std::cerr << "\n";
+  }
+  if (acked < sentCount || refused + skipped > 0)
+    exit(IOERROR);
+}
+
+void client::sendFileOverNetworkSocket(int socket, FILE* file)
+{
+  if (!sendHeader(socket)) {
+    // an older server hangs up on a flag it doesn't know; start over plain
+    std::cerr << "server declined compression, sending uncompressed\n";
+    compressLevel = 0;
+    close(sockfd);
+    initializeNetworkSettings();
+    socket = getSockFd();
+    sendHeader(socket);
+  }
+
+  Reactor reactor;
+  FileManager io(reactor, fileno(file));
+  if (framed && compressLevel > 0) {
+    BufferPool::configure(bufferSize, 1);
+    if (!complete(reactor, sendRange(io, socket, 0, fileSize)))
+      exit(IOERROR);
+  } else if (!useSendfile || (framed && checksum) || !complete(reactor, sendFileWithSendfile(io, socket))) {
+    // sendfile() refuses some file types (pipes, some FUSE mounts); those go
+    // through the buffered loop instead.
+    reactor.spawn(sendFileWithCopy(io, socket));
+    reactor.run();
+  }
+
+  reportProgress(true);
 }
 
 void client::run()
 {
+  // a server that refuses the upload resets the connection; report that
+  // as a write error rather than dying on SIGPIPE
+  ::signal(SIGPIPE, SIG_IGN);
+  if (filenames.size() > 1) {
+    sendSession();
+    return;
+  }
+  FILE* file = openFile();
+
+  if (resumable) {
+    if (!sizeKnown) {
+      std::cerr << "ERROR: --resume needs a regular file\n";
+      exit(ARG_ERROR);
+    }
+    sendResumable(file);
+    return;
+  }
+
+  // Ranges need the header and a size to split; anything else goes as one stream.
+  if (streams > 1 && !rawStream && sizeKnown && fileSize > 0) {
+    sendFileInRanges(file);
+    return;
+  }
+
   initializeNetworkSettings();
-  sendFileOverNetworkSocket(getSockFd());
+  sendFileOverNetworkSocket(getSockFd(), file);
 }
 
+#ifndef BENCH
 int
 main(int argc, char* argv[])
 {
 
-  client c = client(argc, argv);
+  client c(argc, argv);
 
   c.run();
 
   exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -3,6 +3,20 @@
 #ifndef _client
 #define _client
 
+#include <atomic>
+#include <mutex>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "BufferPool.h"
+#include "Compression.h"
+#include "FileManager.h"
+#include "MappedFile.h"
+#include "Protocol.h"
+#include "Reactor.h"
+#include "Task.h"
+
 class client
 {
 private:
@@ -10,26 +24,68 @@ private:
 	std::string port;
 	std::string filename;
 	FILE* fstream;
+	bool useSendfile;
+	bool showProgress;
+	unsigned long fileSize;
+	std::atomic<unsigned long> bytesSent;	// summed over every stream
+	unsigned lastProgress;
+	size_t bufferSize;
+	bool sizeKnown;		// regular file, so fileSize is what we'll send
+	bool rawStream;		// --raw: skip the upload header
+	bool framed;
+	unsigned streams;		// --streams: parallel connections for one file
+	bool resumable;		// --resume
+	unsigned retries;
+	int compressLevel;		// --compress: zlib level, 0 when off or declined
+	bool checksum;		// --checksum: CRC-32C trailer after the body
+	size_t mmapWindow;		// --mmap: bytes mapped at a time, 0 to read() instead
+	std::vector<std::string> filenames;	// more than one: a session
+	std::string filesFrom;	// --files-from: list file, "-" for stdin
+	std::mutex progressLock;
 
 protected:
 	int sockfd;
 	int status;
 
+	// for programs that make the connection and send on their own (bench)
+	client(const std::string& hostname, const std::string& port);
+
+	int parseOptions(int argc, char* argv[]);
 	std::string getArg(const char* arg);
 	std::string checkPortNo(std::string arg);
 
 	void setupHints(struct addrinfo& hints);
 	struct addrinfo* getAddrInfo(struct addrinfo& hints);
-	ushort sleepForOneSecond();
-	bool timedOut(ushort secondsAsleep);
+	unsigned backOff(unsigned attempt);
+	bool timedOut(unsigned millisAsleep);
 	int createSocketAndConnect(struct addrinfo* results);
 	void initializeNetworkSettings();
 
 	int getSockFd();
-	int readBytesFromFileToBuffer(FILE* file, char* buf, unsigned long nbyte);
 	int writeBytesFromBufferToSocket(char* buf, unsigned long nbyte, int socket);
+	const char* readSlice(int fd, MappedFile& map, BufferPool::Lease& buf, unsigned long offset, size_t& want);
 	FILE* openFile();
-	void sendFileOverNetworkSocket(int socket);
+	std::string baseName();
+	void addFlags(UploadHeader& header);
+	Task<bool> sendTrailer(FileManager& io, int socket, uint32_t crc);
+	bool sendHeader(int socket);
+	void reportProgress(bool done);
+	Task<bool> sendFileWithSendfile(FileManager& io, int socket);
+	Task<void> sendFileWithCopy(FileManager& io, int socket);
+	bool readReply(int socket, UploadReply& reply, unsigned timeoutSeconds);
+	Task<bool> readReply(FileManager& io, int socket, UploadReply& reply);
+	// The body of an upload, from the file's offset on, over socket.
+	Task<bool> sendPacked(FileManager& io, int socket, unsigned long offset, unsigned long length,
+	                      BlockPacker& packer);
+	Task<bool> sendRange(FileManager& io, int socket, unsigned long offset, unsigned long length);
+	Task<void> sendStream(Reactor& reactor, int fd, int socket, unsigned long offset, unsigned long length);
+	void sendFileInRanges(FILE* file);
+	uint64_t resumeId(FILE* file);
+	void sendResumable(FILE* file);
+	void readFileList();
+	bool sendSessionFile(Reactor& reactor, int socket, int fd, unsigned long size, BlockPacker& packer);
+	void sendSession();
+	void sendFileOverNetworkSocket(int socket, FILE* file);
 
 public:
 	client();			// done
@@ -0,0 +1,390 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "BufferPool.h"
+#include "FileManager.h"
+
+// Microbenchmarks for the ways the server has written files and could read
+// them back: File (fstream), DirectFile, stdio, write/pwrite and mmap. Each
+// run moves the same number of bytes in ops of one buffer size, with or
+// without an fsync before the file is closed, and prints one CSV line, so
+// buffer sizes and backends can be picked from numbers:
+//
+//   op,method,buffer_bytes,fsync,total_bytes,seconds,mb_per_s,ns_per_op
+//
+// Every write run starts from a missing file. Reads go over a file written
+// once up front and come from the page cache unless --cold drops it first.
+
+typedef bool (*Writer)(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync);
+typedef bool (*Reader)(const std::string& path, char* buf, size_t len, uint64_t total);
+
+static bool syncPath(const std::string& path)
+{
+  // for the interfaces that don't expose their descriptor
+  int fd = open(path.c_str(), O_WRONLY);
+  bool ok = fd != -1 && fsync(fd) == 0;
+  if (fd != -1)
+    close(fd);
+  return ok;
+}
+
+static bool writeFstream(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync)
+{
+  File f(path, WRITE_ONLY);
+  f.open();
+  for (uint64_t done = 0; done < total && f.ok(); done += len)
+    f.write(buf, len < total - done ? len : total - done);
+  bool ok = f.ok();
+  f.close();
+  return ok && (!sync || syncPath(path));
+}
+
+static bool writeDirect(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync)
+{
+  DirectFile f(path, WRITE_ONLY);
+  for (uint64_t done = 0; done < total && f.ok(); done += len)
+    f.write(buf, len < total - done ? len : total - done);
+  f.close();
+  return f.ok() && (!sync || syncPath(path));
+}
+
+static bool writeStdio(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync)
+{
+  FILE* file = fopen(path.c_str(), "w");
+  if (file == nullptr)
+    return false;
+  bool ok = true;
+  for (uint64_t done = 0; done < total && ok; done += len) {
+    size_t n = len < total - done ? len : total - done;
+    ok = fwrite(buf, 1, n, file) == n;
+  }
+  ok = ok && fflush(file) == 0 && (!sync || fsync(fileno(file)) == 0);
+  return fclose(file) == 0 && ok;
+}
+
+static bool writeAllAt(int fd, const char* buf, size_t n, off_t offset, bool positioned)
+{
+  while (n > 0) {
+    ssize_t w = positioned ? pwrite(fd, buf, n, offset) : write(fd, buf, n);
+    if (w == -1 && errno == EINTR)
+      continue;
+    if (w <= 0)
+      return false;
+    buf += w;
+    n -= w;
+    offset += w;
+  }
+  return true;
+}
+
+static bool writeSyscall(const std::string& path, const char* buf, size_t len, uint64_t total,
+                         bool sync, bool positioned)
+{
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    return false;
+  bool ok = true;
+  for (uint64_t done = 0; done < total && ok; done += len)
+    ok = writeAllAt(fd, buf, len < total - done ? len : total - done, done, positioned);
+  ok = ok && (!sync || fsync(fd) == 0);
+  return close(fd) == 0 && ok;
+}
+
+static bool writeWrite(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync)
+{
+  return writeSyscall(path, buf, len, total, sync, false);
+}
+
+static bool writePwrite(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync)
+{
+  return writeSyscall(path, buf, len, total, sync, true);
+}
+
+static bool writeMmap(const std::string& path, const char* buf, size_t len, uint64_t total, bool sync)
+{
+  int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1)
+    return false;
+  if (ftruncate(fd, total) == -1) {
+    close(fd);
+    return false;
+  }
+  void* map = mmap(nullptr, total, PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    close(fd);
+    return false;
+  }
+  for (uint64_t done = 0; done < total; done += len)
+    memcpy((char*)map + done, buf, len < total - done ? len : total - done);
+  bool ok = !sync || msync(map, total, MS_SYNC) == 0;
+  munmap(map, total);
+  return close(fd) == 0 && ok;
+}
+
+static bool readFstream(const std::string& path, char* buf, size_t len, uint64_t total)
+{
+  File f(path, READ_ONLY);
+  f.open();
+  for (uint64_t done = 0; done < total && f.ok(); done += len)
+    f.read(buf, len < total - done ? len : total - done);
+  bool ok = f.ok();
+  f.close();
+  return ok;
+}
+
+static bool readDirect(const std::string& path, char* buf, size_t len, uint64_t total)
+{
+  DirectFile f(path, READ_ONLY);
+  for (uint64_t done = 0; done < total && f.ok(); done += len)
+    f.read(buf, len < total - done ? len : total - done);
+  f.close();
+  return f.ok();
+}
+
+static bool readStdio(const std::string& path, char* buf, size_t len, uint64_t total)
+{
+  FILE* file = fopen(path.c_str(), "r");
+  if (file == nullptr)
+    return false;
+  bool ok = true;
+  for (uint64_t done = 0; done < total && ok; done += len) {
+    size_t n = len < total - done ? len : total - done;
+    ok = fread(buf, 1, n, file) == n;
+  }
+  fclose(file);
+  return ok;
+}
+
+static bool readSyscall(const std::string& path, char* buf, size_t len, uint64_t total, bool positioned)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  bool ok = true;
+  for (uint64_t done = 0; done < total && ok;) {
+    size_t n = len < total - done ? len : total - done;
+    ssize_t r = positioned ? pread(fd, buf, n, done) : read(fd, buf, n);
+    if (r == -1 && errno == EINTR)
+      continue;
+    ok = r > 0;
+    done += r;
+  }
+  close(fd);
+  return ok;
+}
+
+static bool readRead(const std::string& path, char* buf, size_t len, uint64_t total)
+{
+  return readSyscall(path, buf, len, total, false);
+}
+
+static bool readPread(const std::string& path, char* buf, size_t len, uint64_t total)
+{
+  return readSyscall(path, buf, len, total, true);
+}
+
+static bool readMmap(const std::string& path, char* buf, size_t len, uint64_t total)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return false;
+  void* map = mmap(nullptr, total, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  madvise(map, total, MADV_SEQUENTIAL);
+  for (uint64_t done = 0; done < total; done += len)
+    memcpy(buf, (char*)map + done, len < total - done ? len : total - done);
+  munmap(map, total);
+  return true;
+}
+
+static const struct {
+	const char* _name;
+	Writer _write;
+	const char* _readName;
+	Reader _read;
+} methods[] = {
+	{ "fstream", writeFstream, "fstream", readFstream },
+	{ "direct", writeDirect, "direct", readDirect },
+	{ "stdio", writeStdio, "stdio", readStdio },
+	{ "write", writeWrite, "read", readRead },
+	{ "pwrite", writePwrite, "pread", readPread },
+	{ "mmap", writeMmap, "mmap", readMmap },
+};
+
+static void usage()
+{
+  std::cerr << "Usage: ./fmbench [OPTIONS]\n";
+  std::cerr << "  Times writing and reading a file each way, over a range of buffer sizes;\n";
+  std::cerr << "  one CSV line per run on stdout.\n";
+  std::cerr << "Options:\n";
+  std::cerr << "  -d, --dir=DIR           where the scratch file goes (default .)\n";
+  std::cerr << "  -s, --size=BYTES        bytes per run, k/m/g suffixes ok (default 64m)\n";
+  std::cerr << "  -b, --buffers=MIN-MAX   buffer sizes, doubling from MIN (default 512-4m)\n";
+  std::cerr << "  -m, --method=NAME       only this one: fstream, direct, stdio, write (read),\n";
+  std::cerr << "                          pwrite (pread) or mmap; may be given more than once\n";
+  std::cerr << "  -r, --repeat=N          report the fastest of N runs (default 1)\n";
+  std::cerr << "  -c, --cold              drop the file from the page cache before each read\n";
+}
+
+// The fastest of repeat runs; before isn't timed.
+static double timeRun(unsigned repeat, const std::function<void()>& before,
+                      const std::function<bool()>& run)
+{
+  double best = 0;
+  for (unsigned i = 0; i < repeat; i++) {
+    before();
+    auto started = std::chrono::steady_clock::now();
+    if (!run()) {
+      perror("ERROR");
+      exit(EXIT_FAILURE);
+    }
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - started;
+    if (i == 0 || took.count() < best)
+      best = took.count();
+  }
+  return best;
+}
+
+static void dropCache(const std::string& path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1)
+    return;
+  fdatasync(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  close(fd);
+}
+
+static void report(const char* op, const char* method, size_t len, const char* sync, uint64_t total,
+                   double seconds)
+{
+  uint64_t ops = (total + len - 1) / len;
+  std::cout << op << "," << method << "," << len << "," << sync << "," << total << ","
+            << std::fixed << std::setprecision(6) << seconds << ","
+            << std::setprecision(1) << total / seconds / (1 << 20) << "," << seconds * 1e9 / ops
+            << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+  static struct option longopts[] = {
+    { "dir", required_argument, nullptr, 'd' },
+    { "size", required_argument, nullptr, 's' },
+    { "buffers", required_argument, nullptr, 'b' },
+    { "method", required_argument, nullptr, 'm' },
+    { "repeat", required_argument, nullptr, 'r' },
+    { "cold", no_argument, nullptr, 'c' },
+    { nullptr, 0, nullptr, 0 }
+  };
+
+  std::string dir = ".";
+  uint64_t total = 64 << 20;
+  size_t minBuffer = 512;
+  size_t maxBuffer = 4 << 20;
+  std::vector<std::string> only;
+  unsigned repeat = 1;
+  bool cold = false;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "d:s:b:m:r:c", longopts, nullptr)) != -1) {
+    switch (opt) {
+      case 'd':
+        dir = optarg;
+        break;
+      case 's':
+        total = parseSize(optarg);
+        if (total == 0) {
+          std::cerr << "ERROR: invalid size \"" << optarg << "\"" << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'b': {
+        const char* dash = strchr(optarg, '-');
+        minBuffer = dash != nullptr ? parseSize(std::string(optarg, dash - optarg).c_str()) : 0;
+        maxBuffer = dash != nullptr ? parseSize(dash + 1) : 0;
+        if (minBuffer == 0 || maxBuffer < minBuffer) {
+          std::cerr << "ERROR: invalid buffer range \"" << optarg << "\"" << std::endl;
+          exit(EXIT_FAILURE);
+        }
+        break;
+      }
+      case 'm':
+        only.push_back(optarg);
+        break;
+      case 'r':
+        repeat = atoi(optarg);
+        if (repeat == 0)
+          repeat = 1;
+        break;
+      case 'c':
+        cold = true;
+        break;
+      default:
+        usage();
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  // one buffer of the largest size, aligned the way the pool's are
+  char* buf;
+  if (posix_memalign((void**)&buf, DIRECT_BLOCK, maxBuffer) != 0) {
+    perror("ERROR");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < maxBuffer; i++)
+    buf[i] = (char)(i * 131 + (i >> 12));
+
+  std::string path = dir + "/fmbench.tmp";
+  std::string readPath = dir + "/fmbench-read.tmp";
+  unlink(readPath.c_str());
+  if (!writeWrite(readPath, buf, maxBuffer, total, true)) {
+    perror("ERROR");
+    exit(EXIT_FAILURE);
+  }
+
+  std::cout << "op,method,buffer_bytes,fsync,total_bytes,seconds,mb_per_s,ns_per_op" << std::endl;
+  for (auto& method : methods) {
+    bool wanted = only.empty();
+    for (const std::string& name : only)
+      wanted = wanted || name == method._name || name == method._readName;
+    if (!wanted)
+      continue;
+
+    for (size_t len = minBuffer; len <= maxBuffer; len *= 2) {
+      for (bool sync : { false, true }) {
+        double seconds = timeRun(repeat, [&]() { unlink(path.c_str()); }, [&]() {
+          return method._write(path, buf, len, total, sync);
+        });
+        report("write", method._name, len, sync ? "yes" : "no", total, seconds);
+      }
+      double seconds = timeRun(repeat, [&]() {
+        if (cold)
+          dropCache(readPath);
+      }, [&]() {
+        return method._read(readPath, buf, len, total);
+      });
+      report("read", method._readName, len, "-", total, seconds);
+    }
+  }
+
+  unlink(path.c_str());
+  unlink(readPath.c_str());
+  free(buf);
+  return 0;
+}
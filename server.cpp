@@ -1,7 +1,10 @@
 #include <arpa/inet.h>
 #include <csignal>
+#include <ctype.h>
 #include <errno.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <sstream>
 #include <stdio.h>
@@ -9,13 +12,28 @@
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <pthread.h>
 #include <unistd.h>
 
+#include <getopt.h>
+#include <poll.h>
+
+#include <chrono>
+#include <functional>
 #include <thread>
-#include <mutex>
+#include <vector>
 
 #include <iostream>
 #include "server.h"
+#include "Admission.h"
+#include "CoroLoop.h"
+#include "DiskWriter.h"
+#include "EventLoop.h"
+#include "FileManager.h"
+#include "Metrics.h"
+#include "TransferRegistry.h"
+#include "UringLoop.h"
 
 #ifndef OK
 #define OK 0
@@ -25,25 +43,52 @@
 #define ARG_ERROR 1
 #endif
 
-#ifndef TIMEOUT
-#define TIMEOUT 15
-#endif
+const size_t MIN_BUFFER_SIZE = 4 << 10;
+const size_t MAX_BUFFER_SIZE = 16 << 20;
 
-const unsigned short CHUNK = 1024;
+// A duration in seconds, or with an ms/s/m suffix; false if it isn't one
+// or doesn't fit.
+static bool parseMillis(const char* arg, unsigned& millis)
+{
+	// strtoull would take "-5" and wrap it
+	if (!isdigit((unsigned char)*arg))
+		return false;
+	char* end;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &end, 10);
+	if (errno == ERANGE)
+		return false;
+	unsigned long long unit;
+	if (strcmp(end, "ms") == 0)
+		unit = 1;
+	else if (*end == '\0' || strcmp(end, "s") == 0)
+		unit = 1000;
+	else if (strcmp(end, "m") == 0)
+		unit = 60 * 1000;
+	else
+		return false;
+	if (n > UINT_MAX / unit)
+		return false;
+	millis = n * unit;
+	return true;
+}
 
-server::server() : filedir(nullptr), port(nullptr), listen_fd(0) {}
+server::server() : filedir(nullptr), port(nullptr), listen_fd(0), pool(nullptr) {}
 
-server::server(int argc, char* argv[]) : listen_fd(0)
+server::server(int argc, char* argv[])
+: listen_fd(0), pool(nullptr)
 {
-	// This Program excepts 2 and only two arguments
-	if (argc != 3) {
+	int first = parseOptions(argc, argv);
+
+	// After the options we expect 2 and only two arguments
+	if (argc - first != 2) {
 		std::cerr << "ERROR: Incorrect number of arguments." << std::endl;
 		usage();
 		exit(ARG_ERROR);
 	}
 
 	// Get our port number
-	port = getArg(argv[1]);
+	port = getArg(argv[first]);
 	port = checkPortNo(port);
 	if ( port.empty() ) {
 		std::cerr << "ERROR: invalid port number" << std::endl;
@@ -51,11 +96,14 @@ server::server(int argc, char* argv[]) : listen_fd(0)
 	}
 
 	// and the directory to safe files.
-	filedir = getArg(argv[2]);
+	filedir = getArg(argv[first+1]);
 	if ( filedir.empty() ) {
 		std::cerr << "ERROR: Unable to get FILE-DIR" << std::endl;
 		exit(ARG_ERROR);
 	}
+	// the uploads, resume state and chunks all go inside it
+	if (filedir.back() != '/')
+		filedir += '/';
 
 	::signal(SIGTERM, server::sigHandler);
   ::signal(SIGQUIT, server::sigHandler);
@@ -82,6 +130,166 @@ void server::sigHandler(int signum)
   }
 }
 
+int server::parseOptions(int argc, char* argv[])
+{
+	static struct option longopts[] = {
+		{ "backend",        required_argument, nullptr, 'b' },
+		{ "workers",        required_argument, nullptr, 'w' },
+		{ "queue-depth",    required_argument, nullptr, 'q' },
+		{ "stats-interval", required_argument, nullptr, 's' },
+		{ "idle-timeout",   required_argument, nullptr, 'i' },
+		{ "transfer-timeout", required_argument, nullptr, 't' },
+		{ "splice",         no_argument,       nullptr, 'z' },
+		{ "buffer-size",    required_argument, nullptr, 'B' },
+		{ "buffer-cache",   required_argument, nullptr, 'C' },
+		{ "max-file-size",  required_argument, nullptr, 'm' },
+		{ "dedup",          no_argument,       nullptr, 'd' },
+		{ "chunk-size",     required_argument, nullptr, 'c' },
+		{ "disk-threads",   required_argument, nullptr, 'W' },
+		{ "no-fsync",       no_argument,       nullptr, 'F' },
+		{ "direct-io",      no_argument,       nullptr, 'D' },
+		{ "stats-socket",   required_argument, nullptr, 'S' },
+		{ "reuse-port",     no_argument,       nullptr, 'r' },
+		{ "backlog",        required_argument, nullptr, 'l' },
+		{ "defer-accept",   required_argument, nullptr, 'A' },
+		{ "max-connections", required_argument, nullptr, 'N' },
+		{ "when-full",      required_argument, nullptr, 'Q' },
+		{ "client-rate",    required_argument, nullptr, 'R' },
+		{ "total-rate",     required_argument, nullptr, 'G' },
+		{ "rate-burst",     required_argument, nullptr, 'U' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "b:w:q:s:i:t:zB:C:m:dc:W:FDS:rl:A:N:Q:R:G:U:", longopts, nullptr)) != -1) {
+		switch (opt) {
+			case 'b':
+				config.backend = optarg;
+				if (config.backend != "epoll" && config.backend != "pool" && config.backend != "uring" &&
+				    config.backend != "coro") {
+					std::cerr << "ERROR: unknown backend \"" << config.backend << "\"" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'w':
+				config.workers = atoi(optarg);
+				if (config.workers == 0) {
+					std::cerr << "ERROR: need at least one worker" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'q':
+				config.queueDepth = atoi(optarg);
+				if (config.queueDepth == 0) {
+					std::cerr << "ERROR: queue depth must be positive" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 's':
+				config.statsInterval = atoi(optarg);
+				break;
+			case 'i':
+				if (!parseMillis(optarg, config.idleTimeoutMs) || config.idleTimeoutMs == 0) {
+					std::cerr << "ERROR: bad idle timeout \"" << optarg << "\", must be positive" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 't':
+				if (!parseMillis(optarg, config.transferTimeoutMs)) {
+					std::cerr << "ERROR: bad transfer timeout \"" << optarg << "\"" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'z':
+				config.splice = true;
+				break;
+			case 'B':
+				config.bufferSize = parseSize(optarg);
+				if (config.bufferSize < MIN_BUFFER_SIZE || config.bufferSize > MAX_BUFFER_SIZE) {
+					std::cerr << "ERROR: buffer size must be between 4k and 16m" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'C':
+				config.bufferCacheBytes = parseSize(optarg);
+				break;
+			case 'm':
+				config.maxFileSize = parseSize(optarg);
+				if (config.maxFileSize == 0) {
+					std::cerr << "ERROR: invalid file size limit \"" << optarg << "\"" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'd':
+				config.dedup = true;
+				break;
+			case 'c':
+				config.chunkSize = parseSize(optarg);
+				if (config.chunkSize < (1 << 10) || config.chunkSize > (4 << 20)) {
+					std::cerr << "ERROR: chunk size must be between 1k and 4m" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'W':
+				config.diskThreads = atoi(optarg);
+				break;
+			case 'F':
+				config.fsync = false;
+				break;
+			case 'D':
+				config.directIo = true;
+				break;
+			case 'S':
+				config.statsSocket = optarg;
+				break;
+			case 'r':
+				config.reusePort = true;
+				break;
+			case 'l':
+				config.backlog = atoi(optarg);
+				if (config.backlog == 0) {
+					std::cerr << "ERROR: backlog must be positive" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			case 'A':
+				config.deferAcceptSecs = atoi(optarg);
+				break;
+			case 'N':
+				config.maxConnections = atoi(optarg);
+				break;
+			case 'Q':
+				if (strcmp(optarg, "queue") != 0 && strcmp(optarg, "refuse") != 0) {
+					std::cerr << "ERROR: --when-full takes queue or refuse" << std::endl;
+					exit(ARG_ERROR);
+				}
+				config.refuseWhenFull = strcmp(optarg, "refuse") == 0;
+				break;
+			case 'R':
+				config.clientRate = parseSize(optarg);
+				break;
+			case 'G':
+				config.totalRate = parseSize(optarg);
+				break;
+			case 'U':
+				config.rateBurst = parseSize(optarg);
+				if (config.rateBurst == 0) {
+					std::cerr << "ERROR: rate burst must be positive" << std::endl;
+					exit(ARG_ERROR);
+				}
+				break;
+			default:
+				usage();
+				exit(ARG_ERROR);
+		}
+	}
+	if (config.reusePort && config.backend != "coro" && config.backend != "epoll") {
+		std::cerr << "ERROR: --reuse-port goes with the coro and epoll backends" << std::endl;
+		exit(ARG_ERROR);
+	}
+	return optind;
+}
+
 std::string server::getArg(const char* arg)
 {
 	return arg != nullptr ? (const char*)arg : nullptr;
@@ -94,9 +302,47 @@ std::string server::checkPortNo(std::string arg)
 
 void server::usage()
 {
-	std::cerr << "Usage: ./server <PORT> <FILE-DIR>\n";
+	std::cerr << "Usage: ./server [OPTIONS] <PORT> <FILE-DIR>\n";
   	std::cerr << "  <PORT>      port number to listen on connections.\n";
   	std::cerr << "  <FILE-DIR>  directory name where to save the received files\n";
+  	std::cerr << "Options:\n";
+  	std::cerr << "  -b, --backend=coro|epoll|pool|uring  coroutines on one reactor per worker\n";
+  	std::cerr << "                                thread (default), an epoll event loop, a worker\n";
+  	std::cerr << "                                pool, or one io_uring per worker thread\n";
+  	std::cerr << "  -w, --workers=N               pool/uring/coro threads, or --reuse-port shards\n";
+  	std::cerr << "                                (default: one per core)\n";
+  	std::cerr << "  -q, --queue-depth=N           accepted sockets waiting for a worker (default 1024)\n";
+  	std::cerr << "  -s, --stats-interval=SEC      print buffer pool and worker pool stats every SEC\n";
+  	std::cerr << "  -i, --idle-timeout=TIME       drop a client that sends nothing for TIME (default " << TIMEOUT << "s)\n";
+  	std::cerr << "  -t, --transfer-timeout=TIME   drop any upload still running after TIME (default: none)\n";
+  	std::cerr << "                                TIME is in seconds, or with an ms, s or m suffix\n";
+  	std::cerr << "  -z, --splice                  receive with splice(2), copying only if unsupported\n";
+  	std::cerr << "  -B, --buffer-size=BYTES       receive buffer size, k/m suffixes ok (default 64k)\n";
+  	std::cerr << "  -C, --buffer-cache=BYTES      idle buffers kept for reuse (default 64m)\n";
+  	std::cerr << "  -m, --max-file-size=BYTES     refuse uploads larger than this (default: no limit)\n";
+  	std::cerr << "  -d, --dedup                   keep each distinct chunk once under FILE-DIR/chunks,\n";
+  	std::cerr << "                                each N.file holds the upload's chunk manifest\n";
+  	std::cerr << "  -c, --chunk-size=BYTES        average dedup chunk size (default 64k)\n";
+  	std::cerr << "  -W, --disk-threads=N          threads writing received data behind the\n";
+  	std::cerr << "                                network (default 2, 0: write as it arrives)\n";
+  	std::cerr << "  -F, --no-fsync                ack files without waiting for fdatasync\n";
+  	std::cerr << "  -D, --direct-io               write past the page cache with O_DIRECT where\n";
+  	std::cerr << "                                the data is block aligned (disk writers, dedup)\n";
+  	std::cerr << "  -S, --stats-socket=PATH       serve Prometheus metrics on a UNIX socket; they\n";
+  	std::cerr << "                                are also dumped to stderr on SIGUSR1\n";
+  	std::cerr << "  -r, --reuse-port              one SO_REUSEPORT listener and event loop per\n";
+  	std::cerr << "                                worker, each pinned to its own core (coro, epoll)\n";
+  	std::cerr << "  -l, --backlog=N               connections the kernel queues for accept\n";
+  	std::cerr << "                                (default 1024, capped by net.core.somaxconn)\n";
+  	std::cerr << "  -A, --defer-accept=SEC        hand over connections only once the client has\n";
+  	std::cerr << "                                sent something, or SEC passed (default 5, 0: off)\n";
+  	std::cerr << "  -N, --max-connections=N       clients served at once (default: no limit)\n";
+  	std::cerr << "  -Q, --when-full=queue|refuse  past the limit, leave clients in the listen queue\n";
+  	std::cerr << "                                (default) or turn them away with BUSY\n";
+  	std::cerr << "  -R, --client-rate=BYTES       receive rate per client address, per second\n";
+  	std::cerr << "  -G, --total-rate=BYTES        receive rate for the whole server, per second;\n";
+  	std::cerr << "                                the first burst of each file is exempt\n";
+  	std::cerr << "  -U, --rate-burst=BYTES        burst allowed by both rates (default 1m)\n";
 }
 
 void server::setupHints(struct addrinfo& hints) 
@@ -132,6 +378,13 @@ int server::createSocketBindToAddress(struct addrinfo* results)
     if (fd == -1)
       continue;
 
+    // every shard binds the same port; the kernel spreads clients over them
+    int one = 1;
+    if (config.reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+      perror("setsockopt");
+      exit(EXIT_FAILURE);
+    }
+
     if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
       int yes = 1;  // allow the port to be reused then move on.
       if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
@@ -154,169 +407,477 @@ int server::createSocketBindToAddress(struct addrinfo* results)
   return fd;
 }
 
-void server::initializeNetworkSettings()
+int server::openListener()
 {
 	// Stuff for getting address information
   struct addrinfo hints;
   memset(&hints, 0, sizeof(struct addrinfo));
   setupHints(hints);
   struct addrinfo* results = getAddrInfo(hints);
-  listen_fd = createSocketBindToAddress(results);
+  int fd = createSocketBindToAddress(results);
   freeaddrinfo(results); // we've bound, so we're done with this
 
-  if (listen(listen_fd, 1) == -1) {
+  // A burst of reconnects has to fit in the queue, or the SYNs past it are
+  // dropped and those clients sit out a retransmit timeout.
+  if (listen(fd, config.backlog) == -1) {
     perror("listen");
     exit(3);
   }
+
+  // Clients speak first, so nothing is lost by leaving a connection with the
+  // kernel until its header is in; the loops then never wake for a socket
+  // with nothing to read.
+  int secs = config.deferAcceptSecs;
+  if (secs > 0 && setsockopt(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) == -1)
+    perror("TCP_DEFER_ACCEPT");
+
+  // Every backend drains the listener until EAGAIN.
+  if (!setNonBlocking(fd)) {
+    perror("ERROR");
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+void server::initializeNetworkSettings()
+{
+  listen_fd = openListener();
 }
 
 int server::getListener() {	return listen_fd;	}
 
 std::string server::nextFilename()
 {
-  static unsigned short filenum = 0;
-  std::string prefix = "./";
-  const char* postfix = ".file";
-  return (prefix + filedir + std::to_string(++filenum) + postfix);
+  return FileNamer::shared()->next();
 }
 
-void server::handleConnection(int clientfd, std::string file)
+void server::handleConnection(int clientfd, std::function<std::string()> nextFilename,
+                              const ServerConfig& config)
 {
-   
-  std::cerr << "file = " << file << std::endl;
-  FILE* ofile = fopen(file.c_str(), "w");
-
-  // Keep track of progress
-  int bytesRead;
-  int bytesWritten;
-  int newCount = 0;
-  int totalBytesRead = 0;
-  int totalBytesWritten = 0;
-
-  while (true) {
-    char buf[CHUNK];
-    bzero(buf, CHUNK);
-
-    bytesRead = recv(clientfd, buf, CHUNK-1, MSG_DONTWAIT); // non-blocking
-
-    if (errno == EWOULDBLOCK) {
-      std::this_thread::sleep_for(std::chrono::seconds(1));
-      newCount++;
-      errno = 0;
-
-      if( newCount == TIMEOUT ) {
-        errno = ETIMEDOUT;
-        perror("ERROR");
-
-        if (totalBytesRead > 0) {
-          // flush contents of file
-          if (fclose(ofile) == 0) {
-            ofile = fopen(file.c_str(), "w");
-            const char *msg = "ERROR";
-            fwrite(msg, sizeof(char), sizeof msg, ofile);
-            break;
-          } else {
-            // TODO: handle--This shouldn't have happened and so errno is set
-            perror("ERROR:");
-            exit(EXIT_FAILURE);
-          }
-        } else {
-          std::cerr << "ERROR: No data sent from client.\n";
-        } // end if totalBytesRead
-        break; // out of transmission loop
-      } // end if TIMEOUT
-      continue;
-    } else {
-      errno = 0;    // reset so we don't misinterpret later
-      newCount = 0; 
-    }
+  if (!setNonBlocking(clientfd)) {
+    perror("ERROR");
+    close(clientfd);
+    Admission::leave();
+    return;
+  }
 
-    if ( bytesRead > 0 ) {
-      totalBytesRead += bytesRead;
-      bytesWritten = fwrite(buf, sizeof(char), bytesRead, ofile);
-      if (bytesWritten < 0) {
-        perror("ERROR");
+  // Same state machine the event loop drives, but this worker owns the
+  // socket and sleeps in poll() until it is readable or a deadline is due.
+  Connection conn(clientfd, nextFilename, config);
+  struct pollfd pfd;
+  pfd.fd = clientfd;
+  pfd.events = POLLIN;
+
+  while (conn._state != Connection::CLOSED) {
+    if (conn._state == Connection::THROTTLED) {
+      // deadlines are looked at again once it is back to waiting on the socket
+      poll(nullptr, 0, conn._throttleMillis);
+    } else if (conn._state == Connection::RECEIVING) {
+      int wait = conn.millisUntilDeadline(TimerWheel::nowMillis(), config);
+      int ready = wait > 0 ? poll(&pfd, 1, wait) : 0;
+      if (ready == 0) {
+        if (conn.millisUntilDeadline(TimerWheel::nowMillis(), config) > 0)
+          continue;
+        conn.onTimeout();
+        break;
+      } else if (ready == -1) {
+        if (errno == EINTR)
+          continue;
+        perror("poll");
         break;
       }
-      totalBytesWritten += bytesWritten;
-    } else if (bytesRead == 0) {
-      // eof reached and client closed cxn
-      break;
-    } else {
-      // bytes read
     }
+    conn.onReadable();
+  }
+}
+
+void server::reportStats()
+{
+  BufferPool& buffers = BufferPool::shared();
+  std::cerr << "buffers: size=" << buffers.bufferSize()
+            << " hits=" << buffers.hits() << " misses=" << buffers.misses()
+            << " outstanding=" << buffers.outstanding()
+            << " allocated=" << buffers.allocatedBytes()
+            << " high-water=" << buffers.highWaterBytes() << std::endl;
+
+  ChunkStore* store = ChunkStore::shared();
+  if (store != nullptr) {
+    uint64_t stored = store->storedBytes();
+    std::cerr << "dedup: logical=" << store->logicalBytes() << " stored=" << stored
+              << " chunks=" << store->chunks() << " new=" << store->newChunks();
+    if (stored > 0)
+      std::cerr << " ratio=" << (double)store->logicalBytes() / stored << "x";
+    std::cerr << std::endl;
+  }
+
+  DiskWriter* writer = DiskWriter::shared();
+  if (writer != nullptr) {
+    std::cerr << "disk: threads=" << writer->threads() << " buffers=" << writer->buffers()
+              << " bytes=" << writer->bytes() << " write-ms=" << writer->writeMicros() / 1000
+              << " stalls=" << writer->stalls() << std::endl;
+  }
+
+  Committer& committer = Committer::shared();
+  if (committer.batches() > 0 || committer.acks() > 0) {
+    std::cerr << "commit: files=" << committer.files() << " batches=" << committer.batches();
+    if (committer.batches() > 0)
+      std::cerr << " avg-batch=" << (double)committer.files() / committer.batches()
+                << " max-batch=" << committer.maxBatch()
+                << " fsync-avg-us=" << committer.syncMicros() / committer.batches();
+    std::cerr << " acks=" << committer.acks();
+    if (committer.acks() > 0)
+      std::cerr << " ack-avg-us=" << committer.ackMicros() / committer.acks()
+                << " ack-max-us=" << committer.maxAckMicros();
+    std::cerr << std::endl;
+  }
+
+  if (pool != nullptr) {
+    std::cerr << "pool: queued=" << pool->queueDepth() << "/" << pool->queueCapacity()
+              << " busy=" << pool->busyWorkers() << "/" << pool->workerCount()
+              << " utilization=" << (int)(pool->utilization() * 100) << "%"
+              << " completed=" << pool->completed() << std::endl;
+  }
+}
+
+void server::startStatsReporter()
+{
+  if (config.statsInterval == 0)
+    return;
+  std::thread([this]() {
+    for (;;) {
+      std::this_thread::sleep_for(std::chrono::seconds(config.statsInterval));
+      reportStats();
+    }
+  }).detach();
+}
+
+void server::exportStats(std::ostream& out)
+{
+  Metrics::render(out);
+
+  // the subsystems keep their own totals; pass them on as they are
+  auto metric = [&out](const char* name, const char* type, const char* help, uint64_t value) {
+    out << "# HELP " << name << " " << help << "\n# TYPE " << name << " " << type << "\n"
+        << name << " " << value << "\n";
+  };
+
+  BufferPool& buffers = BufferPool::shared();
+  metric("fileserver_buffer_pool_hits_total", "counter", "Buffers handed out from the cache.",
+         buffers.hits());
+  metric("fileserver_buffer_pool_misses_total", "counter", "Buffers that had to be allocated.",
+         buffers.misses());
+  metric("fileserver_buffer_pool_outstanding", "gauge", "Buffers lent out now.",
+         buffers.outstanding());
+  metric("fileserver_buffer_pool_allocated_bytes", "gauge", "Bytes of buffers allocated now.",
+         buffers.allocatedBytes());
+
+  DiskWriter* writer = DiskWriter::shared();
+  if (writer != nullptr) {
+    metric("fileserver_disk_written_bytes_total", "counter", "Bytes written by the disk writers.",
+           writer->bytes());
+    metric("fileserver_disk_stalls_total", "counter", "Times a connection waited on a full ring.",
+           writer->stalls());
+  }
+
+  Committer& committer = Committer::shared();
+  metric("fileserver_commit_batches_total", "counter", "Group commits made.", committer.batches());
+  metric("fileserver_commit_files_total", "counter", "Files synced by group commits.",
+         committer.files());
+
+  if (pool != nullptr) {
+    metric("fileserver_pool_queued", "gauge", "Accepted sockets waiting for a worker.",
+           pool->queueDepth());
+    metric("fileserver_pool_busy_workers", "gauge", "Workers serving a connection.",
+           pool->busyWorkers());
+  }
+}
+
+void server::startStatsSocket()
+{
+  if (config.statsSocket.empty())
+    return;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (config.statsSocket.size() >= sizeof(addr.sun_path)) {
+    std::cerr << "ERROR: stats socket path is too long" << std::endl;
+    exit(ARG_ERROR);
   }
-  
-  fclose(ofile);
-  close(clientfd);
+  strcpy(addr.sun_path, config.statsSocket.c_str());
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  unlink(addr.sun_path);	// left over from a server that didn't shut down cleanly
+  if (fd == -1 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 16) == -1) {
+    perror("stats socket");
+    exit(EXIT_FAILURE);
+  }
+
+  // One scrape at a time is plenty. Whoever connects gets the metrics and
+  // the socket closed behind them; an HTTP request (curl --unix-socket) gets
+  // them as an HTTP response.
+  std::thread([this, fd]() {
+    for (;;) {
+      int clientfd = accept(fd, nullptr, nullptr);
+      if (clientfd == -1) {
+        if (errno != EINTR && errno != ECONNABORTED)
+          perror("accept");
+        continue;
+      }
+
+      char request[512];
+      ssize_t n = 0;
+      struct pollfd pfd;
+      pfd.fd = clientfd;
+      pfd.events = POLLIN;
+      if (poll(&pfd, 1, 100) == 1)
+        n = recv(clientfd, request, sizeof(request), 0);
+
+      std::ostringstream body;
+      exportStats(body);
+      std::string reply = body.str();
+      if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+        reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+                + std::to_string(reply.size()) + "\r\n\r\n" + reply;
+      }
+      for (size_t sent = 0; sent < reply.size();) {
+        ssize_t w = send(clientfd, reply.data() + sent, reply.size() - sent, MSG_NOSIGNAL);
+        if (w == -1 && errno == EINTR)
+          continue;
+        if (w <= 0)
+          break;
+        sent += w;
+      }
+      close(clientfd);
+    }
+  }).detach();
 }
 
-void server::pollFileDescriptors(struct PollingInfo info)
+void server::startStatsSignal()
 {
-  int select_status = select(info.nfds, info.readfds, info.writefds, info.exceptfds, info.timeout);
-  if (select_status == -1) {
-    perror("Select");
-    exit(-10);
-  } else if (select_status == 0) {
-    // TODO: update this with correct handling
-    // We should never get here, but if we do, let console know.
-    std::cerr << "ERROR: TIMEOUT occured on main thread" << std::endl;
-    // close (listen_fd);
-    exit(-1);
+  // Blocked here, before any other thread exists, so every thread inherits
+  // the mask and the signal only ever reaches the sigwait() below; the dump
+  // then runs on an ordinary thread rather than in a signal handler.
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  std::thread([this, set]() {
+    for (;;) {
+      int signum;
+      if (sigwait(&set, &signum) != 0)
+        continue;
+      std::ostringstream out;
+      exportStats(out);
+      std::cerr << out.str() << std::flush;
+    }
+  }).detach();
+}
+
+void server::runPool()
+{
+  DiskWriter::configure(config.diskThreads);
+  unsigned workers = config.workers > 0 ? config.workers : ThreadPool::defaultWorkers();
+  ThreadPool workerPool(workers, config.queueDepth, [this](int clientfd) {
+    handleConnection(clientfd, std::bind(&server::nextFilename, this), config);
+  });
+  pool = &workerPool;
+  startStatsReporter();
+
+  struct pollfd pfd;
+  pfd.fd = getListener();
+  pfd.events = POLLIN;
+  for (;;) {
+    bool admitted = Admission::enter();
+    if (!admitted && !Admission::refusing()) {
+      // at the limit; the rest wait in the listen queue
+      Admission::waitForRoom(ADMISSION_RETRY_MS);
+      continue;
+    }
+
+    int clientfd = acceptClient(pfd.fd);
+    if (clientfd == -1) {
+      if (admitted)
+        Admission::leave();
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+        perror("poll");
+    } else if (admitted) {
+      workerPool.submit(clientfd);
+    } else {
+      shedConnection(clientfd);
+    }
   }
 }
 
 int server::acceptClient(int socket)
 {
-  struct sockaddr_in clientAddr;
+  struct sockaddr_storage clientAddr;
   socklen_t clientAddrSize = sizeof(clientAddr);
-  int clientfd = accept(socket, (struct sockaddr*)&clientAddr, &clientAddrSize);
+  int clientfd = accept4(socket, (struct sockaddr*)&clientAddr, &clientAddrSize, SOCK_CLOEXEC);
   if (clientfd == -1) {
-    perror("ERROR");
-    // TODO update this with correct handling
-    exit(-1);
+    if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK)
+      perror("accept");
+    return clientfd;
   }
-
+  recordAcceptWait(clientfd);
   return clientfd;
 }
 
-bool desiredFDIsSet(int testfd, int requiredFD, fd_set* fdset)
+bool server::runUring()
+{
+  unsigned threads = config.workers > 0 ? config.workers : ThreadPool::defaultWorkers();
+  std::vector<UringLoop*> loops;
+  for (unsigned i = 0; i < threads; i++) {
+    UringLoop* loop = new UringLoop(getListener(), config, std::bind(&server::nextFilename, this));
+    if (!loop->init()) {
+      perror("io_uring");
+      delete loop;
+      for (UringLoop* l : loops)
+        delete l;
+      return false;
+    }
+    loops.push_back(loop);
+  }
+
+  // Every ring arms its own multishot accept on the shared listener and the
+  // kernel hands each new client to one of them.
+  std::vector<std::thread> others;
+  for (unsigned i = 1; i < threads; i++)
+    others.push_back(std::thread(&UringLoop::run, loops[i]));
+  loops[0]->run();
+  for (std::thread& other : others)
+    other.join();
+  return true;
+}
+
+// The CPUs this process may run on, in order.
+static std::vector<int> allowedCpus()
+{
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (CPU_ISSET(cpu, &set))
+        cpus.push_back(cpu);
+  }
+  if (cpus.empty())
+    cpus.push_back(0);
+  return cpus;
+}
+
+static void pinThread(int cpu)
 {
-  return (FD_ISSET(testfd, fdset) && (testfd == requiredFD));
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (rc != 0) {
+    // still works, just without the cache locality
+    errno = rc;
+    perror("pthread_setaffinity_np");
+  }
+}
+
+void server::runCoro()
+{
+  // Like the rings, every thread's accept coroutine waits on the shared
+  // listener and whoever gets a client serves it to the end. With
+  // --reuse-port each thread gets a listener of its own and stays on one
+  // core, as the epoll shards do.
+  std::vector<int> cpus = allowedCpus();
+  unsigned threads = config.workers > 0 ? config.workers
+                     : config.reusePort ? cpus.size() : ThreadPool::defaultWorkers();
+  std::vector<CoroLoop*> loops;
+  for (unsigned i = 0; i < threads; i++) {
+    int listenfd = config.reusePort && i > 0 ? openListener() : getListener();
+    loops.push_back(new CoroLoop(listenfd, config, std::bind(&server::nextFilename, this)));
+  }
+
+  auto runLoop = [this, &cpus, &loops](unsigned i) {
+    if (config.reusePort)
+      pinThread(cpus[i % cpus.size()]);
+    loops[i]->run();
+  };
+  std::vector<std::thread> others;
+  for (unsigned i = 1; i < threads; i++)
+    others.push_back(std::thread(runLoop, i));
+  runLoop(0);
+  for (std::thread& other : others)
+    other.join();
+}
+
+void server::runSharded()
+{
+  // A listener per shard, all on the same port. The kernel hashes each new
+  // connection to one of them, so accepting scales with the shards, and a
+  // connection is served start to finish by the loop that accepted it, on
+  // that loop's core.
+  std::vector<int> cpus = allowedCpus();
+  unsigned shards = config.workers > 0 ? config.workers : cpus.size();
+  std::vector<int> listeners;
+  listeners.push_back(getListener());
+  for (unsigned i = 1; i < shards; i++)
+    listeners.push_back(openListener());
+
+  std::vector<std::thread> others;
+  for (unsigned i = 1; i < shards; i++)
+    others.push_back(std::thread(&server::runShard, this, listeners[i], cpus[i % cpus.size()]));
+  runShard(listeners[0], cpus[0]);
+  for (std::thread& other : others)
+    other.join();
+}
+
+void server::runShard(int listenfd, int cpu)
+{
+  pinThread(cpu);
+  EventLoop loop(listenfd, config, std::bind(&server::nextFilename, this));
+  loop.run();
 }
 
 void server::run()
 {
+  startStatsSignal();
+
   // open connection and listen
   initializeNetworkSettings();
+  BufferPool::configure(config.bufferSize, config.bufferCacheBytes / config.bufferSize);
+  TransferRegistry::shared().setLinger(config.idleTimeoutMs);
+  TransferRegistry::shared().setStatePrefix("./" + filedir + "resume-");
+  if (config.dedup)
+    ChunkStore::configure("./" + filedir + "chunks/", config.chunkSize, config.directIo);
+  Committer::configure(config.fsync);
+  FileNamer::configure("./" + filedir);
+  Admission::configure(config);
+  startStatsSocket();
+
+  if (config.backend == "pool") {
+    runPool();
+    return;
+  }
 
-  // Get ready to work. 
-  fd_set master;
-  FD_ZERO(&master);
-  int listen_fd = getListener();
-  FD_SET(listen_fd, &master);
+  startStatsReporter();
 
-  // Main accept/dispatch loop
-  for (;;) {
-    // Always make a copy. Select alters readfd
-    fd_set readfd;
-    FD_ZERO(&readfd);
-    readfd = master;
-    
-    struct PollingInfo fdinfo(listen_fd+1, &readfd, nullptr, nullptr, nullptr);
-    pollFileDescriptors(fdinfo);
-
-    // Loop through and find ready sockets
-    for(int i = 0; i < listen_fd+1; i++) {
-      if( desiredFDIsSet(i, listen_fd, &readfd) ) {
-        int clientfd = acceptClient(listen_fd);
-        std::string file = nextFilename();
-        std::thread t;
-        t = std::thread(handleConnection, clientfd, file);
-        t.detach();
-      }
-    }
+  if (config.backend == "uring") {
+    if (runUring())
+      return;
+    std::cerr << "ERROR: io_uring unavailable, falling back to epoll" << std::endl;
+  }
+
+  // From here on the loops drive the listener and every client socket;
+  // the disk writers take the file side off their hands.
+  DiskWriter::configure(config.diskThreads);
+  if (config.backend == "coro") {
+    runCoro();
+    return;
+  }
+  if (config.reusePort) {
+    runSharded();
+    return;
   }
+  EventLoop loop(getListener(), config, std::bind(&server::nextFilename, this));
+  loop.run();
 }
 
 int
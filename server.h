@@ -1,27 +1,12 @@
 #ifndef _SERVER
 #define _SERVER
 
+#include <functional>
+#include <iosfwd>
 #include <string>
 
-struct PollingInfo {
-	int nfds;
-	fd_set* readfds;
-	fd_set* writefds;
-	fd_set* exceptfds;
-	struct timeval* timeout;
-
-	PollingInfo(int n, 
-							fd_set* rfds, 
-							fd_set* wfds, 
-							fd_set* efds, 
-							struct timeval* to) 
-							: 
-							nfds(n), 
-							readfds(rfds), 
-							writefds(wfds), 
-							exceptfds(efds), 
-							timeout(to) {}
-};
+#include "ServerConfig.h"
+#include "ThreadPool.h"
 
 class server
 {
@@ -29,23 +14,37 @@ private:
 	std::string filedir;
 	std::string port;
 	int listen_fd;
+	ServerConfig config;
+	ThreadPool* pool;		// set while the pool backend runs, for stats
 
 protected:
 	static void sigHandler(int signum);
+	int parseOptions(int argc, char* argv[]);
 	std::string getArg(const char* arg);
 	std::string checkPortNo(std::string arg);
 
 	void setupHints(struct addrinfo& hints);
 	struct addrinfo* getAddrInfo(struct addrinfo& hints);
 	int createSocketBindToAddress(struct addrinfo* results);
+	int openListener();
 	void initializeNetworkSettings();
 
 	int getListener();
-	void pollFileDescriptors(struct PollingInfo info);
 	int acceptClient(int socket);
 	std::string nextFilename();
 	bool timedOut(ushort secondsAsleep);
-	static void handleConnection(int clientfd, std::string file);
+	static void handleConnection(int clientfd, std::function<std::string()> nextFilename,
+	                             const ServerConfig& config);
+	void reportStats();
+	void startStatsReporter();
+	void exportStats(std::ostream& out);
+	void startStatsSocket();
+	void startStatsSignal();
+	void runPool();
+	bool runUring();
+	void runCoro();
+	void runSharded();
+	void runShard(int listenfd, int cpu);
 
 public:
 	server();